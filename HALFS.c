@@ -4,10 +4,31 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 char *strdup(const char *str);
 char *strndup(const char *str, size_t n);
 
+/* Size of arena chunks; bigger objects get their own chunk */
+#define HALFS_CHUNK_SIZE 16384
+
+/* Alignment of objects in the arena */
+#define ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+struct HALFSChunk {
+	struct HALFSChunk *next;
+	size_t used, size;
+	void *data[]; /* Aligned for pointers and size_t */
+};
+
+struct HALFSArena {
+	struct HALFSChunk *chunks;
+	const char **names; /* Interned names: open addressing hash table */
+	size_t n_names, names_size;
+	HALFS **grafts; /* Trees added with HALFS_addChild */
+	size_t n_grafts;
+};
+
 int HALFS_default_trunc(HALConnection *conn, unsigned char id)
 {
     return 0;
@@ -23,12 +44,104 @@ int HALFS_default_write(HALConnection *conn, unsigned char id, const char *buf,
     return 0;
 }
 
-HALFS *HALFS_create(const char *name)
+static void *arena_alloc(HALFSArena *arena, size_t size)
+{
+	size = ALIGN(size);
+	struct HALFSChunk *chunk = arena->chunks;
+	if (! chunk || chunk->size - chunk->used < size){
+		size_t chunk_size = (size > HALFS_CHUNK_SIZE) ? size : HALFS_CHUNK_SIZE;
+		struct HALFSChunk *fresh = malloc(sizeof(struct HALFSChunk) + chunk_size);
+		if (! fresh)
+			return NULL;
+		fresh->used = 0;
+		fresh->size = chunk_size;
+		if (chunk && size > HALFS_CHUNK_SIZE){
+			/* Keep filling the current chunk */
+			fresh->next = chunk->next;
+			chunk->next = fresh;
+		} else {
+			fresh->next = chunk;
+			arena->chunks = fresh;
+		}
+		chunk = fresh;
+	}
+	void *res = ((char *) chunk->data) + chunk->used;
+	chunk->used += size;
+	return res;
+}
+
+static void arena_free(HALFSArena *arena)
+{
+	free(arena->grafts);
+	free(arena->names);
+	for (struct HALFSChunk *it=arena->chunks; it != NULL;){
+		struct HALFSChunk *next = it->next;
+		free(it);
+		it = next;
+	}
+	free(arena);
+}
+
+static size_t name_hash(const char *name, size_t len)
 {
-	HALFS *res = calloc(1, sizeof(HALFS));
+	/* FNV-1a */
+	size_t h = 2166136261u;
+	for (size_t i=0; i<len; i++){
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Interned copy of name[0:len] */
+static const char *intern(HALFSArena *arena, const char *name, size_t len)
+{
+	if (2*(arena->n_names+1) > arena->names_size){
+		size_t size = arena->names_size ? 2*arena->names_size : 64;
+		const char **names = calloc(size, sizeof(char*));
+		if (! names)
+			return NULL;
+		for (size_t i=0; i<arena->names_size; i++){
+			const char *it = arena->names[i];
+			if (it){
+				size_t j = name_hash(it, strlen(it)) & (size-1);
+				while (names[j])
+					j = (j+1) & (size-1);
+				names[j] = it;
+			}
+		}
+		free(arena->names);
+		arena->names = names;
+		arena->names_size = size;
+	}
+
+	size_t i = name_hash(name, len) & (arena->names_size-1);
+	while (arena->names[i]){
+		const char *it = arena->names[i];
+		if (strncmp(it, name, len) == 0 && it[len] == '\0')
+			return it;
+		i = (i+1) & (arena->names_size-1);
+	}
+
+	char *res = arena_alloc(arena, len+1);
 	if (! res)
 		return NULL;
-	res->name = (const char *) strdup(name);
+	memcpy(res, name, len);
+	res[len] = '\0';
+	arena->names[i] = res;
+	arena->n_names++;
+	return res;
+}
+
+static HALFS *HALFS_createIn(HALFSArena *arena, const char *name, size_t len)
+{
+	HALFS *res = arena_alloc(arena, sizeof(HALFS));
+	if (! res)
+		return NULL;
+	memset(res, 0, sizeof(HALFS));
+	res->name = intern(arena, name, len);
+	if (! res->name)
+		return NULL;
+	res->arena = arena;
 	res->ops.size = 0;
 	res->ops.read = HALFS_default_read;
 	res->ops.write = HALFS_default_write;
@@ -36,55 +149,109 @@ HALFS *HALFS_create(const char *name)
 	return res;
 }
 
-static HALFS *HALFS_createFromSubstring(const char *name, size_t len)
+HALFS *HALFS_create(const char *name)
 {
-	char buf[128];
-	strncpy(buf, name, len);
-	buf[len] = '\0';
-	return HALFS_create(buf);
+	HALFSArena *arena = calloc(1, sizeof(HALFSArena));
+	if (! arena)
+		return NULL;
+	HALFS *res = HALFS_createIn(arena, name, strlen(name));
+	if (! res)
+		arena_free(arena);
+	return res;
 }
 
 void HALFS_destroy(HALFS *self)
 {
-	for (HALFS *it=self->first_child; it != NULL;){
-		HALFS *next = it->next_sibling;
-		HALFS_destroy(it);
-		it = next;
+	HALFSArena *arena = self->arena;
+	for (size_t i=0; i<arena->n_grafts; i++){
+		HALFS_destroy(arena->grafts[i]);
 	}
-	free((void*)self->name);
-	free(self);
+	arena_free(arena);
 }
 
-void HALFS_addChild(HALFS *self, HALFS *child)
+/* Compare node name to name[0:len] */
+static int name_cmp(const char *node_name, const char *name, size_t len)
 {
-	HALFS **anchor = &(self->first_child);
-	while (*anchor){
-		anchor = &((*anchor)->next_sibling);
+	int r = strncmp(node_name, name, len);
+	if (r == 0 && node_name[len] != '\0')
+		return 1;
+	return r;
+}
+
+/* Index of child named name[0:len], or where to insert it (*found = 0) */
+static size_t HALFS_bisect(HALFS *self, const char *name, size_t len, int *found)
+{
+	size_t lo = 0, hi = self->n_children;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo)/2;
+		int r = name_cmp(self->children[mid]->name, name, len);
+		if (r == 0){
+			*found = 1;
+			return mid;
+		}
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	*anchor = child;
+	*found = 0;
+	return lo;
+}
+
+/* Insert child at index i of the children of self */
+static int HALFS_insertAt(HALFS *self, size_t i, HALFS *child)
+{
+	if (self->n_children == self->children_size){
+		/* Old array is left in the arena */
+		size_t size = self->children_size ? 2*self->children_size : 4;
+		HALFS **children = arena_alloc(self->arena, size*sizeof(HALFS*));
+		if (! children)
+			return 0;
+		if (self->n_children)
+			memcpy(children, self->children, self->n_children*sizeof(HALFS*));
+		self->children = children;
+		self->children_size = size;
+	}
+	memmove(self->children+i+1, self->children+i, (self->n_children-i)*sizeof(HALFS*));
+	self->children[i] = child;
+	self->n_children++;
+	return 1;
+}
+
+void HALFS_addChild(HALFS *self, HALFS *child)
+{
+	HALFSArena *arena = self->arena;
+	int found;
+	size_t i = HALFS_bisect(self, child->name, strlen(child->name), &found);
+	if (found)
+		return;
+	HALFS **grafts = realloc(arena->grafts, (arena->n_grafts+1)*sizeof(HALFS*));
+	if (! grafts)
+		return;
+	arena->grafts = grafts;
+	if (HALFS_insertAt(self, i, child))
+		arena->grafts[arena->n_grafts++] = child;
 }
 
 HALFS *HALFS_find(HALFS *root, const char *full_path)
 {
 	assert(full_path[0] == '/');
-	const char *next_part = strchr(full_path+1, '/');
-
-	if (next_part == NULL)
-		next_part = full_path+strlen(full_path);
+	HALFS *cur = root;
+	const char *part = full_path+1;
 
-	if (full_path[1] == '\0')
-		return root;
+	while (*part != '\0'){
+		const char *next_part = strchr(part, '/');
+		if (next_part == NULL)
+			next_part = part+strlen(part);
 
-	HALFS *cur = root->first_child;
-	while (cur){
-		if (strncmp(cur->name, full_path+1, next_part-full_path-1) == 0){
-			if (*next_part == '\0')
-				return cur;
-			return HALFS_find(cur, next_part);
-		}
-		cur = cur->next_sibling;
+		int found;
+		size_t i = HALFS_bisect(cur, part, next_part-part, &found);
+		if (! found)
+			return NULL;
+		cur = cur->children[i];
+		part = (*next_part == '/') ? next_part+1 : next_part;
 	}
-	return NULL;
+	return cur;
 }
 
 HALFS *HALFS_findParent(HALFS *root, const char *full_path)
@@ -105,41 +272,38 @@ HALFS *HALFS_findParent(HALFS *root, const char *full_path)
 HALFS *HALFS_insert(HALFS *root, const char *full_path)
 {
 	assert(full_path[0] == '/');
-	const char *next_part = strchr(full_path+1, '/');
-
-	if (next_part == NULL)
-		next_part = full_path+strlen(full_path);
-
-	if (full_path[1] == '\0')
-		return root;
-
-	HALFS **anchor = &(root->first_child);
-	HALFS *cur = root->first_child;
-	while (cur){
-		if (strncmp(cur->name, full_path+1, next_part-full_path-1) == 0){
-			if (*next_part == '\0')
-				return cur; /* Element already exists */
-			else
-				return HALFS_insert(cur, next_part);
+	HALFS *cur = root;
+	const char *part = full_path+1;
+
+	while (*part != '\0'){
+		const char *next_part = strchr(part, '/');
+		if (next_part == NULL)
+			next_part = part+strlen(part);
+
+		int found;
+		size_t i = HALFS_bisect(cur, part, next_part-part, &found);
+		if (! found){
+			HALFS *child = HALFS_createIn(cur->arena, part, next_part-part);
+			if (! child || ! HALFS_insertAt(cur, i, child))
+				return NULL;
 		}
-		anchor = &(cur->next_sibling);
-		cur = cur->next_sibling;
+		cur = cur->children[i];
+		part = (*next_part == '/') ? next_part+1 : next_part;
 	}
-
-	*anchor = HALFS_createFromSubstring(full_path+1, next_part-full_path-1);
-	if (*next_part != '\0')
-		return HALFS_insert(*anchor, next_part);
-	return *anchor;
+	return cur;
 }
 
 int HALFS_mode(HALFS *node)
 {
+	/* An explicit mode wins; otherwise derive it from operations */
 	int mode = node->ops.mode;
+	if (mode & 0777)
+		return mode;
 	if (node->ops.read != HALFS_default_read)
 		mode |= 0444;
 	if (node->ops.write != HALFS_default_write)
 		mode |= 0222;
-	if (node->first_child)
+	if (node->n_children)
 		mode |= 0555;
 	return mode;
 }
@@ -10,23 +10,39 @@ extern struct fuse_operations HALFS_ops;
 
 typedef struct HALFS_t HALFS;
 
+/* Memory of a tree: nodes, children arrays and interned names */
+typedef struct HALFSArena HALFSArena;
+
 struct HALFS_t {
-	const char *name;
-	HALFS *first_child, *next_sibling;
+	const char *name; /* Interned: shared by nodes with the same name */
+	HALFS **children; /* Sorted by name */
+	size_t n_children;
+	size_t children_size;
+	HALFSArena *arena;
     unsigned char id;
     struct {
         const char *target; /* Target for symlinks */
         int mode; /* File mode */
         size_t size;
+        unsigned char watch; /* Type of resource whose changes wake up pollers (0: none) */
+        unsigned char snapshot; /* Read whole (up to size) once per open; reads are served from it */
         int (* trunc)(HALConnection *, unsigned char); /* File truncate */
         int (* read)(HALConnection *, unsigned char, char *, size_t, off_t); /* File read */
         int (* write)(HALConnection *, unsigned char, const char *, size_t, off_t); /* File write */
     } ops;
 };
 
+/*!
+ *  Create the root of a tree. Nodes inserted below it are allocated in its
+ *  arena, and released all at once by HALFS_destroy(root). Nodes never move.
+ */
 HALFS *HALFS_create(const char *name);
 void HALFS_destroy(HALFS *self);
 
+/*!
+ *  Graft tree child (created with HALFS_create) below self; it is destroyed
+ *  with self.
+ */
 void HALFS_addChild(HALFS *self, HALFS *child);
 
 HALFS *HALFS_find(HALFS *root, const char *full_path);
@@ -0,0 +1,244 @@
+#include "HALMsg.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Bulk kernels work on 16 bytes (SSE2) or 8 bytes (word at a time) at once.
+   Build with -DHALMSG_NO_SIMD to only use the portable ones. */
+#if defined(__SSE2__) && ! defined(HALMSG_NO_SIMD)
+#include <emmintrin.h>
+#define HALMSG_SSE2
+#endif
+
+#define ONES 0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+/* Non zero if any byte of v is equal to c */
+static inline uint64_t has_byte(uint64_t v, unsigned char c)
+{
+    uint64_t x = v ^ (ONES * c);
+    return (x - ONES) & ~x & HIGHS;
+}
+
+static inline int is_special(unsigned char c)
+{
+    return c == HALMSG_SYNC || c == HALMSG_ESC;
+}
+
+/* Number of leading bytes that are neither SYNC nor ESC */
+static inline size_t clean_run(const unsigned char *bytes, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HALMSG_SSE2
+    const __m128i sync = _mm_set1_epi8((char) HALMSG_SYNC);
+    const __m128i esc = _mm_set1_epi8((char) HALMSG_ESC);
+    for (; i+16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes+i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sync),
+                                                  _mm_cmpeq_epi8(v, esc)));
+        if (mask){
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i+8 <= n; i += 8){
+        uint64_t v;
+        memcpy(&v, bytes+i, 8);
+        if (has_byte(v, HALMSG_SYNC) | has_byte(v, HALMSG_ESC)){
+            break;
+        }
+    }
+    while (i < n && ! is_special(bytes[i])){
+        i++;
+    }
+    return i;
+}
+
+unsigned char HALMsg_sum(const unsigned char *bytes, size_t n)
+{
+    size_t i = 0;
+    uint64_t res = 0;
+
+#ifdef HALMSG_SSE2
+    /* psadbw against 0 sums each 8 bytes half in a 64 bits lane */
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i+16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes+i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    res += (uint64_t) _mm_cvtsi128_si64(acc);
+    res += (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+
+    /* Even and odd bytes summed in 16 bits lanes; flushed before they
+       could overflow */
+    while (i+8 <= n){
+        uint64_t even = 0, odd = 0;
+        for (size_t j=0; j<256 && i+8 <= n; j++, i += 8){
+            uint64_t v;
+            memcpy(&v, bytes+i, 8);
+            even += v & 0x00ff00ff00ff00ffull;
+            odd += (v >> 8) & 0x00ff00ff00ff00ffull;
+        }
+        for (int lane=0; lane<64; lane += 16){
+            res += ((even >> lane) & 0xffff) + ((odd >> lane) & 0xffff);
+        }
+    }
+
+    for (; i<n; i++){
+        res += bytes[i];
+    }
+    return (unsigned char) res;
+}
+
+/* Copy byte c in dest, escaped if needed; return number of bytes written */
+static inline size_t escape_byte(unsigned char c, unsigned char *dest)
+{
+    if (is_special(c)){
+        dest[0] = HALMSG_ESC;
+        dest[1] = c;
+        return 2;
+    }
+    dest[0] = c;
+    return 1;
+}
+
+size_t HALMsg_encode(const HALMsg *msg, unsigned char *dest)
+{
+    const unsigned char *bytes = (const unsigned char *) msg;
+    size_t nbytes = ((size_t) msg->len) + 5;
+    size_t n = 0, i = 0;
+
+    /* 3 SYNCs bytes (prelude) */
+    dest[n++] = HALMSG_SYNC;
+    dest[n++] = HALMSG_SYNC;
+    dest[n++] = HALMSG_SYNC;
+
+    /* Message itself, escaping ESC and SYNC; blocks without any of them
+       are copied at once */
+#ifdef HALMSG_SSE2
+    const __m128i sync = _mm_set1_epi8((char) HALMSG_SYNC);
+    const __m128i esc = _mm_set1_epi8((char) HALMSG_ESC);
+    for (; i+16 <= nbytes; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes+i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sync),
+                                                           _mm_cmpeq_epi8(v, esc)));
+        if (mask == 0){
+            _mm_storeu_si128((__m128i *) (dest+n), v);
+            n += 16;
+        } else {
+            for (size_t j=0; j<16; j++){
+                dest[n] = HALMSG_ESC;
+                n += (mask >> j) & 1;
+                dest[n++] = bytes[i+j];
+            }
+        }
+    }
+#endif
+    for (; i+8 <= nbytes; i += 8){
+        uint64_t v;
+        memcpy(&v, bytes+i, 8);
+        if (has_byte(v, HALMSG_SYNC) | has_byte(v, HALMSG_ESC)){
+            for (size_t j=0; j<8; j++){
+                n += escape_byte(bytes[i+j], dest+n);
+            }
+        } else {
+            memcpy(dest+n, &v, 8);
+            n += 8;
+        }
+    }
+    for (; i<nbytes; i++){
+        n += escape_byte(bytes[i], dest+n);
+    }
+
+    return n;
+}
+
+void HALDecoder_init(HALDecoder *dec, HALMsg *msg)
+{
+    dec->msg = msg;
+    dec->pos = 0;
+    dec->syncs = 0;
+    dec->in_msg = 0;
+    dec->escaped = 0;
+}
+
+HALDecoderRes HALDecoder_feed(HALDecoder *dec, const unsigned char *bytes, size_t len, size_t *consumed)
+{
+    size_t i = 0;
+    HALDecoderRes res = HALDEC_INCOMPLETE;
+
+    /* Header just decoded, and there is no body */
+    if (dec->in_msg && dec->pos == 5 && dec->msg->len == 0){
+        goto complete;
+    }
+
+    while (i < len){
+        unsigned char c = bytes[i++];
+
+        if (c == HALMSG_SYNC && ! dec->escaped){
+            dec->syncs++;
+            if (dec->in_msg && dec->pos > 0){
+                /* SYNC in the middle of a message */
+                dec->in_msg = 0;
+                dec->pos = 0;
+                res = HALDEC_BADSYNC;
+                break;
+            }
+            if (dec->syncs >= 3){
+                dec->in_msg = 1;
+            }
+            continue;
+        }
+
+        dec->syncs = 0;
+        if (! dec->in_msg){
+            continue;
+        }
+        if (c == HALMSG_ESC && ! dec->escaped){
+            dec->escaped = 1;
+            continue;
+        }
+        dec->escaped = 0;
+
+        ((unsigned char *) dec->msg)[dec->pos++] = c;
+
+        /* In body: copy runs of clean bytes and escaped bytes in bulk, up
+           to the next SYNC (or the end of input or message) */
+        if (dec->pos > 5){
+            unsigned char *dest = (unsigned char *) dec->msg;
+            size_t end = 5 + (size_t) dec->msg->len;
+            while (dec->pos < end && i < len){
+                if (bytes[i] == HALMSG_ESC && i+1 < len){
+                    dest[dec->pos++] = bytes[i+1];
+                    i += 2;
+                } else if (! is_special(bytes[i])){
+                    size_t run = clean_run(bytes+i, (len-i < end-dec->pos) ? len-i : end-dec->pos);
+                    memcpy(dest + dec->pos, bytes+i, run);
+                    dec->pos += run;
+                    i += run;
+                } else {
+                    break;
+                }
+            }
+        }
+        if (dec->pos == 5){
+            res = HALDEC_HEADER;
+            break;
+        }
+        if (dec->pos > 5 && dec->pos == 5 + (size_t) dec->msg->len){
+            goto complete;
+        }
+    }
+
+    *consumed = i;
+    return res;
+
+complete:
+    dec->in_msg = 0;
+    dec->pos = 0;
+    *consumed = i;
+    return (HALMsg_checksum(dec->msg) == dec->msg->chk) ? HALDEC_COMPLETE : HALDEC_BADCHK;
+}
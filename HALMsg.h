@@ -18,6 +18,11 @@ typedef enum {
     ANIMATION_PLAY='P',
     RGB='R',
 
+    FEATURES='+',
+    MULTI='M',
+    BAUDRATE='B',
+    ANIMATION_PACKED='K',
+
     PARAM_CHANGE=0x80,
     PARAM_ASK=0x00
 } HALCommand;
@@ -31,6 +36,14 @@ typedef struct HALMsg_t {
     unsigned char data[255];  //!< Command data, if any
 } HALMsg;
 
+/* Framing: each message is preceded by 3 SYNC bytes, and SYNC or ESC bytes
+   in the message itself are preceded by an ESC byte */
+#define HALMSG_SYNC 0xff
+#define HALMSG_ESC  0xaa
+
+/* Maximal length of an encoded message */
+#define HALMSG_FRAME_MAX (3 + 2*sizeof(HALMsg))
+
 #define HALMSG_SEQ_MAX 0x7f
 #define ABSOLUTE_SEQ(x) ((x) & 0x7f)
 #define DRIVER_SEQ(x) ABSOLUTE_SEQ(x)
@@ -41,6 +54,40 @@ typedef struct HALMsg_t {
 #define MSG_TYPE(msg) (((msg)->cmd) & 0x7f)
 #define MSG_IS_CHANGE(msg) (((msg)->cmd) & 0x80)
 
+/* Optional protocol features, as announced by the Arduino in the first data
+   byte of its answer to a FEATURES ask. Boards that do not know FEATURES
+   never answer, and are assumed to support none of them. */
+#define HAL_FEAT_MULTI 0x01 //!< Understands MULTI asks
+#define HAL_FEAT_BAUD  0x02 //!< Can change its baudrate
+#define HAL_FEAT_RLE   0x04 //!< Understands RLE packed animation frames
+#define HAL_FEAT_DELTA 0x08 //!< Understands delta packed animation frames
+
+#define HAL_DEFAULT_BAUDRATE 115200
+
+/* A BAUDRATE change carries the new rate as 4 big endian bytes. The Arduino
+   acknowledges it at the current rate, then switches. If it does not receive
+   a valid frame within HAL_BAUD_FALLBACK_MS at the new rate, it goes back to
+   HAL_DEFAULT_BAUDRATE by itself. */
+#define HAL_BAUD_FALLBACK_MS 1000
+
+/* An ANIMATION_PACKED change replaces the frames of an animation, like an
+   ANIMATION_FRAMES change. Its data is the packing (HAL_PACK_*), the
+   unpacked length, then the PackBits encoded frames (see pack.h). With
+   HAL_PACK_DELTA, unpacked data must be XORed with the current frames of the
+   animation (zero-padded) to obtain the new frames. */
+#define HAL_PACK_RLE   1
+#define HAL_PACK_DELTA 2
+
+/* A MULTI ask carries a list of (cmd, rid) pairs in its data, and the number
+   of pairs in rid. The answer data is a list of (cmd, rid, len, value...)
+   entries. */
+#define HALMSG_MULTI_MAX 127
+
+/*!
+ *  Sum (modulo 256) of n bytes
+ */
+unsigned char HALMsg_sum(const unsigned char *bytes, size_t n);
+
 static inline unsigned char HALMsg_checksum(HALMsg *msg)
 {
     unsigned char res = 0;
@@ -48,6 +95,9 @@ static inline unsigned char HALMsg_checksum(HALMsg *msg)
     /* Sum of bytes above chk */
     unsigned char *bytes = (unsigned char *) msg + 1;
     size_t nbytes = ((size_t) msg->len) + 4;
+    if (nbytes >= 16){
+        return HALMsg_sum(bytes, nbytes);
+    }
     for (size_t i=0; i<nbytes; i++){
         res += bytes[i];
     }
@@ -55,4 +105,110 @@ static inline unsigned char HALMsg_checksum(HALMsg *msg)
     return res;
 }
 
+/*!
+ *  Encode a message (prelude and escaped bytes). Checksum must be computed
+ *  beforehand.
+ *  @param msg The message to encode
+ *  @param dest Buffer of at least HALMSG_FRAME_MAX bytes
+ *  @return Number of bytes written in dest
+ */
+size_t HALMsg_encode(const HALMsg *msg, unsigned char *dest);
+
+typedef enum HALDecoderRes {
+    HALDEC_INCOMPLETE = 0, //!< All input consumed, message not complete yet
+    HALDEC_HEADER     = 1, //!< Header decoded; destination may be changed
+    HALDEC_COMPLETE   = 2, //!< Message decoded, with a valid checksum
+    HALDEC_BADCHK     = 3, //!< Message decoded, with an invalid checksum
+    HALDEC_BADSYNC    = 4  //!< Unexpected SYNC in message; message dropped
+} HALDecoderRes;
+
+/*!
+ *  Incremental message decoder
+ */
+typedef struct HALDecoder {
+    HALMsg *msg;   //!< Destination of the message being decoded
+    size_t pos;    //!< Number of message bytes decoded so far
+    int syncs;     //!< Number of consecutive SYNC bytes seen
+    int in_msg;    //!< Prelude seen, decoding a message
+    int escaped;   //!< Previous byte was ESC
+} HALDecoder;
+
+/*!
+ *  Initialize decoder, to decode messages in msg
+ */
+void HALDecoder_init(HALDecoder *dec, HALMsg *msg);
+
+/*!
+ *  Feed bytes to the decoder. Stops as soon as something happens (see
+ *  HALDecoderRes).
+ *  @param dec The decoder
+ *  @param bytes Input bytes
+ *  @param len Number of input bytes
+ *  @param consumed [out] Number of input bytes consumed
+ *  @return One of HALDecoderRes
+ */
+HALDecoderRes HALDecoder_feed(HALDecoder *dec, const unsigned char *bytes, size_t len, size_t *consumed);
+
+/*!
+ *  Length of the value sent back by the Arduino when asked for a resource
+ *  of the given type, or -1 if it is not fixed (and therefore cannot be part
+ *  of a MULTI ask).
+ */
+static inline int HALMsg_value_len(unsigned char cmd)
+{
+    switch (cmd & 0x7f){
+        case TRIGGER:
+        case SWITCH:
+        case ANIMATION_DELAY:
+        case ANIMATION_LOOP:
+        case ANIMATION_PLAY:
+            return 1;
+        case SENSOR:
+            return 2;
+        case RGB:
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+/*!
+ *  Append a (cmd, rid) ask to a MULTI message
+ *  @return 0 if there is no more room in multi, 1 otherwise
+ */
+static inline int HALMsg_multi_add(HALMsg *multi, unsigned char cmd, unsigned char rid)
+{
+    if (multi->rid >= HALMSG_MULTI_MAX){
+        return 0;
+    }
+    multi->data[2*multi->rid] = cmd;
+    multi->data[2*multi->rid + 1] = rid;
+    multi->rid++;
+    multi->len = 2*multi->rid;
+    return 1;
+}
+
+/*!
+ *  Extract next entry from the answer to a MULTI ask
+ *  @param multi The answer
+ *  @param offset [in+out] Offset of the entry in multi data (start with 0)
+ *  @param entry [out] Extracted entry (cmd, rid, len and data)
+ *  @return 0 if there is no more entry (or the answer is malformed), 1 otherwise
+ */
+static inline int HALMsg_multi_next(const HALMsg *multi, size_t *offset, HALMsg *entry)
+{
+    size_t i = *offset;
+    if (i + 3 > multi->len || i + 3 + multi->data[i+2] > multi->len){
+        return 0;
+    }
+    entry->cmd = multi->data[i];
+    entry->rid = multi->data[i+1];
+    entry->len = multi->data[i+2];
+    for (size_t j=0; j<entry->len; j++){
+        entry->data[j] = multi->data[i+3+j];
+    }
+    *offset = i + 3 + entry->len;
+    return 1;
+}
+
 #endif
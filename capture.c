@@ -0,0 +1,202 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN8(n) (((n) + 7) & ~((size_t) 7))
+
+struct HALCapture {
+    char *path;
+    HALCaptureHeader *hdr;
+    unsigned char *ring;
+    size_t map_len;
+    int writable;
+    size_t cursor; /* Offset of next record for HALCapture_next */
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return 1000000000ull*now.tv_sec + now.tv_nsec;
+}
+
+static HALCapture *map_capture(const char *path, int fd, size_t map_len, int writable)
+{
+    int prot = writable ? (PROT_READ|PROT_WRITE) : PROT_READ;
+    void *map = mmap(NULL, map_len, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return NULL;
+    }
+
+    HALCapture *cap = calloc(1, sizeof(HALCapture));
+    cap->path = strdup(path);
+    cap->hdr = map;
+    cap->ring = ((unsigned char *) map) + sizeof(HALCaptureHeader);
+    cap->map_len = map_len;
+    cap->writable = writable;
+    return cap;
+}
+
+HALCapture *HALCapture_open(const char *path, size_t size)
+{
+    size = ALIGN8(size);
+    if (size < 2*ALIGN8(sizeof(HALCaptureRecord) + UINT16_MAX)){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Never follow a symlink planted in place of the capture */
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0){
+        return NULL;
+    }
+    size_t map_len = sizeof(HALCaptureHeader) + size;
+    if (ftruncate(fd, map_len) < 0){
+        close(fd);
+        return NULL;
+    }
+
+    HALCapture *cap = map_capture(path, fd, map_len, 1);
+    if (cap){
+        HALCaptureHeader *hdr = cap->hdr;
+        memcpy(hdr->magic, HALCAP_MAGIC, sizeof(hdr->magic));
+        hdr->version = HALCAP_VERSION;
+        hdr->header_size = sizeof(HALCaptureHeader);
+        hdr->size = size;
+        hdr->start_realtime = clock_ns(CLOCK_REALTIME);
+        hdr->start_mono = clock_ns(CLOCK_MONOTONIC);
+    }
+    return cap;
+}
+
+HALCapture *HALCapture_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+
+    struct stat st;
+    HALCaptureHeader hdr;
+    if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, HALCAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != HALCAP_VERSION ||
+        hdr.header_size != sizeof(HALCaptureHeader) ||
+        (uint64_t) st.st_size < hdr.header_size + hdr.size ||
+        hdr.head > hdr.size || hdr.tail > hdr.size){
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    return map_capture(path, fd, sizeof(HALCaptureHeader) + hdr.size, 0);
+}
+
+void HALCapture_close(HALCapture *cap)
+{
+    if (cap->writable){
+        msync(cap->hdr, cap->map_len, MS_ASYNC);
+    }
+    munmap(cap->hdr, cap->map_len);
+    free(cap->path);
+    free(cap);
+}
+
+const char *HALCapture_path(HALCapture *cap)
+{
+    return cap->path;
+}
+
+const HALCaptureHeader *HALCapture_header(HALCapture *cap)
+{
+    return cap->hdr;
+}
+
+/* Offset of the record at offset, following wrap markers */
+static size_t unwrap(const HALCapture *cap, size_t offset)
+{
+    if (cap->hdr->size - offset < sizeof(HALCaptureRecord)){
+        return 0;
+    }
+    const HALCaptureRecord *rec = (const HALCaptureRecord *) (cap->ring + offset);
+    return (rec->dir == HALCAP_WRAP) ? 0 : offset;
+}
+
+/* Drop oldest records until [from, to[ is free */
+static void evict(HALCapture *cap, size_t from, size_t to)
+{
+    HALCaptureHeader *hdr = cap->hdr;
+    while (hdr->n_records > 0 && hdr->tail >= from && hdr->tail < to){
+        const HALCaptureRecord *rec = (const HALCaptureRecord *) (cap->ring + hdr->tail);
+        hdr->tail = unwrap(cap, hdr->tail + ALIGN8(sizeof(HALCaptureRecord) + rec->len));
+        hdr->n_records--;
+    }
+}
+
+void HALCapture_record(HALCapture *cap, HALCaptureDir dir, const unsigned char *bytes, size_t len)
+{
+    HALCaptureHeader *hdr = cap->hdr;
+    HALCaptureRecord *rec;
+    if (len > UINT16_MAX){
+        len = UINT16_MAX;
+    }
+    size_t rec_len = ALIGN8(sizeof(HALCaptureRecord) + len);
+
+    /* Not enough room until the end of ring: wrap */
+    if (hdr->head + rec_len > hdr->size){
+        evict(cap, hdr->head, hdr->size);
+        if (hdr->size - hdr->head >= sizeof(HALCaptureRecord)){
+            rec = (HALCaptureRecord *) (cap->ring + hdr->head);
+            memset(rec, 0, sizeof(HALCaptureRecord));
+            rec->dir = HALCAP_WRAP;
+        }
+        hdr->head = 0;
+        if (hdr->n_records == 0){
+            hdr->tail = 0;
+        }
+    }
+    evict(cap, hdr->head, hdr->head + rec_len);
+
+    rec = (HALCaptureRecord *) (cap->ring + hdr->head);
+    rec->ts = clock_ns(CLOCK_MONOTONIC);
+    rec->len = len;
+    rec->dir = dir;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    memcpy(rec+1, bytes, len);
+
+    if (hdr->n_records == 0){
+        hdr->tail = hdr->head;
+    }
+    hdr->head += rec_len;
+    hdr->n_records++;
+    hdr->total_records++;
+}
+
+int HALCapture_next(HALCapture *cap, size_t *index, HALCaptureRecord *rec, const unsigned char **bytes)
+{
+    if (*index >= cap->hdr->n_records){
+        return 0;
+    }
+    if (*index == 0){
+        cap->cursor = unwrap(cap, cap->hdr->tail);
+    }
+
+    const HALCaptureRecord *cur = (const HALCaptureRecord *) (cap->ring + cap->cursor);
+    size_t rec_len = ALIGN8(sizeof(HALCaptureRecord) + cur->len);
+    if (cap->cursor + rec_len > cap->hdr->size){
+        /* Truncated or corrupted capture */
+        return 0;
+    }
+    memcpy(rec, cur, sizeof(HALCaptureRecord));
+    *bytes = (const unsigned char *) (cur+1);
+
+    cap->cursor = unwrap(cap, cap->cursor + rec_len);
+    (*index)++;
+    return 1;
+}
@@ -0,0 +1,86 @@
+#ifndef DEFINE_CAPTURE_HEADER
+#define DEFINE_CAPTURE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  Capture of raw serial traffic in a memory-mapped ring file. The file
+ *  starts with a HALCaptureHeader, followed by a ring of records. Each record
+ *  is a HALCaptureRecord header followed by len bytes, padded to 8 bytes.
+ *  When the writer reaches the end of the ring, it writes a record with
+ *  dir == HALCAP_WRAP (or leaves less than a record header) and goes back to
+ *  the start of the ring, overwriting the oldest records. All fields are in
+ *  host byte order.
+ */
+
+#define HALCAP_MAGIC "HALCAP1"
+#define HALCAP_VERSION 1
+
+#ifndef HALCAP_DEFAULT_SIZE
+/* Default size of the ring (in bytes) */
+#define HALCAP_DEFAULT_SIZE (4*1024*1024)
+#endif
+
+typedef enum {
+    HALCAP_RX = 0,      //!< Bytes read from the Arduino, as read
+    HALCAP_TX = 1,      //!< Frame written to the Arduino
+    HALCAP_WRAP = 0xff  //!< End of ring; next record is at its start
+} HALCaptureDir;
+
+typedef struct HALCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;    //!< Offset of the ring in the file
+    uint64_t size;           //!< Size of the ring
+    uint64_t head;           //!< Offset in ring of the next record
+    uint64_t tail;           //!< Offset in ring of the oldest record
+    uint64_t n_records;      //!< Number of records in the ring
+    uint64_t total_records;  //!< Number of records ever written
+    uint64_t start_realtime; //!< Wall clock at start of capture (ns)
+    uint64_t start_mono;     //!< Monotonic clock at start of capture (ns)
+} HALCaptureHeader;
+
+typedef struct HALCaptureRecord {
+    uint64_t ts;    //!< Monotonic clock (ns)
+    uint16_t len;
+    uint8_t dir;    //!< One of HALCaptureDir
+    uint8_t reserved[5];
+} HALCaptureRecord;
+
+typedef struct HALCapture HALCapture;
+
+/*!
+ *  Create (or truncate) a capture file with a ring of size bytes, readable
+ *  by its owner only. Fails if path is a symlink.
+ *  @return The capture, or NULL on error (errno is set)
+ */
+HALCapture *HALCapture_open(const char *path, size_t size);
+
+/*!
+ *  Open an existing capture file, read only
+ *  @return The capture, or NULL on error (errno is set)
+ */
+HALCapture *HALCapture_load(const char *path);
+
+void HALCapture_close(HALCapture *cap);
+
+const char *HALCapture_path(HALCapture *cap);
+
+const HALCaptureHeader *HALCapture_header(HALCapture *cap);
+
+/*!
+ *  Append a record; the oldest records are overwritten if needed.
+ *  Not thread-safe.
+ */
+void HALCapture_record(HALCapture *cap, HALCaptureDir dir, const unsigned char *bytes, size_t len);
+
+/*!
+ *  Iterate over records, from the oldest one. *index must be 0 on first call.
+ *  @param rec Header of the next record
+ *  @param bytes Pointer to the bytes of the next record
+ *  @return 1 if there was a next record, 0 otherwise
+ */
+int HALCapture_next(HALCapture *cap, size_t *index, HALCaptureRecord *rec, const unsigned char **bytes);
+
+#endif
@@ -1,13 +1,24 @@
+#ifndef _GNU_SOURCE
+/* CPU affinity of threads */
+#define _GNU_SOURCE
+#endif
 #include "com.h"
 #include "logger.h"
+#include "pack.h"
+#include "capture.h"
+#include "eventring.h"
+#include "history.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <assert.h>
 #include <poll.h>
 #include <termios.h>
 #include <sys/fcntl.h>
@@ -15,43 +26,380 @@
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/stat.h>
-
-static const unsigned char SYNC = 0xff;
-static const unsigned char  ESC = 0xaa;
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <libgen.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #ifndef HALCONN_SOCK_CLIENTS
 #define HALCONN_SOCK_CLIENTS 42
 #endif
 
+#ifndef HALCONN_JOURNAL_SIZE
+/* Number of recent events listeners may resume from */
+#define HALCONN_JOURNAL_SIZE 1024
+#endif
+
+#ifndef HALCONN_BATCH_WINDOW
+/* Default time (in usec) during which concurrent asks are aggregated */
+#define HALCONN_BATCH_WINDOW 1000
+#endif
+
+#ifndef HALCONN_BATCH_MAX
+#define HALCONN_BATCH_MAX 64
+#endif
+
+#ifndef HALCONN_TX_STARVATION
+/* Number of times a transmit class may be passed over by higher priority
+   classes before it gets the next turn */
+#define HALCONN_TX_STARVATION 8
+#endif
+
+#ifndef HALCONN_TX_COMBINE_MAX
+/* Max number of frames merged in a single write */
+#define HALCONN_TX_COMBINE_MAX 16
+#endif
+
+#ifndef HALCONN_TIMEOUT
+/* Time (in usec) to wait for the response to a request */
+#define HALCONN_TIMEOUT 500000
+#endif
+
+#ifndef HALCONN_HEDGE_PERCENTILE
+/* Default percentile of recent asks latency after which an unanswered ask
+   is sent again; 0 disables hedging */
+#define HALCONN_HEDGE_PERCENTILE 95
+#endif
+
+#ifndef HALCONN_HEDGE_MIN_DELAY
+/* Asks are never sent again sooner than that (usec) */
+#define HALCONN_HEDGE_MIN_DELAY 1000
+#endif
+
+#ifndef HALCONN_HEARTBEAT_INTERVAL
+/* Default delay (in ms) between 2 heartbeats; 0 disables them */
+#define HALCONN_HEARTBEAT_INTERVAL 1000
+#endif
+
+#ifndef HALCONN_HEARTBEAT_TIMEOUT
+/* Time (in usec) after which a heartbeat is considered lost */
+#define HALCONN_HEARTBEAT_TIMEOUT 250000
+#endif
+
+#ifndef HALCONN_HEARTBEAT_MISSES
+/* Number of heartbeats lost in a row after which the link is degraded */
+#define HALCONN_HEARTBEAT_MISSES 2
+#endif
+
+#ifndef HALCONN_RT_PRIORITY
+/* Default priority of I/O threads with real-time scheduling */
+#define HALCONN_RT_PRIORITY 10
+#endif
+
+#ifndef HALCONN_IO_STACK
+/* Stack size of I/O threads (locked in memory with the mlock option) */
+#define HALCONN_IO_STACK (256*1024)
+#endif
+
+#ifndef HALCONN_HISTORY_SIZE
+/* Number of samples kept in the history of a sensor */
+#define HALCONN_HISTORY_SIZE 256
+#endif
+
+/* Number of recent asks latencies the hedging delay is computed on, and
+   how often (in asks) it is computed again */
+#define HALCONN_HEDGE_WINDOW 64
+#define HALCONN_HEDGE_REFRESH 8
+
+/* Number of recent heartbeats link statistics are computed on */
+#define HALCONN_HEARTBEAT_WINDOW 32
+
+/* Last known value of a writable resource */
+struct HALShadow {
+    unsigned char len;
+    unsigned char data[255];
+};
+
+#define HALCONN_SHADOW_TYPES 6
+
+/* An ask in flight, that identical concurrent asks wait for */
+struct HALFlight {
+    unsigned char cmd, rid;
+    HALMsg response;   /* Only filled if there are followers */
+    HALErr err;
+    int done;
+    int refs;
+    pthread_cond_t cond;
+    struct HALFlight *next;
+};
+
+/* An encoded frame waiting for its turn to be transmitted */
+struct HALTxEntry {
+    struct HALTxEntry *next;
+    unsigned char cmd;
+    unsigned char seq;
+    size_t len;
+    unsigned char frame[HALMSG_FRAME_MAX];
+};
+
+/* Intrusive multi-producer single-consumer queue (D. Vyukov). Producers
+   only swap head; the writer thread owns tail. stats.depth counts frames
+   completely pushed. */
+struct HALTxQueue {
+    struct HALTxEntry *head;
+    struct HALTxEntry *tail;
+    struct HALTxEntry stub;
+    size_t skipped;    /* Turns given to other classes while not empty */
+    HALTxStats stats;
+};
+
+/* A set of concurrent asks, sent together in a single MULTI ask */
+struct HALBatch {
+    HALMsg *msgs[HALCONN_BATCH_MAX];
+    HALErr errs[HALCONN_BATCH_MAX];
+    size_t n;
+    size_t answer_len; /* Expected length of the answer data */
+    int done;          /* Answers were fanned out */
+    int refs;
+    pthread_cond_t cond;
+};
+
 struct HALConnection {
     /* Arduino FD */
     int fd;
+    HALConnOpts opts;
+    unsigned int baudrate;
+
+    /* CPUs I/O threads may run on (if opts.cpus), and whether memory
+       is locked */
+    cpu_set_t cpus;
+    int mlocked;
+
+    /* Input buffer, and decoder of incoming messages */
+    unsigned char rx_buf[512];
+    size_t rx_pos, rx_len;
+    HALDecoder decoder;
+    HALMsg rx_msg;
 
     /* Current emit seq number */
     unsigned int current_seq;
 
+    /* Frames to transmit, by class. The writer thread owns the fd for
+       output, and writes them in priority order; tx_sem counts pushes. */
+    struct HALTxQueue tx_queues[HALCONN_TX_CLASSES];
+    pthread_t writer_thread;
+    sem_t tx_sem;
+    int tx_stop;
+
     /* Multithreading for the reader */
     pthread_mutex_t mutex;
     pthread_t reader_thread;
     int running;
 
-    /* A table containing pending requests, indexed by seq number */
+    /* A table containing pending requests, indexed by seq number. Responses
+       are decoded directly in the requester's message. */
     pthread_cond_t  waits[HALMSG_SEQ_MAX+1];
-    unsigned char    used[HALMSG_SEQ_MAX+1];
-    HALMsg      responses[HALMSG_SEQ_MAX+1];
-
-    /* Event socket */
+    HALMsg       *pending[HALMSG_SEQ_MAX+1];
+    unsigned char    done[HALMSG_SEQ_MAX+1];
+    unsigned char  waiter[HALMSG_SEQ_MAX+1]; /* Seq whose cond is signaled */
+    unsigned char    lost[HALMSG_SEQ_MAX+1]; /* Request could not be written */
+    size_t n_inflight;
+
+    /* Hedging: an ask that is not answered after the hedge_percentile of
+       recent asks latencies (in usec) is sent again with another seq, and
+       the first response wins */
+    unsigned int hedge_percentile;
+    unsigned long int ask_latencies[HALCONN_HEDGE_WINDOW];
+    size_t n_asks;
+    unsigned long int hedge_delay; /* 0: not enough asks yet */
+    size_t hedges;
+    size_t hedge_wins;
+
+    /* Optional protocol features supported by the Arduino */
+    unsigned char features;
+
+    /* Shadow state of writable resources, by type and rid (the frames
+       are also the reference for delta packing) */
+    struct HALShadow *shadow[HALCONN_SHADOW_TYPES][256];
+    int shadow_reads;
+    size_t shadow_hits;
+
+    /* Asks in flight, for deduplication */
+    struct HALFlight *flights;
+    size_t flight_hits;
+
+    /* Batch of asks currently being collected, if any */
+    struct HALBatch *batch;
+    unsigned int batch_window;
+
+    /* Capture of serial traffic, if enabled */
+    HALCapture *capture;
+
+    /* Shared memory ring of events, if enabled */
+    HALRing *ring;
+
+    /* Event socket; sequenced listeners asked to resume from the journal,
+       and get events with their sequence number and timestamp. Listeners
+       are never waited for: sequenced ones are sent the journal as their
+       socket accepts it, from their own position in it. */
     int sock;
-    int sock_clients[HALCONN_SOCK_CLIENTS];
+    struct HALListener {
+        int fd;
+        int sequenced;
+        uint64_t next;      /* Next event of the journal to send */
+        char in[32];        /* Incomplete request line */
+        size_t in_len;
+        char out[300];      /* Line being sent */
+        size_t out_pos, out_len;
+    } sock_clients[HALCONN_SOCK_CLIENTS];
     size_t n_sock_clients;
     const char *sock_path;
 
+    /* Recent events; event of sequence number n is at n % HALCONN_JOURNAL_SIZE */
+    struct HALJournalEntry {
+        uint64_t ts;        /* Wall clock (usec) */
+        unsigned char rid;
+        unsigned char state;
+    } journal[HALCONN_JOURNAL_SIZE];
+    uint64_t event_seq;     /* Sequence number of the last event */
+
+    /* Heartbeat: round trip times (usec, -1: lost) of recent PING asks */
+    pthread_t heartbeat_thread;
+    pthread_cond_t heartbeat_cond;
+    unsigned int heartbeat_interval;
+    long int heartbeat_rtts[HALCONN_HEARTBEAT_WINDOW];
+    size_t heartbeats;
+    size_t heartbeats_lost;
+    size_t heartbeat_misses;  /* Lost in a row */
+    double jitter;
+    int link_answered;        /* The Arduino answered a heartbeat once */
+    int degraded;
+
+    /* Sampling of sensors: histories are written by the sampler thread only,
+       and kept until the connection is closed */
+    pthread_t sampler_thread;
+    pthread_cond_t sampler_cond;
+    unsigned int sampling_interval;
+    HALHistory *histories[256];
+    unsigned char sampled[256];
+
+    /* Called when a resource changes */
+    HALChangeHandler change_handler;
+    void *change_arg;
+
     /* Stats */
     size_t rx_bytes;
     size_t tx_bytes;
+    size_t rx_frames;
+    size_t tx_frames;
+    size_t chk_errors;
+    size_t sync_errors;
+    size_t events;
+    size_t rx_by_cmd[256];
+    size_t tx_by_cmd[256];
+    size_t requests[HALCONN_ERRORS];
+    size_t latency[HALCONN_LATENCY_BUCKETS];
+    double latency_sum;
     time_t start_time;
 };
 
+const unsigned long int HALConn_latency_bounds[HALCONN_LATENCY_BUCKETS-1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000
+};
+
+static speed_t baudrate_constant(unsigned int baudrate)
+{
+    switch (baudrate){
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+#ifdef B460800
+        case 460800:  return B460800;
+        case 500000:  return B500000;
+        case 576000:  return B576000;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1152000: return B1152000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+#endif
+        default:      return B0;
+    }
+}
+
+/* Set port speed; non standard rates are set with a custom divisor */
+static int set_baudrate(int fd, unsigned int baudrate)
+{
+    struct termios toptions;
+
+    if (tcgetattr(fd, &toptions) < 0) {
+        return 0;
+    }
+
+    speed_t brate = baudrate_constant(baudrate);
+#ifdef __linux__
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0){
+        serial.flags &= ~ASYNC_SPD_MASK;
+        if (brate == B0 && serial.baud_base > 0){
+            /* B38400 is then interpreted as baud_base/custom_divisor */
+            serial.flags |= ASYNC_SPD_CUST;
+            serial.custom_divisor = (serial.baud_base + baudrate/2) / baudrate;
+            brate = B38400;
+        }
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+#endif
+    if (brate == B0){
+        errno = EINVAL;
+        return 0;
+    }
+
+    cfsetispeed(&toptions, brate);
+    cfsetospeed(&toptions, brate);
+    return tcsetattr(fd, TCSADRAIN, &toptions) == 0;
+}
+
+/* Reduce latency between bytes arrival on the wire and read() */
+static void set_low_latency(int fd, const char *path, const HALConnOpts *opts)
+{
+#ifdef __linux__
+    struct serial_struct serial;
+    if (opts->low_latency){
+        if (ioctl(fd, TIOCGSERIAL, &serial) == 0){
+            serial.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(fd, TIOCSSERIAL, &serial) != 0){
+                HAL_WARN("Unable to set low latency mode [ERRNO %d: %s]", errno, strerror(errno));
+            }
+        }
+    }
+
+    /* USB-serial chips (FTDI...) buffer up to latency_timer ms before sending
+       data to the host */
+    char tty_path[PATH_MAX], sysfs_path[PATH_MAX];
+    if (opts->latency_timer > 0){
+        strncpy(tty_path, path, sizeof(tty_path)-1);
+        tty_path[sizeof(tty_path)-1] = '\0';
+        snprintf(sysfs_path, sizeof(sysfs_path),
+                 "/sys/bus/usb-serial/devices/%s/latency_timer", basename(tty_path));
+        FILE *timer = fopen(sysfs_path, "w");
+        if (timer){
+            fprintf(timer, "%u\n", opts->latency_timer);
+            fclose(timer);
+            HAL_DEBUG("Set latency timer to %ums", opts->latency_timer);
+        } else {
+            HAL_DEBUG("No latency timer for %s", path);
+        }
+    }
+#endif
+}
+
 static int set_termios_opts(int fd)
 {
     struct termios toptions;
@@ -88,7 +436,372 @@ static int set_termios_opts(int fd)
     return 1;
 }
 
-HALConnection *HALConn_open(const char *path, const char *sock_path)
+static int shadow_index(unsigned char type)
+{
+    switch (type){
+        case SWITCH:           return 0;
+        case RGB:              return 1;
+        case ANIMATION_DELAY:  return 2;
+        case ANIMATION_LOOP:   return 3;
+        case ANIMATION_PLAY:   return 4;
+        case ANIMATION_FRAMES: return 5;
+        default:               return -1;
+    }
+}
+
+/* Known value of a resource, or NULL. Lock on connection must be held. */
+static struct HALShadow *HALConn_shadow_get(HALConnection *conn, unsigned char type, unsigned char rid)
+{
+    int i = shadow_index(type);
+    return (i < 0) ? NULL : conn->shadow[i][rid];
+}
+
+/* Set known value of a resource. Return 1 if it was unknown or different. */
+static int HALConn_shadow_set(HALConnection *conn, unsigned char type, unsigned char rid,
+                              const unsigned char *data, size_t len)
+{
+    int i = shadow_index(type);
+    if (i < 0){
+        return 0;
+    }
+    struct HALShadow *shadow = conn->shadow[i][rid];
+    if (shadow && shadow->len == len && memcmp(shadow->data, data, len) == 0){
+        return 0;
+    }
+    if (! shadow){
+        shadow = conn->shadow[i][rid] = malloc(sizeof(struct HALShadow));
+    }
+    if (shadow){
+        shadow->len = len;
+        memcpy(shadow->data, data, len);
+    }
+    return 1;
+}
+
+/* Tell the change handler that a resource changed. Lock must be held. */
+static void HALConn_changed(HALConnection *conn, unsigned char type, unsigned char rid)
+{
+    if (conn->change_handler){
+        conn->change_handler(conn->change_arg, type, rid);
+    }
+}
+
+/* Forget value of a resource (unknown state on the Arduino side) */
+static void HALConn_shadow_forget(HALConnection *conn, unsigned char type, unsigned char rid)
+{
+    int i = shadow_index(type);
+    if (i >= 0){
+        free(conn->shadow[i][rid]);
+        conn->shadow[i][rid] = NULL;
+    }
+}
+
+/* Forget all known values (Arduino rebooted...). Lock must be held. */
+static void HALConn_forget_shadow(HALConnection *conn)
+{
+    for (size_t i=0; i<HALCONN_SHADOW_TYPES; i++){
+        for (size_t j=0; j<256; j++){
+            free(conn->shadow[i][j]);
+            conn->shadow[i][j] = NULL;
+        }
+    }
+}
+
+static HALTxClass HALConn_tx_class(const HALMsg *msg)
+{
+    switch (MSG_TYPE(msg)){
+        case HAL_PING:
+            /* Heartbeats pass asks: a busy link is not a dead one */
+        case BOOT:
+        case VERSION:
+        case TREE:
+        case FEATURES:
+        case BAUDRATE:
+            return HALCONN_TX_CONTROL;
+        case ANIMATION_FRAMES:
+        case ANIMATION_PACKED:
+            return MSG_IS_CHANGE(msg) ? HALCONN_TX_BULK : HALCONN_TX_READ;
+        default:
+            return MSG_IS_CHANGE(msg) ? HALCONN_TX_INTERACTIVE : HALCONN_TX_READ;
+    }
+}
+
+static void HALTxQueue_init(struct HALTxQueue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = queue->tail = &queue->stub;
+}
+
+static void HALTxQueue_push(struct HALTxQueue *queue, struct HALTxEntry *entry)
+{
+    __atomic_store_n(&entry->next, NULL, __ATOMIC_RELAXED);
+    struct HALTxEntry *prev = __atomic_exchange_n(&queue->head, entry, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, entry, __ATOMIC_RELEASE);
+}
+
+/* Oldest entry, or NULL if the queue is empty or a push is in progress.
+   Writer thread only. */
+static struct HALTxEntry *HALTxQueue_pop(struct HALTxQueue *queue)
+{
+    struct HALTxEntry *tail = queue->tail;
+    struct HALTxEntry *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub){
+        if (! next){
+            return NULL;
+        }
+        queue->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next){
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    HALTxQueue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next){
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Next frame to transmit: highest priority first, unless a class has been
+   passed over too many times. Writer thread only. */
+static struct HALTxEntry *HALConn_tx_pop(HALConnection *conn)
+{
+    int chosen = -1, starved = -1;
+    int waiting[HALCONN_TX_CLASSES];
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        struct HALTxQueue *queue = conn->tx_queues + i;
+        waiting[i] = __atomic_load_n(&queue->stats.depth, __ATOMIC_ACQUIRE) > 0;
+        if (! waiting[i]){
+            continue;
+        }
+        if (chosen < 0){
+            chosen = i;
+        } else if (queue->skipped >= HALCONN_TX_STARVATION &&
+                   (starved < 0 || queue->skipped > conn->tx_queues[starved].skipped)){
+            starved = i;
+        }
+    }
+    if (chosen < 0){
+        return NULL;
+    }
+    if (starved >= 0){
+        chosen = starved;
+    }
+
+    struct HALTxQueue *queue = conn->tx_queues + chosen;
+    struct HALTxEntry *entry = HALTxQueue_pop(queue);
+    if (! entry){
+        /* Push in progress; its producer posts tx_sem once done */
+        return NULL;
+    }
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        if (i != chosen && waiting[i]){
+            conn->tx_queues[i].skipped++;
+        }
+    }
+    if (starved >= 0){
+        __atomic_add_fetch(&queue->stats.promoted, 1, __ATOMIC_RELAXED);
+    }
+    queue->skipped = 0;
+    __atomic_sub_fetch(&queue->stats.depth, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&queue->stats.sent, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/* Write queued frames, merged in large writes, until asked to stop */
+static void *HALConn_writer_thread(void *arg)
+{
+    HALConnection *conn = arg;
+    unsigned char buf[HALCONN_TX_COMBINE_MAX * HALMSG_FRAME_MAX];
+    struct HALTxEntry *batch[HALCONN_TX_COMBINE_MAX];
+
+    while (1){
+        size_t n = 0, len = 0;
+        while (n < HALCONN_TX_COMBINE_MAX && (batch[n] = HALConn_tx_pop(conn))){
+            memcpy(buf+len, batch[n]->frame, batch[n]->len);
+            len += batch[n]->len;
+            n++;
+        }
+        if (n == 0){
+            if (__atomic_load_n(&conn->tx_stop, __ATOMIC_ACQUIRE)){
+                break;
+            }
+            sem_wait(&conn->tx_sem);
+            continue;
+        }
+
+        /* Account before writing: responses may arrive as soon as written */
+        pthread_mutex_lock(&conn->mutex);
+        conn->tx_bytes += len;
+        conn->tx_frames += n;
+        for (size_t i=0; i<n; i++){
+            conn->tx_by_cmd[batch[i]->cmd]++;
+            if (conn->capture){
+                HALCapture_record(conn->capture, HALCAP_TX, batch[i]->frame, batch[i]->len);
+            }
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        size_t written = 0;
+        while (written < len){
+            ssize_t r = write(conn->fd, buf+written, len-written);
+            if (r < 0 && errno == EINTR){
+                continue;
+            }
+            if (r <= 0){
+                HAL_WARN("Error when writing [ERRNO %d: %s]", errno, strerror(errno));
+                break;
+            }
+            written += r;
+        }
+
+        if (written < len){
+            /* Requesters of lost frames would otherwise wait until timeout */
+            pthread_mutex_lock(&conn->mutex);
+            conn->tx_bytes -= len - written;
+            for (size_t i=0, end=0; i<n; i++){
+                end += batch[i]->len;
+                if (end > written){
+                    conn->tx_frames--;
+                    conn->tx_by_cmd[batch[i]->cmd]--;
+                    size_t seq = ABSOLUTE_SEQ(batch[i]->seq);
+                    if (IS_DRIVER_SEQ(batch[i]->seq) && conn->pending[seq] && ! conn->done[seq]){
+                        conn->lost[seq] = 1;
+                        pthread_cond_signal(conn->waits+conn->waiter[seq]);
+                    }
+                }
+            }
+            pthread_mutex_unlock(&conn->mutex);
+        }
+
+        for (size_t i=0; i<n; i++){
+            free(batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Queue msg for transmission in its turn; the writer thread writes it */
+static HALErr HALConn_send(HALConnection *conn, const HALMsg *msg)
+{
+    struct HALTxEntry *entry = malloc(sizeof(struct HALTxEntry));
+    if (! entry){
+        return UNKNERR;
+    }
+    entry->cmd = msg->cmd;
+    entry->seq = msg->seq;
+    entry->len = HALMsg_encode(msg, entry->frame);
+    dump_message(msg, " \033[1;34m<<\033[0m ");
+
+    struct HALTxQueue *queue = conn->tx_queues + HALConn_tx_class(msg);
+    HALTxQueue_push(queue, entry);
+    size_t depth = __atomic_add_fetch(&queue->stats.depth, 1, __ATOMIC_RELEASE);
+    size_t max_depth = __atomic_load_n(&queue->stats.max_depth, __ATOMIC_RELAXED);
+    while (depth > max_depth &&
+           ! __atomic_compare_exchange_n(&queue->stats.max_depth, &max_depth, depth, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    sem_post(&conn->tx_sem);
+    return OK;
+}
+
+/* Parse a CPU list such as "0,2-3" */
+static int parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    while (*list){
+        char *end;
+        long int first = strtol(list, &end, 10), last = first;
+        if (end == list){
+            return 0;
+        }
+        if (*end == '-'){
+            list = end+1;
+            last = strtol(list, &end, 10);
+            if (end == list){
+                return 0;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE){
+            return 0;
+        }
+        for (long int i=first; i<=last; i++){
+            CPU_SET(i, cpus);
+        }
+        list = (*end == ',') ? end+1 : end;
+        if (*end && *end != ','){
+            return 0;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+/* Format cpus as a CPU list */
+static int format_cpus(const cpu_set_t *cpus, char *buf, size_t size)
+{
+    int len = 0;
+    buf[0] = '\0';
+    for (int i=0; i<CPU_SETSIZE && (size_t) len < size; i++){
+        if (! CPU_ISSET(i, cpus)){
+            continue;
+        }
+        int last = i;
+        while (last+1 < CPU_SETSIZE && CPU_ISSET(last+1, cpus)){
+            last++;
+        }
+        const char *sep = (len > 0) ? "," : "";
+        if (last > i){
+            len += snprintf(buf+len, size-len, "%s%d-%d", sep, i, last);
+        } else {
+            len += snprintf(buf+len, size-len, "%s%d", sep, i);
+        }
+        i = last;
+    }
+    return len;
+}
+
+/* Start an I/O thread (reader, writer, heartbeat, sampler), with the scheduling
+   options of the connection. Real-time scheduling falls back to the
+   default one if not permitted. */
+static int HALConn_start_thread(HALConnection *conn, pthread_t *thread, void *(*run)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, HALCONN_IO_STACK);
+
+    int policy = conn->opts.sched_policy;
+    if (policy == SCHED_FIFO || policy == SCHED_RR){
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = conn->opts.sched_priority ? (int) conn->opts.sched_priority : HALCONN_RT_PRIORITY;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, policy);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    int r = pthread_create(thread, &attr, run, arg);
+    if (r == EPERM || r == EINVAL){
+        HAL_WARN("Cannot use real-time scheduling [ERRNO %d: %s]; using default", r, strerror(r));
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        r = pthread_create(thread, &attr, run, arg);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (r == 0 && conn->opts.cpus){
+        int err = pthread_setaffinity_np(*thread, sizeof(cpu_set_t), &conn->cpus);
+        if (err != 0){
+            HAL_WARN("Cannot set CPU affinity [ERRNO %d: %s]", err, strerror(err));
+        }
+    }
+    return r;
+}
+
+HALConnection *HALConn_open(const char *path, const char *sock_path, const HALConnOpts *opts)
 {
     int fd = open(path, O_RDWR);
     
@@ -101,14 +814,48 @@ HALConnection *HALConn_open(const char *path, const char *sock_path)
         HAL_ERROR(UNKNERR, "Unable to set serial port options [ERRNO %d: %s]\n", errno, strerror(errno));
         return NULL;
     }
+    set_low_latency(fd, path, opts);
 
+    return HALConn_open_fd(fd, sock_path, opts);
+}
+
+HALConnection *HALConn_open_fd(int fd, const char *sock_path, const HALConnOpts *opts)
+{
     HALConnection *res = calloc(1, sizeof(HALConnection));
+    if (! res){
+        return NULL;
+    }
     res->fd = fd;
+    res->opts = *opts;
+    res->baudrate = HAL_DEFAULT_BAUDRATE;
+    if (opts->cpus && ! parse_cpus(opts->cpus, &res->cpus)){
+        HAL_WARN("Invalid CPU list %s; ignored", opts->cpus);
+        res->opts.cpus = NULL;
+    }
+    if (opts->mlock){
+        /* Also locks (thus preallocates) stacks of threads started later */
+        if (mlockall(MCL_CURRENT|MCL_FUTURE) == 0){
+            res->mlocked = 1;
+        } else {
+            HAL_WARN("Cannot lock memory [ERRNO %d: %s]", errno, strerror(errno));
+        }
+    }
+    HALDecoder_init(&res->decoder, NULL);
     pthread_mutex_init(&res->mutex, NULL);
     for (size_t i=0; i<HALMSG_SEQ_MAX+1; i++){
         pthread_cond_init(res->waits+i, NULL);
     }
-
+    for (size_t i=0; i<HALCONN_TX_CLASSES; i++){
+        HALTxQueue_init(res->tx_queues+i);
+    }
+    sem_init(&res->tx_sem, 0, 0);
+
+    res->batch_window = HALCONN_BATCH_WINDOW;
+    res->hedge_percentile = HALCONN_HEDGE_PERCENTILE;
+    res->shadow_reads = 1;
+    res->heartbeat_interval = HALCONN_HEARTBEAT_INTERVAL;
+    pthread_cond_init(&res->heartbeat_cond, NULL);
+    pthread_cond_init(&res->sampler_cond, NULL);
     res->start_time = time(NULL);
     res->sock_path = strndup(sock_path, 256);
 
@@ -123,6 +870,7 @@ HALConnection *HALConn_open(const char *path, const char *sock_path)
     listen(res->sock, HALCONN_SOCK_CLIENTS);
     chmod(sock_desc.sun_path, 0777);
 
+    HALConn_start_thread(res, &res->writer_thread, HALConn_writer_thread, res);
     return res;
 }
 
@@ -131,360 +879,1866 @@ void HALConn_close(HALConnection *conn)
     if (HALConn_is_running(conn)){
         HALConn_stop_reader(conn);
     }
+    /* Queued frames are written before the writer stops */
+    __atomic_store_n(&conn->tx_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&conn->tx_sem);
+    pthread_join(conn->writer_thread, NULL);
+    sem_destroy(&conn->tx_sem);
     for (size_t i=0; i<conn->n_sock_clients; i++){
-        close(conn->sock_clients[i]);
+        close(conn->sock_clients[i].fd);
+    }
+    HALConn_forget_shadow(conn);
+    if (conn->capture){
+        HALCapture_close(conn->capture);
+    }
+    if (conn->ring){
+        HALRing_close(conn->ring);
     }
     unlink(conn->sock_path);
     free((void*) conn->sock_path);
     pthread_mutex_destroy(&conn->mutex);
-    for (size_t i=0; i<HALMSG_SEQ_MAX; i++){
+    for (size_t i=0; i<HALMSG_SEQ_MAX+1; i++){
         pthread_cond_destroy(conn->waits+i);
     }
+    pthread_cond_destroy(&conn->heartbeat_cond);
+    pthread_cond_destroy(&conn->sampler_cond);
+    for (int i=0; i<256; i++){
+        if (conn->histories[i]){
+            HALHistory_destroy(conn->histories[i]);
+        }
+    }
     close(conn->fd);
     free(conn);
 }
 
-/* Write a single byte, escaping ESC and SYNC */
-static HALErr HAL_write_byte(HALConnection *conn, unsigned char the_byte)
+/* Read what is available in the input buffer, without waiting. Lock on
+   connection must be held. */
+static HALErr HALConn_read_input(HALConnection *conn)
 {
-    HALErr r;
-
-    /* Escape special bytes */
-    if (the_byte == SYNC || the_byte == ESC){
-        r = write(conn->fd, &ESC, 1);
-        if (r != 1){
-            return WRITEERR;
+    ssize_t r = read(conn->fd, conn->rx_buf, sizeof(conn->rx_buf));
+    if (r < 0){
+        if (errno == EAGAIN || errno == EINTR){
+            return OK;
         }
-        conn->tx_bytes++;
+        HAL_WARN("Error when reading [ERRNO %d: %s]", errno, strerror(errno));
+        return READERR;
     }
-
-    /* Write the byte itself */
-    r = write(conn->fd, &the_byte, 1);
-    if (r != 1){
-        return WRITEERR;
+    if (r > 0){
+        conn->rx_pos = 0;
+        conn->rx_len = r;
+        conn->rx_bytes += r;
+        if (conn->capture){
+            HALCapture_record(conn->capture, HALCAP_RX, conn->rx_buf, r);
+        }
     }
-    conn->tx_bytes++;
     return OK;
 }
 
-static const struct timespec read_sleep = {.tv_sec=0, .tv_nsec=10000};
-static inline int wrap_read(int fd, unsigned char *dest)
-{
-    int r = read(fd, dest, 1);
-    while (r == 0){
-        nanosleep(&read_sleep, NULL);
-        r = read(fd, dest, 1);
-    }
-    return r;
-}
-
-/* Read a (potentially escaped) single byte */
-static HALErr HAL_read_byte(HALConnection *conn, unsigned char *the_byte)
+/* Wait until fd is readable, then read what is available in the input
+   buffer. Only for use before the reader thread is started (the lock is
+   held while waiting). Lock on connection must be held. */
+static HALErr HALConn_fill(HALConnection *conn)
 {
-    /* Read byte */
-    int r = wrap_read(conn->fd, the_byte);
-    if (r < 0){
-        return READERR;
-    }
-    conn->rx_bytes++;
-
-    if (*the_byte == SYNC){
-        return OUTOFSYNC;
-    }
-
-    /* If it was escaped read 1 more byte */
-    else if (*the_byte == ESC){
-        r = wrap_read(conn->fd, the_byte);
-        if (r < 0){
-            HAL_WARN("Error when reading byte [ERRNO %d: %s]",
-                errno, strerror(errno));
+    struct pollfd polled = {.fd = conn->fd, .events = POLLIN};
+    HALErr err = HALConn_read_input(conn);
+    while (err == OK && conn->rx_pos == conn->rx_len){
+        if (poll(&polled, 1, -1) < 0 || (polled.revents & (POLLERR|POLLHUP|POLLNVAL))){
             return READERR;
         }
-        conn->rx_bytes++;
+        err = HALConn_read_input(conn);
     }
-
-    return OK;
+    return err;
 }
 
-/* Write a full message */
+/* Write a full message, bypassing the writer queue. Only for use before
+   the reader thread is started. */
 HALErr HALConn_write_message(HALConnection *conn, const HALMsg *msg)
 {
-    const unsigned char *bytes = (const unsigned char *) msg;
-    HALErr r = 0;
-
-    /* Write 3 SYNCs bytes (prelude) */
-    for (int i=0; i<3; i++){
-        r = write(conn->fd, &SYNC, 1);
-        if (r != 1){
-            return WRITEERR;
-        }
-        conn->tx_bytes++;
+    assert(! HALConn_is_running(conn));
+    unsigned char frame[HALMSG_FRAME_MAX];
+    size_t len = HALMsg_encode(msg, frame);
+    if (conn->capture){
+        HALCapture_record(conn->capture, HALCAP_TX, frame, len);
     }
 
-    /* Write message itself */
-    size_t nbytes = ((size_t) msg->len) + 5;
-    for (size_t i=0; i<nbytes; i++){
-        r = HAL_write_byte(conn, bytes[i]);
-        if (r != OK){
-            return r;
+    for (size_t written=0; written<len;){
+        ssize_t r = write(conn->fd, frame+written, len-written);
+        if (r <= 0){
+            return WRITEERR;
         }
+        written += r;
+        conn->tx_bytes += r;
     }
 
+    conn->tx_frames++;
+    conn->tx_by_cmd[msg->cmd]++;
     dump_message(msg, " \033[1;34m<<\033[0m ");
 
     return OK;
 }
 
-/* Read a full message */
-HALErr HALConn_read_message(HALConnection *conn, HALMsg *msg)
+/* Feed buffered input to the decoder, until a message is decoded or the
+   input buffer is empty. If redirect is set, responses to pending requests
+   are decoded in the requester's message. Lock on connection must be held. */
+static HALDecoderRes HALConn_feed(HALConnection *conn, int redirect)
 {
-    int sync_count = 0;
-    unsigned char c;
-    int r;
+    HALDecoderRes res;
+    size_t consumed;
+
+    do {
+        res = HALDecoder_feed(&conn->decoder,
+                              conn->rx_buf + conn->rx_pos,
+                              conn->rx_len - conn->rx_pos,
+                              &consumed);
+        conn->rx_pos += consumed;
+
+        /* After a header, feed again: the message may be complete already
+           (empty body) */
+        HALMsg *msg = conn->decoder.msg;
+        if (res == HALDEC_HEADER && redirect && IS_DRIVER_SEQ(msg->seq)){
+            HALMsg *dest = conn->pending[ABSOLUTE_SEQ(msg->seq)];
+            if (dest){
+                memcpy(dest, msg, 5);
+                conn->decoder.msg = dest;
+            }
+        }
+    } while (res == HALDEC_HEADER);
 
-    /* 1. Find 3 consecutive SYNC */
-    while (sync_count != 3){
-        r = wrap_read(conn->fd, &c);
-        if (r < 0){
-            return READERR;
-        }
-        conn->rx_bytes++;
+    return res;
+}
 
-        if (c == SYNC){
-            sync_count ++;
-        } else {
-            sync_count = 0;
-        }
+/* Account for a message decoded by HALConn_feed */
+static HALErr HALConn_decoded(HALConnection *conn, HALDecoderRes res, HALMsg **received)
+{
+    if (res == HALDEC_BADSYNC){
+        conn->sync_errors++;
+        return OUTOFSYNC;
     }
 
-    /* 2. Read message header */
-    unsigned char *bytes = (unsigned char *)msg;
-    for (int i=0; i<5; i++){
-        r = HAL_read_byte(conn, bytes+i);
-        if (r != OK){
-            return r;
-        }
+    HALMsg *msg = conn->decoder.msg;
+    if (received){
+        *received = msg;
     }
+    conn->rx_frames++;
+    conn->rx_by_cmd[msg->cmd]++;
+    dump_message(msg, " \033[1;35m>>\033[0m ");
 
-    /* 3. Read body */
-    for (int i=0; i<msg->len; i++){
-        r = HAL_read_byte(conn, msg->data+i);
-        if (r != OK){
-            return r;
+    if (res != HALDEC_COMPLETE){
+        conn->chk_errors++;
+        return CHKERR;
+    }
+    return OK;
+}
+
+/* Read a full message in msg. If received is not NULL, responses to pending
+   requests are decoded in the requester's message instead, and received
+   points to where the message was decoded. Lock on connection must be held. */
+static HALErr HALConn_decode(HALConnection *conn, HALMsg *msg, HALMsg **received)
+{
+    HALDecoderRes res;
+
+    conn->decoder.msg = msg;
+    while ((res = HALConn_feed(conn, received != NULL)) == HALDEC_INCOMPLETE){
+        HALErr err = HALConn_fill(conn);
+        if (err != OK){
+            /* Do not resume decoding in a buffer that may be gone */
+            HALDecoder_init(&conn->decoder, NULL);
+            return err;
         }
     }
+    return HALConn_decoded(conn, res, received);
+}
 
-    dump_message(msg, " \033[1;35m>>\033[0m ");
+/* Read a full message */
+HALErr HALConn_read_message(HALConnection *conn, HALMsg *msg)
+{
+    return HALConn_decode(conn, msg, NULL);
+}
+
+/* Set ts to now + usecs */
+static void deadline_in(struct timespec *ts, unsigned long int usecs)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    unsigned long int nsecs = ts->tv_nsec + 1000*(usecs%1000000);
+    ts->tv_sec += usecs/1000000 + nsecs/1000000000l;
+    ts->tv_nsec = nsecs % 1000000000l;
+}
 
-    /* 4. Verify checksum */
-    return (HALMsg_checksum(msg) == msg->chk) ? OK : CHKERR;
+/* The reader does not hold the lock while waiting for the rest of a message.
+   If the message was being decoded in msg, which is about to be gone,
+   finish decoding it in the reader buffer instead. Lock on connection must
+   be held. */
+static void HALConn_detach_decoder(HALConnection *conn, HALMsg *msg)
+{
+    if (conn->decoder.msg == msg){
+        memcpy(&conn->rx_msg, msg, sizeof(HALMsg));
+        conn->decoder.msg = &conn->rx_msg;
+    }
 }
 
-HALErr HALConn_request(HALConnection *conn, HALMsg *msg)
+/* Attribute a seq no to msg, register it as destination of the response
+   and send it. Lock on connection must be held. */
+static HALErr HALConn_emit(HALConnection *conn, HALMsg *msg, unsigned char *seq)
+{
+    /* Acquire next SEQ no */
+    *seq = DRIVER_SEQ(conn->current_seq + 1);
+    if (conn->pending[ABSOLUTE_SEQ(*seq)]){
+        return SEQERR;
+    }
+
+    /* Attribute SEQ no, and register msg as destination of the response */
+    conn->pending[ABSOLUTE_SEQ(*seq)] = msg;
+    conn->done[ABSOLUTE_SEQ(*seq)] = 0;
+    conn->lost[ABSOLUTE_SEQ(*seq)] = 0;
+    conn->waiter[ABSOLUTE_SEQ(*seq)] = *seq;
+    msg->seq = conn->current_seq = *seq;
+    /* Compute and store checksum in msg */
+    msg->chk = HALMsg_checksum(msg);
+
+    HALErr r = HALConn_send(conn, msg);
+    if (r != OK){
+        conn->pending[ABSOLUTE_SEQ(*seq)] = NULL;
+    }
+    return r;
+}
+
+/* Emit msg and wait for its response. If hedge_usecs is not 0 and msg is
+   not answered by then, a copy of msg is sent again; the first response
+   is kept in msg. Background exchanges (heartbeats) are not counted in
+   flight, so that asks do not wait for a batch because of them, and time
+   out silently. If the writer could not write msg (nor its hedge), fail
+   with WRITEERR at once. Lock on connection must be held. */
+static HALErr HALConn_exchange(HALConnection *conn, HALMsg *msg, unsigned long int usecs,
+                               unsigned long int hedge_usecs, int background)
 {
     HALErr retval;
+    int r;
+    unsigned char seq, hedge_seq = 0;
+    int hedged = 0;
+
+    /* Responses are decoded in place, even corrupted ones: keep the
+       request intact for the hedge */
+    HALMsg hedge;
+    if (hedge_usecs > 0){
+        memcpy(&hedge, msg, 5 + (size_t) msg->len);
+    }
 
-    /* Acquire lock on connection */
-    int r = pthread_mutex_lock(&conn->mutex);
-    if (r != 0){
-        return LOCKERR;
+    r = HALConn_emit(conn, msg, &seq);
+    if (r != OK){
+        return r;
     }
 
-    /* Acquire next SEQ no */
-    unsigned char seq = DRIVER_SEQ(conn->current_seq + 1);
-    if (conn->used[ABSOLUTE_SEQ(seq)]){
-        retval = SEQERR;
+    struct timespec timeout, hedge_at;
+    deadline_in(&timeout, usecs);
+    if (hedge_usecs > 0){
+        deadline_in(&hedge_at, hedge_usecs);
     }
-    else {
-        /* Attribute SEQ no and emit message */
-        conn->used[ABSOLUTE_SEQ(seq)] = 1;
-        msg->seq = conn->current_seq = seq;
-        /* Compute and store checksum in msg */
-        msg->chk = HALMsg_checksum(msg);
 
-        r = HALConn_write_message(conn, msg);
-        if (r != OK){
-            retval = r;
-        }
-        else {
-            /* Set timeout in 500ms */
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            unsigned long int nsecs = timeout.tv_nsec + 500000000;
-            if (nsecs > 1000000000l){
-                timeout.tv_sec++;
+    /* Wait for response (decoded in msg, or hedge, by the reader thread) */
+    if (! background){
+        conn->n_inflight++;
+    }
+    r = 0;
+    while (! conn->done[seq] && ! (hedged && conn->done[hedge_seq]) &&
+           ! (conn->lost[seq] && (! hedged || conn->lost[hedge_seq])) && r == 0){
+        if (hedge_usecs > 0){
+            r = pthread_cond_timedwait(conn->waits+seq, &conn->mutex, &hedge_at);
+            if (r == ETIMEDOUT && ! conn->done[seq] && ! conn->lost[seq]){
+                if (HALConn_emit(conn, &hedge, &hedge_seq) == OK){
+                    /* Both responses wake us up */
+                    conn->waiter[hedge_seq] = seq;
+                    conn->hedges++;
+                    hedged = 1;
+                    HAL_DEBUG("Ask %02hhx not answered after %lu usec; sent again with seq %02hhx",
+                              seq, hedge_usecs, hedge_seq);
+                }
+                hedge_usecs = r = 0;
             }
-            timeout.tv_nsec = nsecs % 1000000000l;
-
-            /* Wait for response */
+        } else {
             r = pthread_cond_timedwait(conn->waits+seq, &conn->mutex, &timeout);
-            if (r == ETIMEDOUT){
-                retval = TIMEOUT;
-                HAL_WARN("Timeout on message");
-                dump_message(msg, "Timeouted request");
-            }
-            else if (r != 0){
-                retval = UNKNERR;
-            }
-            else {
-                memcpy(msg, conn->responses+seq, sizeof(HALMsg));
-                retval = OK;
-            }
         }
-
-        /* Mark as unused */
-        conn->used[ABSOLUTE_SEQ(seq)] = 0;
+    }
+    if (! background){
+        conn->n_inflight--;
+    }
+    if (conn->done[seq]){
+        retval = OK;
+    }
+    else if (hedged && conn->done[hedge_seq]){
+        memcpy(msg, &hedge, 5 + (size_t) hedge.len);
+        conn->hedge_wins++;
+        retval = OK;
+    }
+    else if (conn->lost[seq] && (! hedged || conn->lost[hedge_seq])){
+        retval = WRITEERR;
+    }
+    else if (r == ETIMEDOUT){
+        retval = TIMEOUT;
+        if (! background){
+            HAL_WARN("Timeout on message");
+            dump_message(msg, "Timeouted request");
+        }
+    }
+    else {
+        retval = UNKNERR;
     }
 
-    /* Release lock; we're done */
-    pthread_mutex_unlock(&conn->mutex);
+    /* Mark as unused; a late response is ignored */
+    conn->pending[ABSOLUTE_SEQ(seq)] = NULL;
+    HALConn_detach_decoder(conn, msg);
+    if (hedged){
+        conn->pending[ABSOLUTE_SEQ(hedge_seq)] = NULL;
+        HALConn_detach_decoder(conn, &hedge);
+    }
     return retval;
 }
 
-struct reader_opts {
-    HALConnection *conn;
-    const char **trigger_names;
-    size_t n_triggers;
-};
+/* Emit heartbeat msg and wait for its response (boards that ignore
+   heartbeats never answer). Lock on connection must be held. */
+static HALErr HALConn_transact_heartbeat(HALConnection *conn, HALMsg *msg, unsigned long int usecs)
+{
+    return HALConn_exchange(conn, msg, usecs, 0, 1);
+}
 
-static void HALConn_trigger_socket(HALConnection *conn, const char *name, int state)
+static int compare_latencies(const void *a, const void *b)
 {
-    int r;
-    char buf[256];
-    int len = snprintf(buf, sizeof(buf)-1, "%s:%d\n", name, state);
+    unsigned long int x = *(const unsigned long int *) a, y = *(const unsigned long int *) b;
+    return (x > y) - (x < y);
+}
 
-    for (size_t i=0; i<conn->n_sock_clients; i++){
-        HAL_DEBUG("%d << %s", conn->sock_clients[i], buf);
-        r = send(conn->sock_clients[i], buf, len, MSG_NOSIGNAL);
-        if (r < 0){
-            HAL_WARN("Lost listener %d", conn->sock_clients[i]);
-            close(conn->sock_clients[i]);
-            conn->n_sock_clients--;
-            if (conn->n_sock_clients > 0){
-                conn->sock_clients[i] = conn->sock_clients[conn->n_sock_clients];
+/* Compute the hedging delay from recent asks latencies. Lock on connection
+   must be held. */
+static void HALConn_update_hedge_delay(HALConnection *conn)
+{
+    if (conn->n_asks < HALCONN_HEDGE_WINDOW/4){
+        /* Not enough asks yet */
+        conn->hedge_delay = 0;
+        return;
+    }
+
+    size_t n = (conn->n_asks < HALCONN_HEDGE_WINDOW) ? conn->n_asks : HALCONN_HEDGE_WINDOW;
+    unsigned long int sorted[HALCONN_HEDGE_WINDOW];
+    memcpy(sorted, conn->ask_latencies, n*sizeof(unsigned long int));
+    qsort(sorted, n, sizeof(unsigned long int), compare_latencies);
+    conn->hedge_delay = sorted[(n-1) * conn->hedge_percentile / 100];
+    if (conn->hedge_delay < HALCONN_HEDGE_MIN_DELAY){
+        conn->hedge_delay = HALCONN_HEDGE_MIN_DELAY;
+    }
+}
+
+/* Account for an ask answered in usecs. Lock on connection must be held. */
+static void HALConn_ask_done(HALConnection *conn, unsigned long int usecs)
+{
+    conn->ask_latencies[conn->n_asks % HALCONN_HEDGE_WINDOW] = usecs;
+    conn->n_asks++;
+    if (conn->n_asks % HALCONN_HEDGE_REFRESH == 0){
+        HALConn_update_hedge_delay(conn);
+    }
+}
+
+/* Emit msg and wait for its response; asks (which are idempotent) are
+   hedged. Lock on connection must be held. */
+static HALErr HALConn_transact(HALConnection *conn, HALMsg *msg)
+{
+    if (MSG_IS_CHANGE(msg)){
+        return HALConn_exchange(conn, msg, HALCONN_TIMEOUT, 0, 0);
+    }
+
+    unsigned long int hedge_usecs = 0;
+    if (conn->hedge_percentile > 0 && conn->hedge_delay > 0 && conn->hedge_delay < HALCONN_TIMEOUT){
+        hedge_usecs = conn->hedge_delay;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HALErr retval = HALConn_exchange(conn, msg, HALCONN_TIMEOUT, hedge_usecs, 0);
+    if (retval == OK){
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        HALConn_ask_done(conn, 1000000l*(end.tv_sec - start.tv_sec) +
+                               (end.tv_nsec - start.tv_nsec)/1000);
+    }
+    return retval;
+}
+
+/* Send all asks of batch in a single MULTI ask, and dispatch answers */
+static void HALConn_send_batch(HALConnection *conn, struct HALBatch *batch)
+{
+    HALMsg multi = {.cmd=(PARAM_ASK|MULTI), .rid=0, .len=0};
+    for (size_t i=0; i<batch->n; i++){
+        HALMsg_multi_add(&multi, batch->msgs[i]->cmd, batch->msgs[i]->rid);
+        batch->errs[i] = UNKNERR;
+    }
+
+    HALErr err = HALConn_transact(conn, &multi);
+    if (err != OK){
+        for (size_t i=0; i<batch->n; i++){
+            batch->errs[i] = err;
+        }
+        return;
+    }
+
+    HALMsg entry;
+    size_t offset = 0;
+    while (HALMsg_multi_next(&multi, &offset, &entry)){
+        for (size_t i=0; i<batch->n; i++){
+            HALMsg *msg = batch->msgs[i];
+            if (batch->errs[i] != OK && msg->cmd == entry.cmd && msg->rid == entry.rid){
+                msg->seq = multi.seq;
+                msg->len = entry.len;
+                memcpy(msg->data, entry.data, entry.len);
+                msg->chk = HALMsg_checksum(msg);
+                batch->errs[i] = OK;
+                break;
             }
         }
     }
 }
 
-static void HALConn_dispatch(HALConnection *conn, HALMsg *msg, struct reader_opts *opts)
+static void HALBatch_release(struct HALBatch *batch)
 {
-    if (IS_DRIVER_SEQ(msg->seq)){
-        size_t i = ABSOLUTE_SEQ(msg->seq);
-        memcpy(conn->responses+i, msg, sizeof(HALMsg));
-        pthread_cond_signal(conn->waits+i);
+    batch->refs--;
+    if (batch->refs == 0){
+        pthread_cond_destroy(&batch->cond);
+        free(batch);
     }
-    else {
-        if (MSG_TYPE(msg) == HAL_PING){
-            HALConn_write_message(conn, msg);
-        } else if (MSG_TYPE(msg) == BOOT){
-            HAL_WARN("Arduino rebooted");
-        } else if (msg->cmd == (TRIGGER|PARAM_CHANGE)){
-            unsigned char trigger_id = msg->rid;
-            unsigned char state = msg->data[0];
-            if (trigger_id < opts->n_triggers){
-                HALConn_trigger_socket(conn, opts->trigger_names[trigger_id], state);
-            }
+}
+
+/* Ask msg as part of a MULTI ask. Lock on connection must be held. */
+static HALErr HALConn_batch_request(HALConnection *conn, HALMsg *msg, int value_len)
+{
+    struct HALBatch *batch = conn->batch;
+    size_t entry_len = 3 + value_len;
+    HALErr retval;
+
+    /* Join the batch being collected, if there is room left */
+    if (batch && batch->n < HALCONN_BATCH_MAX && batch->answer_len + entry_len <= 255){
+        size_t i = batch->n++;
+        batch->msgs[i] = msg;
+        batch->answer_len += entry_len;
+        batch->refs++;
+        if (batch->n == HALCONN_BATCH_MAX){
+            /* Batch is full: wake up leader */
+            pthread_cond_broadcast(&batch->cond);
+        }
+        while (! batch->done){
+            pthread_cond_wait(&batch->cond, &conn->mutex);
+        }
+        retval = batch->errs[i];
+        HALBatch_release(batch);
+        return retval;
+    }
+
+    /* Otherwise, start a new batch and lead it */
+    batch = calloc(1, sizeof(struct HALBatch));
+    if (! batch){
+        return HALConn_transact(conn, msg);
+    }
+    pthread_cond_init(&batch->cond, NULL);
+    batch->msgs[0] = msg;
+    batch->n = 1;
+    batch->answer_len = entry_len;
+    batch->refs = 1;
+    conn->batch = batch;
+
+    /* Let other asks join the batch during the window */
+    struct timespec window;
+    deadline_in(&window, conn->batch_window);
+    while (batch->n < HALCONN_BATCH_MAX){
+        if (pthread_cond_timedwait(&batch->cond, &conn->mutex, &window) == ETIMEDOUT){
+            break;
         }
     }
+    if (conn->batch == batch){
+        conn->batch = NULL;
+    }
+
+    if (batch->n == 1){
+        batch->errs[0] = HALConn_transact(conn, msg);
+    } else {
+        HAL_DEBUG("Sending %lu asks in a single message", (unsigned long int) batch->n);
+        HALConn_send_batch(conn, batch);
+    }
+
+    /* Fan out to other asks in this batch */
+    batch->done = 1;
+    pthread_cond_broadcast(&batch->cond);
+    retval = batch->errs[0];
+    HALBatch_release(batch);
+    return retval;
 }
 
-static void *HALConn_reader_thread(void *arg)
+/* Upload animation frames, packed if the Arduino supports it and if it is
+   worth it. Lock on connection must be held. */
+static HALErr HALConn_upload_frames(HALConnection *conn, HALMsg *msg)
 {
-    struct reader_opts *opts = (struct reader_opts *) arg;
-    HALConnection *conn = opts->conn;
-    int r = 0;
-    HALMsg msg;
-    struct pollfd polled[2] = {
-        {.fd = conn->fd, .events = POLLIN},
-        {.fd = conn->sock, .events = POLLIN},
-    };
+    unsigned char anim = msg->rid;
+    unsigned char raw[255], delta[255];
+    size_t raw_len = msg->len, packed_len, best_len = msg->len;
+    HALMsg packed = {.cmd=(PARAM_CHANGE|ANIMATION_PACKED), .rid=anim, .len=0};
+    HALErr err;
+
+    memcpy(raw, msg->data, raw_len);
+
+    if (conn->features & HAL_FEAT_RLE){
+        packed_len = HALPack_rle(raw, raw_len, packed.data+2, 253);
+        if (packed_len > 0 && packed_len+2 < best_len){
+            packed.data[0] = HAL_PACK_RLE;
+            packed.len = packed_len+2;
+            best_len = packed.len;
+        }
+    }
 
-    HAL_INFO("Reader thread started");
+    struct HALShadow *ref = HALConn_shadow_get(conn, ANIMATION_FRAMES, anim);
+    if ((conn->features & HAL_FEAT_DELTA) && ref){
+        unsigned char delta_packed[253];
+        HALPack_delta(ref->data, ref->len, raw, raw_len, delta);
+        packed_len = HALPack_rle(delta, raw_len, delta_packed, sizeof(delta_packed));
+        if (packed_len > 0 && packed_len+2 < best_len){
+            packed.data[0] = HAL_PACK_DELTA;
+            memcpy(packed.data+2, delta_packed, packed_len);
+            packed.len = packed_len+2;
+            best_len = packed.len;
+        }
+    }
 
-    while (HALConn_is_running(conn)){
-        /* Wait for arduino readyness */
-        do {r = poll(polled, 2, 1000);}
-        while (r == 0);
+    if (packed.len > 0){
+        HAL_DEBUG("Upload %lu bytes of frames in %hhu bytes (packing %hhu)",
+                  (unsigned long int) raw_len, packed.len, packed.data[0]);
+        packed.data[1] = raw_len;
+        err = HALConn_transact(conn, &packed);
+        if (err == OK){
+            memcpy(msg, &packed, 5 + (size_t) packed.len);
+        }
+    } else {
+        err = HALConn_transact(conn, msg);
+    }
 
-        if (r < 0){
-            HAL_ERROR(UNKNERR, "Poll error");
-            continue;
+    /* Keep track of frames on the Arduino */
+    if (err == OK){
+        HALConn_shadow_set(conn, ANIMATION_FRAMES, anim, raw, raw_len);
+    } else {
+        HALConn_shadow_forget(conn, ANIMATION_FRAMES, anim);
+    }
+
+    return err;
+}
+
+static void HALFlight_release(struct HALFlight *flight)
+{
+    flight->refs--;
+    if (flight->refs == 0){
+        pthread_cond_destroy(&flight->cond);
+        free(flight);
+    }
+}
+
+/* If an identical ask is in flight, wait for its response instead of asking
+   again and return 1. Otherwise, register msg as in flight in *flight (if
+   possible) and return 0. Lock on connection must be held. */
+static int HALConn_join_flight(HALConnection *conn, HALMsg *msg, struct HALFlight **flight, HALErr *err)
+{
+    struct HALFlight *cur;
+    for (cur=conn->flights; cur; cur=cur->next){
+        if (cur->cmd == msg->cmd && cur->rid == msg->rid){
+            break;
+        }
+    }
+
+    if (cur){
+        conn->flight_hits++;
+        cur->refs++;
+        while (! cur->done){
+            pthread_cond_wait(&cur->cond, &conn->mutex);
         }
+        *err = cur->err;
+        if (cur->err == OK){
+            memcpy(msg, &cur->response, 5 + (size_t) cur->response.len);
+        }
+        HALFlight_release(cur);
+        return 1;
+    }
 
-        /* Acquire lock and read message */
-        r = pthread_mutex_lock(&conn->mutex);
-        if (r == 0){
-            if ((polled[0].revents) & POLLIN){
-                r = HALConn_read_message(conn, &msg);
-                if (r == OK){
-                    HALConn_dispatch(conn, &msg, opts);
-                } else {
-                    HAL_ERROR(r, "Error while acquiring message in reader thread");
-                }
-                polled[0].revents = 0;
-            }
+    cur = malloc(sizeof(struct HALFlight));
+    if (cur){
+        cur->cmd = msg->cmd;
+        cur->rid = msg->rid;
+        cur->done = 0;
+        cur->refs = 1;
+        pthread_cond_init(&cur->cond, NULL);
+        cur->next = conn->flights;
+        conn->flights = cur;
+    }
+    *flight = cur;
+    return 0;
+}
 
-            if ((polled[1].revents) & POLLIN){
-                int fd = accept(conn->sock, NULL, NULL);
-                conn->sock_clients[conn->n_sock_clients] = fd;
-                conn->n_sock_clients++;
-                HAL_INFO("New listener: %d", fd);
-                polled[1].revents = 0;
-            }
+/* Hand response over to identical asks. Lock on connection must be held. */
+static void HALConn_land_flight(HALConnection *conn, struct HALFlight *flight, const HALMsg *msg, HALErr err)
+{
+    struct HALFlight **cur = &conn->flights;
+    while (*cur != flight){
+        cur = &(*cur)->next;
+    }
+    *cur = flight->next;
 
-            pthread_mutex_unlock(&conn->mutex);
+    if (flight->refs > 1){
+        if (err == OK){
+            memcpy(&flight->response, msg, 5 + (size_t) msg->len);
         }
+        flight->err = err;
+        flight->done = 1;
+        pthread_cond_broadcast(&flight->cond);
     }
+    HALFlight_release(flight);
+}
 
-    HAL_INFO("Reader thread terminated");
+HALErr HALConn_request(HALConnection *conn, HALMsg *msg)
+{
+    return HALConn_request_flags(conn, msg, 0);
+}
 
-    return NULL;
+/* Serve a request. Lock on connection must be held. */
+static HALErr HALConn_serve(HALConnection *conn, HALMsg *msg, int flags)
+{
+    HALErr retval;
+    struct HALFlight *flight = NULL;
+    unsigned char type = MSG_TYPE(msg), changed[255], changed_len = 0;
+
+    /* Serve asks from the shadow state if possible */
+    struct HALShadow *shadow = HALConn_shadow_get(conn, type, msg->rid);
+    if (! MSG_IS_CHANGE(msg) && shadow && conn->shadow_reads && ! (flags & HALCONN_DEVICE_READ)){
+        msg->len = shadow->len;
+        memcpy(msg->data, shadow->data, shadow->len);
+        msg->chk = HALMsg_checksum(msg);
+        conn->shadow_hits++;
+        return OK;
+    }
+    /* Link is down: fail right away; heartbeats tell when it is back */
+    if (conn->degraded){
+        return TIMEOUT;
+    }
+
+    if (MSG_IS_CHANGE(msg)){
+        /* Msg is overwritten by the response */
+        changed_len = msg->len;
+        memcpy(changed, msg->data, changed_len);
+    }
+
+    /* Identical concurrent asks share a single round trip */
+    if (! MSG_IS_CHANGE(msg) && msg->len == 0 && HALConn_join_flight(conn, msg, &flight, &retval)){
+        return retval;
+    }
+
+    /* Asks for fixed size values are aggregated, as long as there are
+       other requests in flight (otherwise, there is no point in waiting) */
+    int value_len = HALMsg_value_len(msg->cmd);
+    if (msg->cmd == (PARAM_CHANGE|ANIMATION_FRAMES)){
+        retval = HALConn_upload_frames(conn, msg);
+    }
+    else if ((conn->features & HAL_FEAT_MULTI) && conn->batch_window > 0 &&
+        ! MSG_IS_CHANGE(msg) && value_len > 0 &&
+        (conn->batch || conn->n_inflight > 0)){
+        retval = HALConn_batch_request(conn, msg, value_len);
+    } else {
+        retval = HALConn_transact(conn, msg);
+    }
+
+    if (flight){
+        HALConn_land_flight(conn, flight, msg, retval);
+    }
+
+    /* Keep shadow state up to date (frames are handled on upload) */
+    if (msg->cmd != (PARAM_CHANGE|ANIMATION_FRAMES)){
+        if (retval != OK && changed_len > 0){
+            HALConn_shadow_forget(conn, type, msg->rid);
+        } else if (retval == OK){
+            if (changed_len > 0){
+                if (HALConn_shadow_set(conn, type, msg->rid, changed, changed_len)){
+                    HALConn_changed(conn, type, msg->rid);
+                }
+            } else {
+                HALConn_shadow_set(conn, type, msg->rid, msg->data, msg->len);
+            }
+        }
+    }
+
+    return retval;
 }
 
-int HALConn_run_reader(HALConnection *conn, const char **trigger_names, size_t n_triggers)
+/* Account for a request completed in usecs. Lock on connection must be held. */
+static void HALConn_account_request(HALConnection *conn, HALErr err, unsigned long int usecs)
 {
-    struct reader_opts *opts = calloc(1, sizeof(struct reader_opts));
-    opts->conn = conn;
-    opts->trigger_names = trigger_names;
-    opts->n_triggers = n_triggers;
-    conn->running = 1;
-    return pthread_create(&conn->reader_thread, NULL, HALConn_reader_thread, opts);
+    int bucket = 0;
+    while (bucket < HALCONN_LATENCY_BUCKETS-1 && usecs > HALConn_latency_bounds[bucket]){
+        bucket++;
+    }
+    conn->latency[bucket]++;
+    conn->latency_sum += usecs / 1e6;
+    conn->requests[(err < HALCONN_ERRORS) ? err : UNKNERR]++;
 }
 
-void HALConn_stop_reader(HALConnection *conn)
+HALErr HALConn_request_flags(HALConnection *conn, HALMsg *msg, int flags)
 {
-    pthread_mutex_lock(&conn->mutex);
-    conn->running = 0;
-    pthread_mutex_unlock(&conn->mutex);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    void *retval;
-    pthread_join(conn->reader_thread, &retval);
+    /* Acquire lock on connection */
+    int r = pthread_mutex_lock(&conn->mutex);
+    if (r != 0){
+        return LOCKERR;
+    }
+
+    HALErr retval = HALConn_serve(conn, msg, flags);
+    if (retval == TIMEOUT && ! conn->degraded){
+        /* Check the link right away */
+        pthread_cond_signal(&conn->heartbeat_cond);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    HALConn_account_request(conn, retval, 1000000l*(end.tv_sec - start.tv_sec) +
+                                          (end.tv_nsec - start.tv_nsec)/1000);
+
+    /* Release lock; we're done */
+    pthread_mutex_unlock(&conn->mutex);
+    return retval;
 }
 
-int HALConn_is_running(HALConnection *conn)
+/* Ask the Arduino to switch to baudrate, and follow it */
+static HALErr HALConn_set_remote_baudrate(HALConnection *conn, unsigned int baudrate)
 {
-    int r = 0;
+    HALMsg msg = {.cmd=(PARAM_CHANGE|BAUDRATE), .rid=0, .len=4};
+    msg.data[0] = (baudrate >> 24) & 0xff;
+    msg.data[1] = (baudrate >> 16) & 0xff;
+    msg.data[2] = (baudrate >> 8) & 0xff;
+    msg.data[3] = baudrate & 0xff;
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return err;
+    }
+
     pthread_mutex_lock(&conn->mutex);
-    r = conn->running;
+    tcdrain(conn->fd);
+    if (set_baudrate(conn->fd, baudrate)){
+        conn->baudrate = baudrate;
+    } else {
+        err = UNKNERR;
+    }
     pthread_mutex_unlock(&conn->mutex);
-    return r;
+    return err;
 }
 
-size_t HALConn_rx_bytes(HALConnection *conn)
+/* Go back to the default rate; the Arduino does the same on its own */
+static void HALConn_fallback_baudrate(HALConnection *conn)
 {
-    size_t res = 0;
+    HALConn_set_remote_baudrate(conn, HAL_DEFAULT_BAUDRATE);
+
     pthread_mutex_lock(&conn->mutex);
-    res = conn->rx_bytes;
+    set_baudrate(conn->fd, HAL_DEFAULT_BAUDRATE);
+    conn->baudrate = HAL_DEFAULT_BAUDRATE;
+    pthread_mutex_unlock(&conn->mutex);
+
+    struct timespec fallback_delay = {
+        .tv_sec = HAL_BAUD_FALLBACK_MS / 1000,
+        .tv_nsec = 1000000l * (HAL_BAUD_FALLBACK_MS % 1000)
+    };
+    nanosleep(&fallback_delay, NULL);
+
+    /* Drop garbage received meanwhile */
+    pthread_mutex_lock(&conn->mutex);
+    tcflush(conn->fd, TCIFLUSH);
+    conn->rx_pos = conn->rx_len = 0;
+    HALDecoder_init(&conn->decoder, NULL);
     pthread_mutex_unlock(&conn->mutex);
-    return res;
 }
 
-size_t HALConn_tx_bytes(HALConnection *conn)
+#ifndef HALCONN_BAUD_PROBES
+#define HALCONN_BAUD_PROBES 8
+#endif
+
+/* Switch to baudrate; fall back to default if the link is not clean */
+static void HALConn_switch_baudrate(HALConnection *conn, unsigned int baudrate)
 {
-    size_t res = 0;
-    pthread_mutex_lock(&conn->mutex);
-    res = conn->tx_bytes;
+    HALErr err = HALConn_set_remote_baudrate(conn, baudrate);
+    if (err != OK){
+        HAL_ERROR(err, "Unable to switch to %u bauds", baudrate);
+        if (err == UNKNERR){
+            HALConn_fallback_baudrate(conn);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    size_t chk_errors = conn->chk_errors;
+    pthread_mutex_unlock(&conn->mutex);
+
+    /* Probe the link at the new rate */
+    for (int i=0; i<HALCONN_BAUD_PROBES && err == OK; i++){
+        HALMsg probe = {.cmd=(PARAM_ASK|FEATURES), .rid=0, .len=0};
+        err = HALConn_request(conn, &probe);
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    chk_errors = conn->chk_errors - chk_errors;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (err != OK || chk_errors > 0){
+        HAL_WARN("Link unreliable at %u bauds (%lu checksum errors); back to %d",
+                 baudrate, (unsigned long int) chk_errors, HAL_DEFAULT_BAUDRATE);
+        HALConn_fallback_baudrate(conn);
+    } else {
+        HAL_INFO("Switched to %u bauds", baudrate);
+    }
+}
+
+void HALConn_negotiate(HALConnection *conn)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|FEATURES), .rid=0, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    unsigned char features = 0;
+
+    if (err == OK && msg.len > 0){
+        features = msg.data[0];
+    } else {
+        HAL_INFO("Arduino did not announce features; using basic protocol");
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    conn->features = features;
+    pthread_mutex_unlock(&conn->mutex);
+    HAL_DEBUG("Arduino features: %02hhx", features);
+
+    unsigned int baudrate = conn->opts.baudrate;
+    if (baudrate != 0 && baudrate != HAL_DEFAULT_BAUDRATE){
+        if (features & HAL_FEAT_BAUD){
+            HALConn_switch_baudrate(conn, baudrate);
+        } else {
+            HAL_WARN("Arduino cannot change baudrate; staying at %d", HAL_DEFAULT_BAUDRATE);
+        }
+    }
+}
+
+struct reader_opts {
+    HALConnection *conn;
+    const char **trigger_names;
+    size_t n_triggers;
+};
+
+/* Close listener i; the last one takes its place. Lock must be held. */
+static void HALConn_drop_listener(HALConnection *conn, size_t i)
+{
+    HAL_WARN("Lost listener %d", conn->sock_clients[i].fd);
+    close(conn->sock_clients[i].fd);
+    conn->n_sock_clients--;
+    conn->sock_clients[i] = conn->sock_clients[conn->n_sock_clients];
+}
+
+/* Format event seq of the journal as "seq ts name:state" */
+static int format_event(HALConnection *conn, struct reader_opts *opts, uint64_t seq, char *buf, size_t size)
+{
+    const struct HALJournalEntry *event = conn->journal + (seq % HALCONN_JOURNAL_SIZE);
+    const char *name = (event->rid < opts->n_triggers) ? opts->trigger_names[event->rid] : "?";
+    return snprintf(buf, size, "%lu %lu.%06lu %s:%d\n", (unsigned long int) seq,
+                    (unsigned long int) (event->ts / 1000000),
+                    (unsigned long int) (event->ts % 1000000),
+                    name, event->state);
+}
+
+/* Oldest event still in the journal */
+static uint64_t HALConn_journal_oldest(HALConnection *conn)
+{
+    return (conn->event_seq >= HALCONN_JOURNAL_SIZE) ? conn->event_seq - HALCONN_JOURNAL_SIZE + 1 : 1;
+}
+
+/* True if sequenced listener i has events (or part of a line) to be sent.
+   Lock must be held. */
+static int HALConn_listener_behind(HALConnection *conn, size_t i)
+{
+    const struct HALListener *listener = conn->sock_clients + i;
+    return listener->sequenced &&
+           (listener->out_pos < listener->out_len || listener->next <= conn->event_seq);
+}
+
+/* Send sequenced listener i the events of the journal from its position,
+   until it is up to date or its socket is full. A listener that falls
+   behind the journal is told "lost" and continues from the oldest event.
+   Returns 0 if the listener left. Lock must be held. */
+static int HALConn_flush_listener(HALConnection *conn, struct reader_opts *opts, size_t i)
+{
+    struct HALListener *listener = conn->sock_clients + i;
+
+    while (HALConn_listener_behind(conn, i)){
+        if (listener->out_pos == listener->out_len){
+            uint64_t oldest = HALConn_journal_oldest(conn);
+            if (listener->next < oldest){
+                listener->out_len = snprintf(listener->out, sizeof(listener->out), "lost\n");
+                listener->next = oldest;
+            } else {
+                listener->out_len = format_event(conn, opts, listener->next++,
+                                                 listener->out, sizeof(listener->out));
+            }
+            listener->out_pos = 0;
+        }
+        ssize_t r = send(listener->fd, listener->out + listener->out_pos,
+                         listener->out_len - listener->out_pos, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (r < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        listener->out_pos += r;
+    }
+    return 1;
+}
+
+/* Record a trigger change in the journal, and send it to listeners */
+static void HALConn_trigger_socket(HALConnection *conn, struct reader_opts *opts, unsigned char trigger_id, int state)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t seq = ++conn->event_seq;
+    struct HALJournalEntry *event = conn->journal + (seq % HALCONN_JOURNAL_SIZE);
+    event->ts = 1000000ull*now.tv_sec + now.tv_nsec/1000;
+    event->rid = trigger_id;
+    event->state = state;
+
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf)-1, "%s:%d\n", opts->trigger_names[trigger_id], state);
+
+    size_t i = 0;
+    while (i < conn->n_sock_clients){
+        int ok;
+        HAL_DEBUG("%d << %s", conn->sock_clients[i].fd, buf);
+        if (conn->sock_clients[i].sequenced){
+            ok = HALConn_flush_listener(conn, opts, i);
+        } else {
+            /* A listener that does not read its events is not waited for */
+            ok = send(conn->sock_clients[i].fd, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT) == len;
+        }
+        if (ok){
+            i++;
+        } else {
+            HALConn_drop_listener(conn, i);
+        }
+    }
+}
+
+/* Switch listener i to sequenced events, from the events of the journal
+   after since. "lost" tells that some of them are not in the journal
+   anymore (or that the driver restarted). Lock must be held. */
+static int HALConn_resume_listener(HALConnection *conn, struct reader_opts *opts, size_t i, uint64_t since)
+{
+    struct HALListener *listener = conn->sock_clients + i;
+    uint64_t oldest = HALConn_journal_oldest(conn);
+
+    listener->next = since + 1;
+    if (since > conn->event_seq){
+        /* Driver restarted: resend the whole journal */
+        listener->next = 0;
+    }
+    HAL_INFO("Listener %d resumes from %lu%s", listener->fd,
+             (unsigned long int) ((listener->next < oldest) ? oldest : listener->next),
+             (listener->next < oldest) ? " (some events lost)" : "");
+    listener->sequenced = 1;
+    return HALConn_flush_listener(conn, opts, i);
+}
+
+/* Handle a request line of listener i ("SINCE <seq>"). Returns 0 if the
+   listener left. Lock must be held. */
+static int HALConn_listener_request(HALConnection *conn, struct reader_opts *opts, size_t i, const char *line)
+{
+    unsigned long int since;
+    if (sscanf(line, "SINCE %lu", &since) != 1){
+        HAL_WARN("Unexpected request from listener %d", conn->sock_clients[i].fd);
+        return 1;
+    }
+    return HALConn_resume_listener(conn, opts, i, since);
+}
+
+/* Read requests of listener i, or notice it left. Requests are lines, which
+   may come in several reads. Returns 0 if the listener left. Lock must be
+   held. */
+static int HALConn_listener_read(HALConnection *conn, struct reader_opts *opts, size_t i)
+{
+    struct HALListener *listener = conn->sock_clients + i;
+    ssize_t r = recv(listener->fd, listener->in + listener->in_len,
+                     sizeof(listener->in) - 1 - listener->in_len, MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return 1;
+    }
+    if (r <= 0){
+        return 0;
+    }
+    listener->in_len += r;
+    listener->in[listener->in_len] = '\0';
+
+    char *line = listener->in, *eol;
+    while ((eol = strchr(line, '\n'))){
+        *eol = '\0';
+        if (! HALConn_listener_request(conn, opts, i, line)){
+            return 0;
+        }
+        line = eol + 1;
+    }
+    listener->in_len -= line - listener->in;
+    memmove(listener->in, line, listener->in_len);
+    if (listener->in_len == sizeof(listener->in) - 1){
+        HAL_WARN("Request too long from listener %d", listener->fd);
+        listener->in_len = 0;
+    }
+    return 1;
+}
+
+/* Serve the listener on fd: read its requests, or notice it left, and send
+   it pending events if it can take them. Lock must be held. */
+static void HALConn_listener_ready(HALConnection *conn, struct reader_opts *opts, int fd, short revents)
+{
+    size_t i = 0;
+    while (i < conn->n_sock_clients && conn->sock_clients[i].fd != fd){
+        i++;
+    }
+    if (i == conn->n_sock_clients){
+        return;
+    }
+
+    if ((revents & ~POLLOUT) && ! HALConn_listener_read(conn, opts, i)){
+        HALConn_drop_listener(conn, i);
+    }
+    else if ((revents & POLLOUT) && ! HALConn_flush_listener(conn, opts, i)){
+        HALConn_drop_listener(conn, i);
+    }
+}
+
+/* Publish an event in the shared memory ring, if any. Lock must be held. */
+static void HALConn_publish(HALConnection *conn, unsigned char type, unsigned char rid,
+                            const unsigned char *data, size_t len)
+{
+    if (conn->ring){
+        HALRing_publish(conn->ring, type, rid, data, len);
+    }
+}
+
+static void HALConn_dispatch(HALConnection *conn, HALMsg *msg, struct reader_opts *opts)
+{
+    if (IS_DRIVER_SEQ(msg->seq)){
+        /* Response was decoded in the requester's message; just wake it up */
+        size_t i = ABSOLUTE_SEQ(msg->seq);
+        if (conn->pending[i] == msg){
+            conn->done[i] = 1;
+            pthread_cond_signal(conn->waits+conn->waiter[i]);
+        } else {
+            HAL_DEBUG("Unexpected response (seq %02hhx)", msg->seq);
+        }
+    }
+    else {
+        if (MSG_TYPE(msg) == HAL_PING){
+            HALConn_send(conn, msg);
+        } else if (MSG_TYPE(msg) == BOOT){
+            HAL_WARN("Arduino rebooted");
+            HALConn_forget_shadow(conn);
+        } else if (MSG_IS_CHANGE(msg) && shadow_index(MSG_TYPE(msg)) >= 0){
+            /* Resource changed on the Arduino side */
+            HALConn_publish(conn, MSG_TYPE(msg), msg->rid, msg->data, msg->len);
+            if (HALConn_shadow_set(conn, MSG_TYPE(msg), msg->rid, msg->data, msg->len)){
+                HALConn_changed(conn, MSG_TYPE(msg), msg->rid);
+            }
+        } else if (msg->cmd == (TRIGGER|PARAM_CHANGE)){
+            unsigned char trigger_id = msg->rid;
+            unsigned char state = msg->data[0];
+            if (trigger_id < opts->n_triggers){
+                conn->events++;
+                HALConn_trigger_socket(conn, opts, trigger_id, state);
+                HALConn_publish(conn, TRIGGER, trigger_id, &state, 1);
+                HALConn_changed(conn, TRIGGER, trigger_id);
+            }
+        }
+    }
+}
+
+/* Accept a new client on the event socket. Lock on connection must be held. */
+static void HALConn_accept_listener(HALConnection *conn)
+{
+    int fd = accept(conn->sock, NULL, NULL);
+    if (fd < 0){
+        return;
+    }
+    if (conn->n_sock_clients >= HALCONN_SOCK_CLIENTS){
+        HAL_WARN("Too many listeners; rejecting %d", fd);
+        close(fd);
+        return;
+    }
+    struct HALListener *listener = conn->sock_clients + conn->n_sock_clients;
+    memset(listener, 0, sizeof(struct HALListener));
+    listener->fd = fd;
+    conn->n_sock_clients++;
+    HAL_INFO("New listener: %d", fd);
+}
+
+/* Decode and dispatch buffered input. A message may be completed by a later
+   call. Lock on connection must be held. */
+static HALErr HALConn_process(HALConnection *conn, struct reader_opts *opts)
+{
+    HALErr retval = OK;
+    HALMsg *received;
+
+    while (conn->rx_pos < conn->rx_len){
+        /* Continue decoding of a message started in previous call */
+        if (! conn->decoder.in_msg || ! conn->decoder.msg){
+            conn->decoder.msg = &conn->rx_msg;
+        }
+        HALDecoderRes res = HALConn_feed(conn, 1);
+        if (res != HALDEC_INCOMPLETE){
+            HALErr r = HALConn_decoded(conn, res, &received);
+            if (r == OK){
+                HALConn_dispatch(conn, received, opts);
+            } else {
+                retval = r;
+            }
+        }
+    }
+    return retval;
+}
+
+static void *HALConn_reader_thread(void *arg)
+{
+    struct reader_opts *opts = (struct reader_opts *) arg;
+    HALConnection *conn = opts->conn;
+    int r = 0;
+    struct pollfd polled[2+HALCONN_SOCK_CLIENTS] = {
+        {.fd = conn->fd, .events = POLLIN},
+        {.fd = conn->sock, .events = POLLIN},
+    };
+    size_t n_polled = 2;
+
+    HAL_INFO("Reader thread started");
+
+    while (HALConn_is_running(conn)){
+        /* Listeners may send requests, or wait for their backlog. Only
+           this thread adds or removes them. */
+        pthread_mutex_lock(&conn->mutex);
+        int buffered = conn->rx_pos < conn->rx_len;
+        n_polled = 2 + conn->n_sock_clients;
+        for (size_t i=2; i<n_polled; i++){
+            polled[i].fd = conn->sock_clients[i-2].fd;
+            polled[i].events = POLLIN;
+            if (HALConn_listener_behind(conn, i-2)){
+                polled[i].events |= POLLOUT;
+            }
+            polled[i].revents = 0;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        /* Wait for arduino readyness, unless there are buffered bytes */
+        if (buffered){
+            polled[0].revents = POLLIN;
+            polled[1].revents = 0;
+            r = 1;
+        } else {
+            r = poll(polled, n_polled, 1000);
+        }
+        if (r == 0){
+            continue;
+        }
+        else if (r < 0){
+            HAL_ERROR(UNKNERR, "Poll error");
+            continue;
+        }
+
+        /* Acquire lock and read message */
+        r = pthread_mutex_lock(&conn->mutex);
+        if (r == 0){
+            /* Never wait for input with the lock held: requesters must be
+               able to time out (or hedge) while a message is incomplete */
+            if ((polled[0].revents) & POLLIN){
+                /* Bytes left in the buffer (for instance after those read
+                   before the reader started) are decoded first */
+                r = OK;
+                if (conn->rx_pos == conn->rx_len){
+                    r = HALConn_read_input(conn);
+                }
+                if (r == OK){
+                    r = HALConn_process(conn, opts);
+                }
+                if (r != OK){
+                    HAL_ERROR(r, "Error while acquiring message in reader thread");
+                }
+                polled[0].revents = 0;
+            }
+
+            for (size_t i=2; i<n_polled; i++){
+                if (polled[i].revents){
+                    HALConn_listener_ready(conn, opts, polled[i].fd, polled[i].revents);
+                }
+            }
+
+            if ((polled[1].revents) & POLLIN){
+                HALConn_accept_listener(conn);
+                polled[1].revents = 0;
+            }
+
+            pthread_mutex_unlock(&conn->mutex);
+        }
+    }
+
+    HAL_INFO("Reader thread terminated");
+
+    return NULL;
+}
+
+/* Account for a heartbeat answered in rtt usecs (-1: lost). Lock must be held. */
+static void HALConn_heartbeat_done(HALConnection *conn, long int rtt)
+{
+    size_t last = (conn->heartbeats + HALCONN_HEARTBEAT_WINDOW - 1) % HALCONN_HEARTBEAT_WINDOW;
+    long int prev = (conn->heartbeats > 0) ? conn->heartbeat_rtts[last] : -1;
+    conn->heartbeat_rtts[conn->heartbeats % HALCONN_HEARTBEAT_WINDOW] = rtt;
+    conn->heartbeats++;
+
+    if (rtt < 0){
+        conn->heartbeats_lost++;
+        conn->heartbeat_misses++;
+        if (conn->link_answered && ! conn->degraded &&
+            conn->heartbeat_misses >= HALCONN_HEARTBEAT_MISSES){
+            conn->degraded = 1;
+            HAL_WARN("Link degraded: %lu heartbeats lost", (unsigned long int) conn->heartbeat_misses);
+        }
+        return;
+    }
+
+    /* Interarrival jitter, as in RFC 3550 */
+    if (prev >= 0){
+        long int diff = (rtt > prev) ? rtt - prev : prev - rtt;
+        conn->jitter += (diff - conn->jitter) / 16;
+    }
+    conn->heartbeat_misses = 0;
+    conn->link_answered = 1;
+    if (conn->degraded){
+        conn->degraded = 0;
+        HAL_INFO("Link recovered (rtt %ldus)", rtt);
+    }
+}
+
+/* Send a PING ask every heartbeat interval (or right away when a request
+   timed out); more often while the link is degraded */
+static void *HALConn_heartbeat_thread(void *arg)
+{
+    HALConnection *conn = arg;
+    struct timespec deadline, start, end;
+
+    pthread_mutex_lock(&conn->mutex);
+    while (conn->running){
+        unsigned int interval = conn->heartbeat_interval;
+        if (interval == 0){
+            pthread_cond_wait(&conn->heartbeat_cond, &conn->mutex);
+            continue;
+        }
+        if (conn->degraded){
+            interval = (interval + 3) / 4;
+        }
+        deadline_in(&deadline, 1000l*interval);
+        int r = pthread_cond_timedwait(&conn->heartbeat_cond, &conn->mutex, &deadline);
+        if (! conn->running || conn->heartbeat_interval == 0){
+            continue;
+        }
+        if (r != 0 && r != ETIMEDOUT){
+            continue;
+        }
+
+        HALMsg ping = {.cmd=(PARAM_ASK|HAL_PING), .rid=0, .len=0};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        HALErr err = HALConn_transact_heartbeat(conn, &ping, HALCONN_HEARTBEAT_TIMEOUT);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (err == OK){
+            HALConn_heartbeat_done(conn, 1000000l*(end.tv_sec - start.tv_sec) +
+                                         (end.tv_nsec - start.tv_nsec)/1000);
+        } else if (err == TIMEOUT){
+            HALConn_heartbeat_done(conn, -1);
+        }
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    return NULL;
+}
+
+/* Ask sampled sensors at a fixed rate, and add answers to their history */
+static void *HALConn_sampler_thread(void *arg)
+{
+    HALConnection *conn = arg;
+    struct timespec deadline, now;
+    unsigned char rids[256];
+
+    pthread_mutex_lock(&conn->mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while (conn->running){
+        unsigned int interval = conn->sampling_interval;
+        if (interval == 0){
+            pthread_cond_wait(&conn->sampler_cond, &conn->mutex);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            continue;
+        }
+
+        /* Next tick; skip ticks missed (slow link) */
+        clock_gettime(CLOCK_REALTIME, &now);
+        long int nsecs = deadline.tv_nsec + 1000000l*(interval%1000);
+        deadline.tv_sec += interval/1000 + nsecs/1000000000l;
+        deadline.tv_nsec = nsecs % 1000000000l;
+        if (deadline.tv_sec < now.tv_sec ||
+            (deadline.tv_sec == now.tv_sec && deadline.tv_nsec < now.tv_nsec)){
+            deadline_in(&deadline, 1000l*interval);
+        }
+        int r = pthread_cond_timedwait(&conn->sampler_cond, &conn->mutex, &deadline);
+        if (! conn->running || conn->sampling_interval == 0 || r != ETIMEDOUT){
+            /* Stopped, or interval changed: start over from now */
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            continue;
+        }
+
+        int n = 0;
+        for (int i=0; i<256; i++){
+            if (conn->sampled[i]){
+                rids[n++] = i;
+            }
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        for (int i=0; i<n; i++){
+            HALMsg msg = {.cmd=(PARAM_ASK|SENSOR), .rid=rids[i], .len=0};
+            if (HALConn_request(conn, &msg) == OK){
+                clock_gettime(CLOCK_REALTIME, &now);
+                HALHistory_add(conn->histories[rids[i]],
+                               1000000ull*now.tv_sec + now.tv_nsec/1000,
+                               (msg.data[0] << 8) | msg.data[1]);
+                pthread_mutex_lock(&conn->mutex);
+                HALConn_publish(conn, SENSOR, rids[i], msg.data, 2);
+                pthread_mutex_unlock(&conn->mutex);
+            }
+        }
+        pthread_mutex_lock(&conn->mutex);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    return NULL;
+}
+
+int HALConn_run_reader(HALConnection *conn, const char **trigger_names, size_t n_triggers)
+{
+    struct reader_opts *opts = calloc(1, sizeof(struct reader_opts));
+    opts->conn = conn;
+    opts->trigger_names = trigger_names;
+    opts->n_triggers = n_triggers;
+    conn->running = 1;
+    int r = HALConn_start_thread(conn, &conn->reader_thread, HALConn_reader_thread, opts);
+    if (r == 0){
+        HALConn_start_thread(conn, &conn->heartbeat_thread, HALConn_heartbeat_thread, conn);
+        HALConn_start_thread(conn, &conn->sampler_thread, HALConn_sampler_thread, conn);
+    }
+    return r;
+}
+
+HALErr HALConn_replay(HALConnection *conn, const unsigned char *bytes, size_t len,
+                      const char **trigger_names, size_t n_triggers)
+{
+    struct reader_opts opts = {
+        .conn = conn,
+        .trigger_names = trigger_names,
+        .n_triggers = n_triggers
+    };
+    struct pollfd polled = {.fd = conn->sock, .events = POLLIN};
+    HALErr retval = OK;
+
+    int r = pthread_mutex_lock(&conn->mutex);
+    if (r != 0){
+        return LOCKERR;
+    }
+
+    /* Accept listeners that connected meanwhile, and serve their requests */
+    while (poll(&polled, 1, 0) > 0 && (polled.revents & POLLIN)){
+        HALConn_accept_listener(conn);
+    }
+    size_t i = conn->n_sock_clients;
+    while (i > 0){
+        struct pollfd listener = {.fd = conn->sock_clients[--i].fd, .events = POLLIN};
+        if (poll(&listener, 1, 0) > 0){
+            HALConn_listener_ready(conn, &opts, listener.fd, listener.revents);
+        }
+    }
+
+    while (len > 0 || conn->rx_pos < conn->rx_len){
+        /* Refill input buffer, as HALConn_read_input would */
+        if (conn->rx_pos == conn->rx_len){
+            size_t n = (len < sizeof(conn->rx_buf)) ? len : sizeof(conn->rx_buf);
+            memcpy(conn->rx_buf, bytes, n);
+            conn->rx_pos = 0;
+            conn->rx_len = n;
+            conn->rx_bytes += n;
+            bytes += n;
+            len -= n;
+        }
+
+        r = HALConn_process(conn, &opts);
+        if (r != OK){
+            retval = r;
+        }
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+    return retval;
+}
+
+void HALConn_stop_reader(HALConnection *conn)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->running = 0;
+    pthread_cond_signal(&conn->heartbeat_cond);
+    pthread_cond_signal(&conn->sampler_cond);
+    pthread_mutex_unlock(&conn->mutex);
+
+    void *retval;
+    pthread_join(conn->sampler_thread, &retval);
+    pthread_join(conn->heartbeat_thread, &retval);
+    pthread_join(conn->reader_thread, &retval);
+}
+
+int HALConn_is_running(HALConnection *conn)
+{
+    int r = 0;
+    pthread_mutex_lock(&conn->mutex);
+    r = conn->running;
+    pthread_mutex_unlock(&conn->mutex);
+    return r;
+}
+
+size_t HALConn_rx_bytes(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->rx_bytes;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+size_t HALConn_tx_bytes(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->tx_bytes;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+unsigned int HALConn_baudrate(HALConnection *conn)
+{
+    unsigned int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->baudrate;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+size_t HALConn_rx_frames(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->rx_frames;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+/* Counters are updated with atomic operations by senders and the writer */
+static void HALConn_get_tx_stats(HALConnection *conn, HALTxClass tx_class, HALTxStats *stats)
+{
+    HALTxStats *src = &conn->tx_queues[tx_class].stats;
+    stats->depth = __atomic_load_n(&src->depth, __ATOMIC_RELAXED);
+    stats->max_depth = __atomic_load_n(&src->max_depth, __ATOMIC_RELAXED);
+    stats->sent = __atomic_load_n(&src->sent, __ATOMIC_RELAXED);
+    stats->promoted = __atomic_load_n(&src->promoted, __ATOMIC_RELAXED);
+}
+
+size_t HALConn_shadow_hits(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->shadow_hits;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+int HALConn_shadow_reads(HALConnection *conn)
+{
+    int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->shadow_reads;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_set_shadow_reads(HALConnection *conn, int enabled)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->shadow_reads = enabled;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+size_t HALConn_dedup_hits(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->flight_hits;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+size_t HALConn_chk_errors(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->chk_errors;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+size_t HALConn_sync_errors(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->sync_errors;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+size_t HALConn_events(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->events;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+/* Lock on connection must be held */
+static void HALConn_get_link_stats(HALConnection *conn, HALLinkStats *stats)
+{
+    memset(stats, 0, sizeof(HALLinkStats));
+    stats->degraded = conn->degraded;
+    stats->sent = conn->heartbeats;
+    stats->lost = conn->heartbeats_lost;
+    stats->jitter = conn->jitter;
+
+    size_t n = (conn->heartbeats < HALCONN_HEARTBEAT_WINDOW) ? conn->heartbeats : HALCONN_HEARTBEAT_WINDOW;
+    unsigned long int sum = 0;
+    size_t answered = 0;
+    for (size_t i=0; i<n; i++){
+        long int rtt = conn->heartbeat_rtts[i];
+        if (rtt < 0){
+            stats->window_lost++;
+            continue;
+        }
+        if (answered == 0 || (unsigned long int) rtt < stats->rtt_min){
+            stats->rtt_min = rtt;
+        }
+        if ((unsigned long int) rtt > stats->rtt_max){
+            stats->rtt_max = rtt;
+        }
+        sum += rtt;
+        answered++;
+    }
+    stats->window = n;
+    if (answered > 0){
+        stats->rtt_avg = sum / answered;
+    }
+    if (n > 0){
+        long int last = conn->heartbeat_rtts[(conn->heartbeats - 1) % HALCONN_HEARTBEAT_WINDOW];
+        stats->rtt_last = (last < 0) ? 0 : last;
+    }
+}
+
+void HALConn_link_stats(HALConnection *conn, HALLinkStats *stats)
+{
+    pthread_mutex_lock(&conn->mutex);
+    HALConn_get_link_stats(conn, stats);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+void HALConn_stats(HALConnection *conn, HALConnStats *stats)
+{
+    pthread_mutex_lock(&conn->mutex);
+    stats->rx_bytes = conn->rx_bytes;
+    stats->tx_bytes = conn->tx_bytes;
+    stats->rx_frames = conn->rx_frames;
+    stats->tx_frames = conn->tx_frames;
+    memcpy(stats->rx_by_cmd, conn->rx_by_cmd, sizeof(stats->rx_by_cmd));
+    memcpy(stats->tx_by_cmd, conn->tx_by_cmd, sizeof(stats->tx_by_cmd));
+    stats->chk_errors = conn->chk_errors;
+    stats->sync_errors = conn->sync_errors;
+    stats->events = conn->events;
+    memcpy(stats->requests, conn->requests, sizeof(stats->requests));
+    memcpy(stats->latency, conn->latency, sizeof(stats->latency));
+    stats->latency_sum = conn->latency_sum;
+    stats->inflight = conn->n_inflight;
+    stats->shadow_hits = conn->shadow_hits;
+    stats->dedup_hits = conn->flight_hits;
+    stats->hedges = conn->hedges;
+    stats->hedge_wins = conn->hedge_wins;
+    stats->listeners = conn->n_sock_clients;
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        HALConn_get_tx_stats(conn, i, stats->tx+i);
+    }
+    stats->baudrate = conn->baudrate;
+    stats->uptime = time(NULL) - conn->start_time;
+    HALConn_get_link_stats(conn, &stats->link);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Effective scheduling of thread */
+static int format_thread_sched(pthread_t thread, const char *name, char *buf, size_t size)
+{
+    int policy;
+    struct sched_param param;
+    cpu_set_t cpus;
+    char cpu_list[256] = "?";
+
+    if (pthread_getschedparam(thread, &policy, &param) != 0){
+        return snprintf(buf, size, "%s ?\n", name);
+    }
+    if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) == 0){
+        format_cpus(&cpus, cpu_list, sizeof(cpu_list));
+    }
+    const char *policy_name = (policy == SCHED_FIFO) ? "fifo" : (policy == SCHED_RR) ? "rr" : "other";
+    return snprintf(buf, size, "%s policy=%s priority=%d cpus=%s\n",
+                    name, policy_name, param.sched_priority, cpu_list);
+}
+
+int HALConn_sched(HALConnection *conn, char *buf, size_t size)
+{
+    int len = format_thread_sched(conn->writer_thread, "writer", buf, size);
+    if (HALConn_is_running(conn) && (size_t) len < size){
+        len += format_thread_sched(conn->reader_thread, "reader", buf+len, size-len);
+    }
+    if (HALConn_is_running(conn) && (size_t) len < size){
+        len += format_thread_sched(conn->heartbeat_thread, "heartbeat", buf+len, size-len);
+    }
+    if (HALConn_is_running(conn) && (size_t) len < size){
+        len += format_thread_sched(conn->sampler_thread, "sampler", buf+len, size-len);
+    }
+    if ((size_t) len < size){
+        len += snprintf(buf+len, size-len, "mlock=%d\n", conn->mlocked);
+    }
+    return ((size_t) len < size) ? len : (int) size;
+}
+
+unsigned int HALConn_heartbeat(HALConnection *conn)
+{
+    unsigned int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->heartbeat_interval;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_set_heartbeat(HALConnection *conn, unsigned int msecs)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->heartbeat_interval = msecs;
+    if (msecs == 0 && conn->degraded){
+        /* Nothing would tell when the link is back */
+        conn->degraded = 0;
+    }
+    pthread_cond_signal(&conn->heartbeat_cond);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+unsigned int HALConn_hedge_percentile(HALConnection *conn)
+{
+    unsigned int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->hedge_percentile;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_set_hedge_percentile(HALConnection *conn, unsigned int percentile)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->hedge_percentile = (percentile < 100) ? percentile : 99;
+    HALConn_update_hedge_delay(conn);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+unsigned long int HALConn_hedge_delay(HALConnection *conn)
+{
+    unsigned long int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = (conn->hedge_percentile > 0) ? conn->hedge_delay : 0;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+uint64_t HALConn_event_seq(HALConnection *conn)
+{
+    uint64_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->event_seq;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+unsigned int HALConn_sampling(HALConnection *conn)
+{
+    unsigned int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->sampling_interval;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_set_sampling(HALConnection *conn, unsigned int msecs)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->sampling_interval = msecs;
+    pthread_cond_signal(&conn->sampler_cond);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+int HALConn_set_history(HALConnection *conn, unsigned char rid, int enabled)
+{
+    int res = 1;
+    pthread_mutex_lock(&conn->mutex);
+    if (enabled && ! conn->histories[rid]){
+        conn->histories[rid] = HALHistory_create(HALCONN_HISTORY_SIZE);
+        res = (conn->histories[rid] != NULL);
+    }
+    conn->sampled[rid] = enabled && res;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+HALHistory *HALConn_history(HALConnection *conn, unsigned char rid)
+{
+    HALHistory *res = NULL;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->histories[rid];
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_on_change(HALConnection *conn, HALChangeHandler handler, void *arg)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->change_handler = handler;
+    conn->change_arg = arg;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+size_t HALConn_tx_frames(HALConnection *conn)
+{
+    size_t res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->tx_frames;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+unsigned int HALConn_batch_window(HALConnection *conn)
+{
+    unsigned int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    res = conn->batch_window;
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+void HALConn_set_batch_window(HALConnection *conn, unsigned int usecs)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->batch_window = usecs;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+int HALConn_start_capture(HALConnection *conn, const char *path, size_t size)
+{
+    HALCapture *capture = HALCapture_open(path, size);
+    if (! capture){
+        HAL_WARN("Unable to capture in %s [ERRNO %d: %s]", path, errno, strerror(errno));
+        return 0;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    HALCapture *previous = conn->capture;
+    conn->capture = capture;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (previous){
+        HALCapture_close(previous);
+    }
+    HAL_INFO("Capturing serial traffic in %s", path);
+    return 1;
+}
+
+void HALConn_stop_capture(HALConnection *conn)
+{
+    pthread_mutex_lock(&conn->mutex);
+    HALCapture *capture = conn->capture;
+    conn->capture = NULL;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (capture){
+        HAL_INFO("Stopped capture in %s", HALCapture_path(capture));
+        HALCapture_close(capture);
+    }
+}
+
+int HALConn_start_ring(HALConnection *conn, const char *name, size_t capacity)
+{
+    pthread_mutex_lock(&conn->mutex);
+    HALRing *previous = conn->ring;
+    conn->ring = NULL;
+    pthread_mutex_unlock(&conn->mutex);
+    if (previous){
+        HALRing_close(previous);
+    }
+
+    HALRing *ring = HALRing_create(name, capacity);
+    if (! ring){
+        HAL_WARN("Unable to create event ring %s [ERRNO %d: %s]", name, errno, strerror(errno));
+        return 0;
+    }
+    pthread_mutex_lock(&conn->mutex);
+    conn->ring = ring;
+    pthread_mutex_unlock(&conn->mutex);
+
+    HAL_INFO("Publishing events in shared memory %s", name);
+    return 1;
+}
+
+void HALConn_stop_ring(HALConnection *conn)
+{
+    pthread_mutex_lock(&conn->mutex);
+    HALRing *ring = conn->ring;
+    conn->ring = NULL;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (ring){
+        HAL_INFO("Stopped publishing events in %s", HALRing_name(ring));
+        HALRing_close(ring);
+    }
+}
+
+int HALConn_ring_name(HALConnection *conn, char *buf, size_t size)
+{
+    int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    if (conn->ring){
+        res = snprintf(buf, size, "%s", HALRing_name(conn->ring));
+    } else if (size > 0){
+        buf[0] = '\0';
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    return res;
+}
+
+int HALConn_capture_path(HALConnection *conn, char *buf, size_t size)
+{
+    int res = 0;
+    pthread_mutex_lock(&conn->mutex);
+    if (conn->capture){
+        res = snprintf(buf, size, "%s", HALCapture_path(conn->capture));
+    } else if (size > 0){
+        buf[0] = '\0';
+    }
     pthread_mutex_unlock(&conn->mutex);
     return res;
 }
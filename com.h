@@ -2,6 +2,7 @@
 #define DEFINE_COM_HEADER
 
 #include "HALMsg.h"
+#include "history.h"
 
 /*!
  *  Connection to the arduino. Manage requests and responses,
@@ -22,7 +23,25 @@ typedef enum HALErr {
     UNKNERR   = 8  //!< Unknown error
 } HALErr;
 
-HALConnection *HALConn_open(const char *path, const char *sock_path);
+/*!
+ *  Connection settings
+ */
+typedef struct HALConnOpts {
+    unsigned int baudrate;      //!< Baudrate to negotiate with the Arduino (0: default)
+    int low_latency;            //!< Ask the tty driver not to buffer incoming bytes
+    unsigned int latency_timer; //!< USB-serial latency timer, in ms (0: keep default)
+    int sched_policy;           //!< SCHED_FIFO or SCHED_RR for I/O threads (0: default scheduling)
+    unsigned int sched_priority; //!< Real-time priority of I/O threads (0: default)
+    const char *cpus;           //!< CPUs I/O threads may run on, e.g. "0,2-3" (NULL: any)
+    int mlock;                  //!< Lock all memory (including I/O threads stacks)
+} HALConnOpts;
+
+HALConnection *HALConn_open(const char *path, const char *sock_path, const HALConnOpts *opts);
+
+/*!
+ *  Same as HALConn_open, on an already opened (and configured) fd
+ */
+HALConnection *HALConn_open_fd(int fd, const char *sock_path, const HALConnOpts *opts);
 
 /*!
  *  Close connection to Arduino
@@ -37,10 +56,15 @@ void HALConn_close(HALConnection *conn);
 HALErr HALConn_read_message(HALConnection *conn, HALMsg *msg);
 
 
+/*!
+ *  Write msg right away, regardless of other transmissions. Only for use
+ *  before the reader thread is started.
+ */
 HALErr HALConn_write_message(HALConnection *conn, const HALMsg *msg);
 
 /*!
- *  Send request to HAL and wait for response
+ *  Send request to HAL and wait for response. Asks that are identical to an
+ *  ask in flight (same command and rid) share its response.
  *  @param conn The HAL connection to use
  *  @param msg [in+out] Message to send. Contains the response if return value
                         is OK
@@ -48,6 +72,31 @@ HALErr HALConn_write_message(HALConnection *conn, const HALMsg *msg);
  */
 HALErr HALConn_request(HALConnection *conn, HALMsg *msg);
 
+/* Ask the Arduino even if the value is known from the shadow state */
+#define HALCONN_DEVICE_READ 0x01
+
+/*!
+ *  Same as HALConn_request. Asks of writable resources (switches, colors,
+ *  animations) are answered from the last known value (acknowledged change,
+ *  unsolicited change or previous answer), unless flags has
+ *  HALCONN_DEVICE_READ or shadow reads are disabled. Other requests fail
+ *  with TIMEOUT right away while the link is degraded (see HALLinkStats).
+ */
+HALErr HALConn_request_flags(HALConnection *conn, HALMsg *msg, int flags);
+
+/*!
+ *  Ask the Arduino which optional protocol features it supports, and switch
+ *  to the requested baudrate if possible. Must be called once the reader is
+ *  running.
+ *  @param conn The HAL connection to use
+ */
+void HALConn_negotiate(HALConnection *conn);
+
+/*!
+ *  Current baudrate of the serial link
+ */
+unsigned int HALConn_baudrate(HALConnection *conn);
+
 /*!
  *  Start the read thread, and call reader for each correctly received message
  *  @param conn The HAL connection to use
@@ -57,6 +106,15 @@ int HALConn_run_reader(HALConnection *conn, const char **trigger_names, size_t n
 
 void HALConn_stop_reader(HALConnection *conn);
 
+/*!
+ *  Process bytes as if they were received from the Arduino, through the same
+ *  decoding and dispatching path as the reader thread. A message may span
+ *  several calls. Must not be used while the reader thread is running.
+ *  @return OK, or the last decoding error (CHKERR, OUTOFSYNC)
+ */
+HALErr HALConn_replay(HALConnection *conn, const unsigned char *bytes, size_t len,
+                      const char **trigger_names, size_t n_triggers);
+
 int HALConn_is_running(HALConnection *conn);
 
 int HALConn_uptime(HALConnection *conn);
@@ -65,6 +123,228 @@ size_t HALConn_rx_bytes(HALConnection *conn);
 
 size_t HALConn_tx_bytes(HALConnection *conn);
 
+size_t HALConn_rx_frames(HALConnection *conn);
+
+size_t HALConn_tx_frames(HALConnection *conn);
+
+/*!
+ *  Transmit classes, by decreasing priority. A class that is passed over too
+ *  many times gets the next turn anyway.
+ */
+typedef enum HALTxClass {
+    HALCONN_TX_CONTROL     = 0, //!< Link control (PING, features, baudrate...)
+    HALCONN_TX_INTERACTIVE = 1, //!< Changes (switches, colors...)
+    HALCONN_TX_READ        = 2, //!< Asks
+    HALCONN_TX_BULK        = 3, //!< Animation frames uploads
+    HALCONN_TX_CLASSES     = 4
+} HALTxClass;
+
+/*!
+ *  Counters of a transmit class, in HALConnStats.tx (see HALConn_stats)
+ */
+typedef struct HALTxStats {
+    size_t depth;     //!< Frames currently waiting
+    size_t max_depth; //!< Max number of frames waiting at once
+    size_t sent;      //!< Frames transmitted
+    size_t promoted;  //!< Turns given because of starvation protection
+} HALTxStats;
+
+/*!
+ *  Health of the link, measured by heartbeats (PING asks sent periodically by
+ *  the driver). Round trip times are in usec, over the recent heartbeats.
+ */
+typedef struct HALLinkStats {
+    int degraded;           //!< Heartbeats are lost: requests fail right away
+    size_t sent;            //!< Heartbeats sent
+    size_t lost;            //!< Heartbeats not answered in time
+    size_t window;          //!< Number of recent heartbeats
+    size_t window_lost;     //!< Recent heartbeats not answered in time
+    unsigned long int rtt_last;
+    unsigned long int rtt_min;
+    unsigned long int rtt_avg;
+    unsigned long int rtt_max;
+    unsigned long int jitter; //!< Smoothed variation of round trip time
+} HALLinkStats;
+
+void HALConn_link_stats(HALConnection *conn, HALLinkStats *stats);
+
+/*!
+ *  Delay (in ms) between 2 heartbeats. 0 disables heartbeats (and the link
+ *  is never considered degraded).
+ */
+unsigned int HALConn_heartbeat(HALConnection *conn);
+
+void HALConn_set_heartbeat(HALConnection *conn, unsigned int msecs);
+
+/*!
+ *  Delay (in ms) between 2 samples of sensors that have a history. 0 (the
+ *  default) stops sampling.
+ */
+unsigned int HALConn_sampling(HALConnection *conn);
+
+void HALConn_set_sampling(HALConnection *conn, unsigned int msecs);
+
+/*!
+ *  Start (or stop) keeping a history of sensor rid. A stopped history keeps
+ *  its samples.
+ *  @return 0 if the history cannot be allocated, 1 otherwise
+ */
+int HALConn_set_history(HALConnection *conn, unsigned char rid, int enabled);
+
+/*!
+ *  History of sensor rid (see history.h), or NULL if it was never enabled.
+ *  Valid until the connection is closed.
+ */
+HALHistory *HALConn_history(HALConnection *conn, unsigned char rid);
+
+/*!
+ *  Asks not answered after this percentile (1-99) of recent asks latencies
+ *  are sent again, and the first response wins. Changes are never sent
+ *  again. 0 disables hedging.
+ */
+unsigned int HALConn_hedge_percentile(HALConnection *conn);
+
+void HALConn_set_hedge_percentile(HALConnection *conn, unsigned int percentile);
+
+/*!
+ *  Current delay (in usec) after which asks are sent again (0: no hedging,
+ *  or not enough asks to know the latency yet)
+ */
+unsigned long int HALConn_hedge_delay(HALConnection *conn);
+
+/* Number of HALErr values */
+#define HALCONN_ERRORS (UNKNERR+1)
+
+/* Number of request latency buckets (the last one has no upper bound) */
+#define HALCONN_LATENCY_BUCKETS 14
+
+/*!
+ *  Upper bounds (in usec) of request latency buckets, but the last one
+ */
+extern const unsigned long int HALConn_latency_bounds[HALCONN_LATENCY_BUCKETS-1];
+
+/*!
+ *  Snapshot of the connection counters
+ */
+typedef struct HALConnStats {
+    size_t rx_bytes;
+    size_t tx_bytes;
+    size_t rx_frames;
+    size_t tx_frames;
+    size_t rx_by_cmd[256];     //!< Frames received, by command
+    size_t tx_by_cmd[256];     //!< Frames transmitted, by command
+    size_t chk_errors;
+    size_t sync_errors;
+    size_t events;
+    size_t requests[HALCONN_ERRORS]; //!< Requests completed, by result
+    size_t latency[HALCONN_LATENCY_BUCKETS]; //!< Requests, by latency bucket
+    double latency_sum;        //!< Sum of requests latencies (in sec)
+    size_t inflight;           //!< Requests waiting for a response
+    size_t shadow_hits;
+    size_t dedup_hits;
+    size_t hedges;             //!< Asks sent again because not answered in time
+    size_t hedge_wins;         //!< Hedged asks answered by the copy first
+    size_t listeners;          //!< Clients of the event socket
+    HALTxStats tx[HALCONN_TX_CLASSES];
+    HALLinkStats link;
+    unsigned int baudrate;
+    int uptime;
+} HALConnStats;
+
+void HALConn_stats(HALConnection *conn, HALConnStats *stats);
+
+/*!
+ *  Number of asks answered from the shadow state
+ */
+size_t HALConn_shadow_hits(HALConnection *conn);
+
+/*!
+ *  Whether asks are answered from the shadow state (default: 1)
+ */
+int HALConn_shadow_reads(HALConnection *conn);
+
+void HALConn_set_shadow_reads(HALConnection *conn, int enabled);
+
+/*!
+ *  Number of asks answered with the response of an identical concurrent ask
+ */
+size_t HALConn_dedup_hits(HALConnection *conn);
+
+size_t HALConn_chk_errors(HALConnection *conn);
+
+/*!
+ *  Number of messages dropped because of an unexpected SYNC byte
+ */
+size_t HALConn_sync_errors(HALConnection *conn);
+
+/*!
+ *  Number of events (triggers) sent to listeners of the event socket
+ */
+size_t HALConn_events(HALConnection *conn);
+
+/*!
+ *  Sequence number of the last event (0: none yet). Events are kept in a
+ *  bounded journal; a listener that sends "SINCE <seq>\n" on the event
+ *  socket gets the events after seq still in the journal (preceded by
+ *  "lost\n" if some are missing), then all events as "seq ts name:state\n".
+ */
+uint64_t HALConn_event_seq(HALConnection *conn);
+
+/*!
+ *  Function called when a resource changes: trigger change, or new value of
+ *  a writable resource (announced by the Arduino, or acknowledged change).
+ *  It is called with the connection lock held, and must not make requests.
+ */
+typedef void (*HALChangeHandler)(void *arg, unsigned char type, unsigned char rid);
+
+void HALConn_on_change(HALConnection *conn, HALChangeHandler handler, void *arg);
+
+/*!
+ *  Time window (in usec) during which concurrent asks are aggregated in a
+ *  single MULTI ask. 0 disables aggregation.
+ */
+unsigned int HALConn_batch_window(HALConnection *conn);
+
+void HALConn_set_batch_window(HALConnection *conn, unsigned int usecs);
+
+/*!
+ *  Start capturing raw serial traffic in a ring file of size bytes (see
+ *  capture.h). A capture in progress is stopped.
+ *  @return 1 on success, 0 otherwise
+ */
+int HALConn_start_capture(HALConnection *conn, const char *path, size_t size);
+
+void HALConn_stop_capture(HALConnection *conn);
+
+/*!
+ *  Copy path of the capture in progress (if any) in buf
+ *  @return Length of path, 0 if there is no capture in progress
+ */
+int HALConn_capture_path(HALConnection *conn, char *buf, size_t size);
+
+/*!
+ *  Start publishing events (trigger changes, changes announced by the
+ *  Arduino, sensor samples) in a ring of capacity events, in the shared
+ *  memory object name (see eventring.h). A ring in use is removed.
+ *  @return 1 on success, 0 otherwise
+ */
+int HALConn_start_ring(HALConnection *conn, const char *name, size_t capacity);
+
+void HALConn_stop_ring(HALConnection *conn);
+
+/*!
+ *  Copy name of the event ring in use (if any) in buf
+ *  @return Length of name, 0 if there is no ring in use
+ */
+int HALConn_ring_name(HALConnection *conn, char *buf, size_t size);
+
 const char *HALConn_sock_path(HALConnection *conn);
 
+/*!
+ *  Describe effective scheduling of I/O threads (policy, priority, CPUs) and
+ *  memory locking in buf, one line per thread
+ *  @return Length of the description
+ */
+int HALConn_sched(HALConnection *conn, char *buf, size_t size);
+
 #endif
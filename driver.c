@@ -1,10 +1,17 @@
 #include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include "hal.h"
 #include "logger.h"
+#include "metrics.h"
+#include "watch.h"
 
 #define streq(s1,s2) (strcmp((s1),(s2)) == 0)
 #define HAL_IDX(cat,name) idx(name, hal->cat, hal->n_##cat)
@@ -12,11 +19,46 @@
 static HAL *hal = NULL;
 static int my_uid, my_gid;
 
+/* Driver options (-o name=value) */
+static HALConnOpts hal_opts = {.baudrate=0, .low_latency=0, .latency_timer=0};
+
+#define HAL_OPT(templ,field,value) {templ, offsetof(HALConnOpts, field), value}
+static struct fuse_opt hal_opts_spec[] = {
+    HAL_OPT("baud=%u", baudrate, 0),
+    HAL_OPT("low_latency", low_latency, 1),
+    HAL_OPT("latency_timer=%u", latency_timer, 0),
+    HAL_OPT("sched=fifo", sched_policy, SCHED_FIFO),
+    HAL_OPT("sched=rr", sched_policy, SCHED_RR),
+    HAL_OPT("rt_priority=%u", sched_priority, 0),
+    HAL_OPT("cpus=%s", cpus, 0),
+    HAL_OPT("mlock", mlock, 1),
+    FUSE_OPT_END
+};
+
+static void notify_poll(void *ph)
+{
+    fuse_notify_poll(ph);
+    fuse_pollhandle_destroy(ph);
+}
+
+static void release_poll(void *ph)
+{
+    fuse_pollhandle_destroy(ph);
+}
+
+/* Called by the connection (reader thread) when a resource changes */
+static void HALFS_changed(void *unused_arg, unsigned char type, unsigned char rid)
+{
+    HALWatch_changed(type, rid, notify_poll);
+}
+
 void *HALFS_init(struct fuse_conn_info *conn)
 {
-    hal = HAL_connect();
+    hal = HAL_connect(&hal_opts);
     if (! hal){
         HAL_WARN("Cannot connect to arduino; quit !");
+    } else {
+        HALConn_on_change(hal->conn, HALFS_changed, NULL);
     }
     return NULL;
 }
@@ -26,14 +68,53 @@ void HALFS_cleanup(void *param)
     if (hal){
         HAL_release(hal);
     }
+    HALWatch_forget(release_poll);
+}
+
+/* Content of a snapshot file, rendered when opened */
+struct HALSnapshot {
+    size_t len;
+    char text[];
+};
+
+/* Render file once, so that reads at any offset see the same content */
+static int HALFS_snapshot(HALFS *file, struct fuse_file_info *fi)
+{
+    struct HALSnapshot *snapshot = malloc(sizeof(struct HALSnapshot) + file->ops.size);
+    if (! snapshot){
+        return -ENOMEM;
+    }
+    int res = file->ops.read(hal->conn, file->id, snapshot->text, file->ops.size, 0);
+    if (res < 0){
+        free(snapshot);
+        return res;
+    }
+    snapshot->len = res;
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) snapshot;
+    return 0;
 }
 
 static int HALFS_open(const char *path, struct fuse_file_info *fi)
 {
     HALFS *file = HALFS_find(hal->root, path);
-    if (file)
-        return 0;
-    return -ENOENT;
+    int res = file ? 0 : -ENOENT;
+    if (file && file->ops.watch){
+        /* Value changes between reads: bypass the page cache. The watcher
+           lives as long as the open file, as fi->fh is kept by FUSE. */
+        HALWatcher *watcher = HALWatch_open(file->ops.watch, file->id);
+        if (watcher){
+            fi->direct_io = 1;
+            fi->fh = (uintptr_t) watcher;
+        } else {
+            res = -ENOMEM;
+        }
+    }
+    else if (file && file->ops.snapshot && file->ops.read){
+        res = HALFS_snapshot(file, fi);
+    }
+    HALFS_account(HALFS_OP_OPEN, res);
+    return res;
 }
 
 static int HALFS_read(
@@ -46,12 +127,42 @@ static int HALFS_read(
     HALFS *file = HALFS_find(hal->root, path);
     int res = -ENOENT;
     if (file){
-        res = file->ops.read(hal->conn, file->id, buf, size, offset);
+        if (file->ops.watch && offset > 0){
+            /* Not cached: values are read whole, at offset 0 */
+            res = 0;
+        } else if (file->ops.snapshot && fi->fh){
+            struct HALSnapshot *snapshot = (struct HALSnapshot *) (uintptr_t) fi->fh;
+            res = 0;
+            if ((size_t) offset < snapshot->len){
+                res = (size < snapshot->len - offset) ? size : snapshot->len - offset;
+                memcpy(buf, snapshot->text + offset, res);
+            }
+        } else {
+            if (file->ops.watch && fi->fh){
+                HALWatch_seen((HALWatcher *) (uintptr_t) fi->fh);
+            }
+            res = file->ops.read(hal->conn, file->id, buf, size, offset);
+        }
         HAL_DEBUG("READ %s (len: %lu -> %d)", path, size, res);
     }
+    HALFS_account(HALFS_OP_READ, res);
     return res;
 }
 
+static int HALFS_release(const char *path, struct fuse_file_info *fi)
+{
+    HALFS *file = HALFS_find(hal->root, path);
+    if (file && file->ops.watch){
+        HALWatch_close((HALWatcher *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    else if (file && file->ops.snapshot){
+        free((void *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    return 0;
+}
+
 
 static int HALFS_write(
     const char *path, 
@@ -66,6 +177,7 @@ static int HALFS_write(
         res = file->ops.write(hal->conn, file->id, buf, size, offset);
         HAL_DEBUG("WRITE %s (len: %lu -> %d)", path, size, res);
     }
+    HALFS_account(HALFS_OP_WRITE, res);
     return res;
 }
 
@@ -84,59 +196,70 @@ static int HALFS_size(const char *path, struct fuse_file_info *fi)
 static int HALFS_trunc(const char *path, off_t offset) 
 {
     HALFS *file = HALFS_find(hal->root, path);
+    int res = -ENOENT;
     if (file){
         HAL_DEBUG("TRUNC %s", path);
-        return file->ops.trunc(hal->conn, file->id);
+        res = file->ops.trunc(hal->conn, file->id);
     }
-    return -ENOENT;
+    HALFS_account(HALFS_OP_TRUNCATE, res);
+    return res;
 }
 
-static int HALFS_readdir(
-    const char *path, 
-    void *buf, 
-    fuse_fill_dir_t filler,
-    off_t offset, 
-    struct fuse_file_info *fi
+/* Watched files are readable once their value changed since last read; other
+   files are always ready */
+static int HALFS_poll(
+    const char *path,
+    struct fuse_file_info *fi,
+    struct fuse_pollhandle *ph,
+    unsigned *reventsp
 ){
+    HALFS *file = HALFS_find(hal->root, path);
+    int res = file ? 0 : -ENOENT;
+    HALFS_account(HALFS_OP_POLL, res);
+    if (! file){
+        if (ph){
+            fuse_pollhandle_destroy(ph);
+        }
+        return res;
+    }
 
-    HALFS *dir = HALFS_find(hal->root, path);
-    if (! dir)
-        return -ENOENT;
-
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    for (HALFS *it=dir->first_child; it!=NULL; it=it->next_sibling)
-        filler(buf, it->name, NULL, 0);
-
+    *reventsp = POLLOUT|POLLWRNORM;
+    if (! file->ops.watch || ! fi->fh){
+        *reventsp |= POLLIN|POLLRDNORM;
+    } else if (HALWatch_poll((HALWatcher *) (uintptr_t) fi->fh, ph)){
+        *reventsp |= POLLIN|POLLRDNORM;
+    } else {
+        /* Kept until the next change */
+        ph = NULL;
+    }
+    if (ph){
+        fuse_pollhandle_destroy(ph);
+    }
     return 0;
 }
 
 static int HALFS_readlink(const char *path, char *buf, size_t size)
 {
     HALFS *file = HALFS_find(hal->root, path);
-    if (file){
-        if (file->ops.target == NULL)
-            return -ENOENT;
+    int res = -ENOENT;
+    if (file && file->ops.target != NULL){
         strcpy(buf, file->ops.target);
-        return 0;
+        res = 0;
     }
-    return -ENOENT;
+    HALFS_account(HALFS_OP_READLINK, res);
+    return res;
 }
 
-static int HALFS_getattr(const char *path, struct stat *stbuf)
+/* Attributes of file, as seen by getattr and readdir */
+static void HALFS_stat(HALFS *file, struct stat *stbuf)
 {
     memset(stbuf, 0, sizeof(struct stat));
-    HALFS *file = HALFS_find(hal->root, path);
-    if (! file)
-        return -ENOENT;
-
     stbuf->st_uid = my_uid;
     stbuf->st_gid = my_gid;
 
     stbuf->st_mode = HALFS_mode(file);
 
-    if (file->first_child){
+    if (file->n_children){
         /* has child: Directory */
         stbuf->st_mode |= S_IFDIR;
         stbuf->st_nlink = 2;
@@ -151,20 +274,81 @@ static int HALFS_getattr(const char *path, struct stat *stbuf)
         stbuf->st_nlink = 1;
         stbuf->st_size = file->ops.size;
     }
+}
+
+static int HALFS_getattr(const char *path, struct stat *stbuf)
+{
+    HALFS *file = HALFS_find(hal->root, path);
+    HALFS_account(HALFS_OP_GETATTR, file ? 0 : -ENOENT);
+    if (! file)
+        return -ENOENT;
+
+    HALFS_stat(file, stbuf);
+    return 0;
+}
+
+/* The directory node is looked up once, and kept in fi->fh for readdir
+   (nodes live as long as the mount) */
+static int HALFS_opendir(const char *path, struct fuse_file_info *fi)
+{
+    HALFS *dir = HALFS_find(hal->root, path);
+    if (! dir)
+        return -ENOENT;
+    fi->fh = (uintptr_t) dir;
+    return 0;
+}
+
+/* Entries are numbered from 1 (".", "..", then children in order), so that
+   a listing that does not fit in buf is resumed at offset. Each entry comes
+   with its attributes. */
+static int HALFS_readdir(
+    const char *path, 
+    void *buf, 
+    fuse_fill_dir_t filler,
+    off_t offset, 
+    struct fuse_file_info *fi
+){
+
+    HALFS *dir = (fi && fi->fh) ? (HALFS *) (uintptr_t) fi->fh : HALFS_find(hal->root, path);
+    HALFS_account(HALFS_OP_READDIR, dir ? 0 : -ENOENT);
+    if (! dir)
+        return -ENOENT;
+
+    struct stat stbuf;
+    if (offset < 1){
+        HALFS_stat(dir, &stbuf);
+        if (filler(buf, ".", &stbuf, 1))
+            return 0;
+    }
+    if (offset < 2){
+        HALFS *parent = HALFS_findParent(hal->root, path);
+        HALFS_stat(parent ? parent : hal->root, &stbuf);
+        if (filler(buf, "..", &stbuf, 2))
+            return 0;
+    }
+
+    for (size_t i=(offset > 2) ? offset-2 : 0; i<dir->n_children; i++){
+        HALFS_stat(dir->children[i], &stbuf);
+        if (filler(buf, dir->children[i]->name, &stbuf, i+3))
+            break;
+    }
 
     return 0;
 }
 
 static struct fuse_operations hal_ops = {
     .getattr    = HALFS_getattr,
+    .opendir    = HALFS_opendir,
     .readdir    = HALFS_readdir,
     .open       = HALFS_open,
     .read       = HALFS_read,
+    .release    = HALFS_release,
     .write      = HALFS_write,
     .truncate   = HALFS_trunc,
     .init       = HALFS_init,
     .destroy    = HALFS_cleanup,
-    .readlink   = HALFS_readlink
+    .readlink   = HALFS_readlink,
+    .poll       = HALFS_poll
 };
 
 /* ============================================== */
@@ -173,5 +357,15 @@ int main(int argc, char *argv[])
 {
     my_uid = getuid();
     my_gid = getgid();
-    return fuse_main(argc, argv, &hal_ops, NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &hal_opts, hal_opts_spec, NULL) < 0){
+        return 1;
+    }
+    /* Let the kernel enforce file modes (some control files are only
+       writable by the user running the driver) */
+    fuse_opt_add_arg(&args, "-odefault_permissions");
+    int res = fuse_main(args.argc, args.argv, &hal_ops, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
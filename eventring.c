@@ -0,0 +1,330 @@
+#ifndef _GNU_SOURCE
+/* syscall() */
+#define _GNU_SOURCE
+#endif
+#include "eventring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct HALRing {
+    char *name;
+    char *wait_name;
+    HALRingHeader *hdr;
+    HALRingEvent *slots;
+    HALRingWait *wait;
+    size_t map_len;
+    int writer;
+    /* Never read back from shared memory, where readers might change them */
+    uint64_t head;
+    uint64_t capacity;
+};
+
+/* Name of the ".wait" sibling of name */
+static char *wait_name(const char *name)
+{
+    char *res = malloc(strlen(name) + 6);
+    if (res){
+        strcpy(res, name);
+        strcat(res, ".wait");
+    }
+    return res;
+}
+
+/* Map the ring object (fd) and the wait object (wait_fd); both are closed */
+static HALRing *map_ring(const char *name, int fd, int wait_fd, size_t map_len, uint64_t capacity, int writer)
+{
+    void *map = mmap(NULL, map_len, writer ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    void *wait = mmap(NULL, sizeof(HALRingWait), PROT_READ|PROT_WRITE, MAP_SHARED, wait_fd, 0);
+    close(fd);
+    close(wait_fd);
+    if (map == MAP_FAILED || wait == MAP_FAILED){
+        if (map != MAP_FAILED){
+            munmap(map, map_len);
+        }
+        if (wait != MAP_FAILED){
+            munmap(wait, sizeof(HALRingWait));
+        }
+        return NULL;
+    }
+
+    HALRing *ring = calloc(1, sizeof(HALRing));
+    ring->name = strdup(name);
+    ring->wait_name = wait_name(name);
+    ring->hdr = map;
+    ring->slots = (HALRingEvent *) (((unsigned char *) map) + sizeof(HALRingHeader));
+    ring->wait = wait;
+    ring->map_len = map_len;
+    ring->writer = writer;
+    ring->capacity = capacity;
+    return ring;
+}
+
+/* Create shared memory object name of len bytes, with mode. An object left
+   by a previous writer of ours (same user) is replaced; any other one is
+   left untouched, and creation fails with EEXIST. */
+static int create_object(const char *name, size_t len, mode_t mode)
+{
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, mode);
+    if (fd < 0 && errno == EEXIST){
+        struct stat st;
+        int stale = shm_open(name, O_RDONLY, 0);
+        if (stale < 0){
+            return -1;
+        }
+        int ours = (fstat(stale, &st) == 0 && st.st_uid == geteuid());
+        close(stale);
+        if (! ours){
+            errno = EEXIST;
+            return -1;
+        }
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, mode);
+    }
+    if (fd < 0){
+        return -1;
+    }
+    /* Regardless of umask */
+    if (fchmod(fd, mode) < 0 || ftruncate(fd, len) < 0){
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    return fd;
+}
+
+HALRing *HALRing_create(const char *name, size_t capacity)
+{
+    size_t n = 1;
+    while (n < capacity){
+        n *= 2;
+    }
+    char *wname = wait_name(name);
+    if (capacity == 0 || n > UINT32_MAX || ! wname){
+        free(wname);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Readers may belong to other users, as listeners of the event socket:
+       they may read events, and register as waiters */
+    size_t map_len = sizeof(HALRingHeader) + n*sizeof(HALRingEvent);
+    int fd = create_object(name, map_len, 0644);
+    if (fd < 0){
+        free(wname);
+        return NULL;
+    }
+    int wait_fd = create_object(wname, sizeof(HALRingWait), 0666);
+    if (wait_fd < 0){
+        close(fd);
+        shm_unlink(name);
+        free(wname);
+        return NULL;
+    }
+
+    HALRing *ring = map_ring(name, fd, wait_fd, map_len, n, 1);
+    if (! ring){
+        shm_unlink(name);
+        shm_unlink(wname);
+        free(wname);
+        return NULL;
+    }
+    free(wname);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    HALRingHeader *hdr = ring->hdr;
+    memcpy(hdr->magic, HALRING_MAGIC, sizeof(hdr->magic));
+    hdr->version = HALRING_VERSION;
+    hdr->header_size = sizeof(HALRingHeader);
+    hdr->capacity = n;
+    hdr->slot_size = sizeof(HALRingEvent);
+    hdr->start_realtime = 1000000ull*now.tv_sec + now.tv_nsec/1000;
+    return ring;
+}
+
+HALRing *HALRing_attach(const char *name)
+{
+    char *wname = wait_name(name);
+    if (! wname){
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    int wait_fd = shm_open(wname, O_RDWR, 0);
+    free(wname);
+    if (fd < 0 || wait_fd < 0){
+        int err = errno;
+        if (fd >= 0){
+            close(fd);
+        }
+        if (wait_fd >= 0){
+            close(wait_fd);
+        }
+        errno = err;
+        return NULL;
+    }
+
+    struct stat st, wait_st;
+    HALRingHeader hdr;
+    if (fstat(fd, &st) < 0 || fstat(wait_fd, &wait_st) < 0 ||
+        (uint64_t) wait_st.st_size < sizeof(HALRingWait) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, HALRING_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != HALRING_VERSION ||
+        hdr.header_size != sizeof(HALRingHeader) ||
+        hdr.slot_size != sizeof(HALRingEvent) ||
+        hdr.capacity == 0 || (hdr.capacity & (hdr.capacity-1)) != 0 ||
+        (uint64_t) st.st_size < hdr.header_size + (uint64_t) hdr.capacity*hdr.slot_size){
+        close(fd);
+        close(wait_fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    return map_ring(name, fd, wait_fd, sizeof(HALRingHeader) + hdr.capacity*sizeof(HALRingEvent),
+                    hdr.capacity, 0);
+}
+
+void HALRing_close(HALRing *ring)
+{
+    if (ring->writer){
+        shm_unlink(ring->name);
+        shm_unlink(ring->wait_name);
+    }
+    munmap(ring->hdr, ring->map_len);
+    munmap(ring->wait, sizeof(HALRingWait));
+    free(ring->name);
+    free(ring->wait_name);
+    free(ring);
+}
+
+const char *HALRing_name(HALRing *ring)
+{
+    return ring->name;
+}
+
+const HALRingHeader *HALRing_header(HALRing *ring)
+{
+    return ring->hdr;
+}
+
+void HALRing_publish(HALRing *ring, uint8_t type, uint8_t rid, const unsigned char *data, size_t len)
+{
+    uint64_t seq = ++ring->head;
+    HALRingEvent *slot = ring->slots + ((seq-1) & (ring->capacity-1));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (len > sizeof(slot->data)){
+        len = sizeof(slot->data);
+    }
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->ts, 1000000ull*now.tv_sec + now.tv_nsec/1000, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->rid, rid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+    for (size_t i=0; i<sizeof(slot->data); i++){
+        __atomic_store_n(slot->data + i, (i < len) ? data[i] : 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->hdr->head, seq, __ATOMIC_RELEASE);
+
+    /* Pairs with HALRing_wait: either the reader sees the new head, or the
+       writer sees the reader waiting */
+    HALRingWait *wait = ring->wait;
+    __atomic_store_n(&wait->futex, (uint32_t) seq, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wait->waiters, __ATOMIC_SEQ_CST) > 0){
+        syscall(SYS_futex, &wait->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+uint64_t HALRing_head(HALRing *ring)
+{
+    if (ring->writer){
+        return ring->head;
+    }
+    return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+uint32_t HALRing_waiters(HALRing *ring)
+{
+    return __atomic_load_n(&ring->wait->waiters, __ATOMIC_RELAXED);
+}
+
+int HALRing_next(HALRing *ring, uint64_t *cursor, HALRingEvent *event)
+{
+    uint64_t capacity = ring->capacity;
+    for (;;){
+        uint64_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+        if (*cursor >= head){
+            return 0;
+        }
+        /* Too late: skip to the oldest event left */
+        uint64_t seq = (head - *cursor > capacity) ? head - capacity + 1 : *cursor + 1;
+
+        HALRingEvent *slot = ring->slots + ((seq-1) & (capacity-1));
+        uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        event->ts = __atomic_load_n(&slot->ts, __ATOMIC_RELAXED);
+        event->type = __atomic_load_n(&slot->type, __ATOMIC_RELAXED);
+        event->rid = __atomic_load_n(&slot->rid, __ATOMIC_RELAXED);
+        event->len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        for (size_t i=0; i<sizeof(event->data); i++){
+            event->data[i] = __atomic_load_n(slot->data + i, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (before == seq && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq){
+            memset(event->reserved, 0, sizeof(event->reserved));
+            event->seq = seq;
+            *cursor = seq;
+            return 1;
+        }
+        /* Overwritten meanwhile: the writer is far ahead, start over */
+        *cursor = seq;
+    }
+}
+
+int HALRing_wait(HALRing *ring, uint64_t cursor, int timeout)
+{
+    HALRingHeader *hdr = ring->hdr;
+    HALRingWait *wait = ring->wait;
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += 1000000l * (timeout % 1000);
+    if (deadline.tv_nsec >= 1000000000l){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000l;
+    }
+
+    while (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) <= cursor){
+        struct timespec rel, *relp = NULL;
+        if (timeout >= 0){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec = deadline.tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0){
+                rel.tv_sec--;
+                rel.tv_nsec += 1000000000l;
+            }
+            if (rel.tv_sec < 0){
+                return 0;
+            }
+            relp = &rel;
+        }
+
+        __atomic_add_fetch(&wait->waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t val = __atomic_load_n(&wait->futex, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) <= cursor){
+            syscall(SYS_futex, &wait->futex, FUTEX_WAIT, val, relp, NULL, 0);
+        }
+        __atomic_sub_fetch(&wait->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return 1;
+}
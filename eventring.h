@@ -0,0 +1,119 @@
+#ifndef DEFINE_EVENTRING_HEADER
+#define DEFINE_EVENTRING_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  Ring of events (trigger changes, resource changes, sensor samples) in a
+ *  POSIX shared memory object, for local consumers. The object starts with a
+ *  HALRingHeader, followed by capacity HALRingEvent slots. Event n (numbered
+ *  from 1) is in slot (n-1) % capacity. It is only writable by the driver;
+ *  readers map it read-only.
+ *
+ *  There is a single writer. It marks a slot as being written (seq = 0),
+ *  fills it, sets its seq, then sets head. The writer keeps its own head and
+ *  capacity, and never reads them back from shared memory. Readers copy a
+ *  slot, and keep it only if its seq was the expected one before and after
+ *  the copy. A reader that is more than capacity events late loses the
+ *  oldest ones; it notices a gap in seq.
+ *
+ *  Waiting readers register in the waiters count of a second object (the
+ *  ring name followed by ".wait", writable by all), and sleep on its futex
+ *  word, which the writer changes on each event, so that the writer only
+ *  makes a syscall when someone sleeps. All fields are in host byte order.
+ */
+
+#define HALRING_MAGIC "HALRING"
+#define HALRING_VERSION 2
+
+#ifndef HALRING_DEFAULT_CAPACITY
+/* Default number of events in the ring */
+#define HALRING_DEFAULT_CAPACITY 4096
+#endif
+
+typedef struct HALRingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;    //!< Offset of the first slot
+    uint32_t capacity;       //!< Number of slots (power of 2)
+    uint32_t slot_size;
+    uint64_t start_realtime; //!< Wall clock at creation (usec)
+    uint8_t reserved[32];
+    /* Written on each event: on its own cache line */
+    uint64_t head;           //!< Number of events published
+    uint8_t reserved2[56];
+} HALRingHeader;
+
+/* Content of the ".wait" object */
+typedef struct HALRingWait {
+    uint32_t futex;          //!< Low bits of head
+    uint32_t waiters;        //!< Readers sleeping on futex
+} HALRingWait;
+
+typedef struct HALRingEvent {
+    uint64_t seq;            //!< Event number (0 while being written)
+    uint64_t ts;             //!< Wall clock (usec)
+    uint8_t type;            //!< Resource type (TRIGGER, SENSOR, SWITCH...)
+    uint8_t rid;
+    uint8_t len;             //!< Length of data
+    uint8_t reserved[5];
+    uint8_t data[8];         //!< Value, as sent by the Arduino
+} HALRingEvent;
+
+typedef struct HALRing HALRing;
+
+/*!
+ *  Create the shared memory object name ("/something"), and its ".wait"
+ *  sibling, with a ring of at least capacity events. Existing objects are
+ *  only replaced if they belong to the same user (left by a previous
+ *  writer); otherwise creation fails with EEXIST.
+ *  @return The ring, or NULL on error (errno is set)
+ */
+HALRing *HALRing_create(const char *name, size_t capacity);
+
+/*!
+ *  Open an existing ring, as a reader
+ *  @return The ring, or NULL on error (errno is set)
+ */
+HALRing *HALRing_attach(const char *name);
+
+/*!
+ *  Unmap the ring; the writer also removes the shared memory objects
+ */
+void HALRing_close(HALRing *ring);
+
+const char *HALRing_name(HALRing *ring);
+
+const HALRingHeader *HALRing_header(HALRing *ring);
+
+/*!
+ *  Publish an event (len <= 8). Must not be called concurrently.
+ */
+void HALRing_publish(HALRing *ring, uint8_t type, uint8_t rid, const unsigned char *data, size_t len);
+
+/*!
+ *  Number of events published so far: start reading from there to get new
+ *  events only
+ */
+uint64_t HALRing_head(HALRing *ring);
+
+/*!
+ *  Number of readers sleeping in HALRing_wait
+ */
+uint32_t HALRing_waiters(HALRing *ring);
+
+/*!
+ *  Copy the next event after cursor (number of the last event read, 0 at
+ *  first), and advance cursor. Never makes a syscall.
+ *  @return 1 if there was an event, 0 otherwise
+ */
+int HALRing_next(HALRing *ring, uint64_t *cursor, HALRingEvent *event);
+
+/*!
+ *  Wait until there are events after cursor, or timeout (ms, -1: forever)
+ *  @return 1 if there are events after cursor, 0 otherwise
+ */
+int HALRing_wait(HALRing *ring, uint64_t cursor, int timeout);
+
+#endif
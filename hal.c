@@ -1,13 +1,25 @@
 #include "hal.h"
 #include "logger.h"
+#include "capture.h"
+#include "eventring.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <string.h>
 #include <glob.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
 
 #define min(A,B) ((A) < (B)) ? (A) : (B)
 
+/* Max length of a line of sensor history files */
+#define HAL_HISTORY_LINE 32
+
+/* Max length of a line of /driver/queues: 4 counters of 20 digits */
+#define HAL_QUEUES_LINE 128
+
 const char *ARDUINO_DEV_PATH[] = {
     "/dev/tty.usbmodem*",
     "/dev/ttyUSB*",
@@ -27,6 +39,77 @@ static int sensor_read(HALConnection *conn, unsigned char sensor_id, char *buf,
     return snprintf(buf, size, "%f\n", sensor_val);
 }
 
+/* Raw 10-bit value, as little-endian uint16 */
+static int sensor_raw_read(HALConnection *conn, unsigned char sensor_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|SENSOR), .rid=sensor_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    if (size < 2){
+        return -EINVAL;
+    }
+    buf[0] = msg.data[1];
+    buf[1] = msg.data[0];
+    return 2;
+}
+
+
+/* Last samples, oldest first: one "timestamp value" line per sample.
+   Rendered whole once per open (snapshot file). */
+static int sensor_history_read(HALConnection *conn, unsigned char sensor_id, char *buf, size_t size, off_t offset)
+{
+    HALHistory *history = HALConn_history(conn, sensor_id);
+    if (! history || offset > 0 || size == 0){
+        return 0;
+    }
+    size_t n = HALHistory_size(history);
+    HALSample *samples = malloc(n*sizeof(HALSample));
+    if (! samples){
+        return -ENOMEM;
+    }
+
+    n = HALHistory_samples(history, samples, n);
+    size_t len = 0;
+    for (size_t i=0; i<n && len<size; i++){
+        len += snprintf(buf+len, size-len, "%lu.%06lu %f\n",
+                        (unsigned long int) (samples[i].ts / 1000000),
+                        (unsigned long int) (samples[i].ts % 1000000),
+                        samples[i].value / 1024.0);
+    }
+    if (len >= size){
+        len = size - 1;
+    }
+    free(samples);
+    return len;
+}
+
+/* "1": sample the sensor, "0": stop */
+static int sensor_history_write(HALConnection *conn, unsigned char sensor_id, const char *buf, size_t size, off_t offset)
+{
+    if (! HALConn_set_history(conn, sensor_id, buf[0] != '0')){
+        return -ENOMEM;
+    }
+    return size;
+}
+
+/* Rendered once per open (snapshot file) */
+static int sensor_stats_read(HALConnection *conn, unsigned char sensor_id, char *buf, size_t size, off_t offset)
+{
+    HALHistory *history = HALConn_history(conn, sensor_id);
+    HALHistoryStats stats;
+    if (! history || offset > 0 || size == 0){
+        return 0;
+    }
+    HALHistory_stats(history, &stats);
+    int len = snprintf(buf, size, "samples=%lu min=%f max=%f mean=%f ewma=%f last=%f\n",
+                    (unsigned long int) stats.count,
+                    stats.min / 1024.0, stats.max / 1024.0,
+                    stats.mean / 1024, stats.ewma / 1024, stats.last / 1024.0);
+    return ((size_t) len < size) ? len : (int) size - 1;
+}
+
 
 /* === Triggers === */
 static int trigger_read(HALConnection *conn, unsigned char trigger_id, char *buf, size_t size, off_t offset)
@@ -39,6 +122,18 @@ static int trigger_read(HALConnection *conn, unsigned char trigger_id, char *buf
     return snprintf(buf, size, "%c\n", msg.data[0] ? '1' : '0');
 }
 
+/* Raw state, as a single byte (0 or 1) */
+static int trigger_raw_read(HALConnection *conn, unsigned char trigger_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|TRIGGER), .rid=trigger_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    buf[0] = msg.data[0] ? 1 : 0;
+    return 1;
+}
+
 
 /* === Switchs === */
 static int switch_read(HALConnection *conn, unsigned char switch_id, char *buf, size_t size, off_t offset)
@@ -62,6 +157,32 @@ static int switch_write(HALConnection *conn, unsigned char switch_id, const char
     return size;
 }
 
+/* Raw state, as a single byte (0 or 1) */
+static int switch_raw_read(HALConnection *conn, unsigned char switch_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|SWITCH), .rid=switch_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    buf[0] = msg.data[0] ? 1 : 0;
+    return 1;
+}
+
+static int switch_raw_write(HALConnection *conn, unsigned char switch_id, const char *buf, size_t size, off_t offset)
+{
+    if (size != 1){
+        return -EINVAL;
+    }
+    HALMsg msg = {.cmd=(PARAM_CHANGE|SWITCH), .rid=switch_id, .len=1};
+    msg.data[0] = buf[0] ? 1 : 0;
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    return size;
+}
+
 
 /* === Rgbs === */
 static int rgb_read(HALConnection *conn, unsigned char rgb_id, char *buf, size_t size, off_t offset)
@@ -103,6 +224,35 @@ static int rgb_write(HALConnection *conn, unsigned char rgb_id, const char *buf,
     return size;
 }
 
+/* Raw color, as 3 bytes: red, green, blue */
+static int rgb_raw_read(HALConnection *conn, unsigned char rgb_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|RGB), .rid=rgb_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    if (size < 3){
+        return -EINVAL;
+    }
+    memcpy(buf, msg.data, 3);
+    return 3;
+}
+
+static int rgb_raw_write(HALConnection *conn, unsigned char rgb_id, const char *buf, size_t size, off_t offset)
+{
+    if (size != 3){
+        return -EINVAL;
+    }
+    HALMsg msg = {.cmd=(PARAM_CHANGE|RGB), .rid=rgb_id, .len=3};
+    memcpy(msg.data, buf, 3);
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    return size;
+}
+
 
 /* === Animations FPS === */
 static int anim_fps_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
@@ -136,6 +286,32 @@ static int anim_fps_write(HALConnection *conn, unsigned char anim_id, const char
     return size;
 }
 
+/* Raw delay between frames, in ms, as a single byte */
+static int anim_delay_raw_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|ANIMATION_DELAY), .rid=anim_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    buf[0] = msg.data[0];
+    return 1;
+}
+
+static int anim_delay_raw_write(HALConnection *conn, unsigned char anim_id, const char *buf, size_t size, off_t offset)
+{
+    if (size != 1 || buf[0] == 0){
+        return -EINVAL;
+    }
+    HALMsg msg = {.cmd=(PARAM_CHANGE|ANIMATION_DELAY), .rid=anim_id, .len=1};
+    msg.data[0] = buf[0];
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    return size;
+}
+
 /* === Animations loop === */
 static int anim_loop_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
 {
@@ -158,6 +334,31 @@ static int anim_loop_write(HALConnection *conn, unsigned char anim_id, const cha
     return size;
 }
 
+static int anim_loop_raw_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|ANIMATION_LOOP), .rid=anim_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    buf[0] = msg.data[0] ? 1 : 0;
+    return 1;
+}
+
+static int anim_loop_raw_write(HALConnection *conn, unsigned char anim_id, const char *buf, size_t size, off_t offset)
+{
+    if (size != 1){
+        return -EINVAL;
+    }
+    HALMsg msg = {.cmd=(PARAM_CHANGE|ANIMATION_LOOP), .rid=anim_id, .len=1};
+    msg.data[0] = buf[0] ? 1 : 0;
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    return size;
+}
+
 /* === Animations playing === */
 static int anim_play_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
 {
@@ -180,6 +381,31 @@ static int anim_play_write(HALConnection *conn, unsigned char anim_id, const cha
     return size;
 }
 
+static int anim_play_raw_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
+{
+    HALMsg msg = {.cmd=(PARAM_ASK|ANIMATION_PLAY), .rid=anim_id, .len=0};
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    buf[0] = msg.data[0] ? 1 : 0;
+    return 1;
+}
+
+static int anim_play_raw_write(HALConnection *conn, unsigned char anim_id, const char *buf, size_t size, off_t offset)
+{
+    if (size != 1){
+        return -EINVAL;
+    }
+    HALMsg msg = {.cmd=(PARAM_CHANGE|ANIMATION_PLAY), .rid=anim_id, .len=1};
+    msg.data[0] = buf[0] ? 1 : 0;
+    HALErr err = HALConn_request(conn, &msg);
+    if (err != OK){
+        return -EAGAIN;
+    }
+    return size;
+}
+
 /* === Animations frames === */
 static int anim_frames_read(HALConnection *conn, unsigned char anim_id, char *buf, size_t size, off_t offset)
 {
@@ -221,6 +447,295 @@ static int driver_tx_bytes_read(HALConnection *conn, unsigned char unused_id, ch
     return snprintf(buf, size, "%lu\n",  tx);
 }
 
+static int driver_rx_frames_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int rx = HALConn_rx_frames(conn);
+    return snprintf(buf, size, "%lu\n",  rx);
+}
+
+static int driver_tx_frames_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int tx = HALConn_tx_frames(conn);
+    return snprintf(buf, size, "%lu\n",  tx);
+}
+
+static int driver_shadow_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%d\n",  HALConn_shadow_reads(conn));
+}
+
+static int driver_shadow_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    HALConn_set_shadow_reads(conn, buf[0] != '0');
+    return size;
+}
+
+static int driver_shadow_hits_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int hits = HALConn_shadow_hits(conn);
+    return snprintf(buf, size, "%lu\n",  hits);
+}
+
+static int driver_dedup_hits_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int hits = HALConn_dedup_hits(conn);
+    return snprintf(buf, size, "%lu\n",  hits);
+}
+
+static int driver_batch_window_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%u\n",  HALConn_batch_window(conn));
+}
+
+static int driver_batch_window_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char *endptr;
+    long int val = strtol(buf, &endptr, 10);
+    if (endptr == buf || val < 0 || val > 1000000){
+        return -EINVAL;
+    }
+    HALConn_set_batch_window(conn, val);
+    return size;
+}
+
+static int driver_heartbeat_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%u\n",  HALConn_heartbeat(conn));
+}
+
+static int driver_heartbeat_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char *endptr;
+    long int val = strtol(buf, &endptr, 10);
+    if (endptr == buf || val < 0 || val > 3600000){
+        return -EINVAL;
+    }
+    HALConn_set_heartbeat(conn, val);
+    return size;
+}
+
+static int driver_hedge_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%u\n",  HALConn_hedge_percentile(conn));
+}
+
+static int driver_hedge_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char *endptr;
+    long int val = strtol(buf, &endptr, 10);
+    if (endptr == buf || val < 0 || val > 99){
+        return -EINVAL;
+    }
+    HALConn_set_hedge_percentile(conn, val);
+    return size;
+}
+
+static int driver_event_seq_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int seq = HALConn_event_seq(conn);
+    return snprintf(buf, size, "%lu\n",  seq);
+}
+
+static int driver_sampling_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%u\n",  HALConn_sampling(conn));
+}
+
+static int driver_sampling_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char *endptr;
+    long int val = strtol(buf, &endptr, 10);
+    if (endptr == buf || val < 0 || val > 3600000){
+        return -EINVAL;
+    }
+    HALConn_set_sampling(conn, val);
+    return size;
+}
+
+static int driver_link_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    HALLinkStats stats;
+    HALConn_link_stats(conn, &stats);
+    return snprintf(buf, size, "%s rtt=%lu min=%lu avg=%lu max=%lu jitter=%lu lost=%lu/%lu\n",
+                    stats.degraded ? "degraded" : "ok",
+                    stats.rtt_last, stats.rtt_min, stats.rtt_avg, stats.rtt_max, stats.jitter,
+                    (unsigned long int) stats.window_lost, (unsigned long int) stats.window);
+}
+
+static int driver_sched_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return HALConn_sched(conn, buf, size);
+}
+
+/* Rendered once per open (snapshot file) */
+static int driver_queues_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    static const char *names[HALCONN_TX_CLASSES] = {"control", "interactive", "read", "bulk"};
+    HALConnStats stats;
+    int len = 0;
+    if (offset > 0 || size == 0){
+        return 0;
+    }
+
+    HALConn_stats(conn, &stats);
+    for (int i=0; i<HALCONN_TX_CLASSES && (size_t) len < size; i++){
+        len += snprintf(buf+len, size-len, "%s depth=%lu max=%lu sent=%lu promoted=%lu\n",
+                        names[i], (unsigned long int) stats.tx[i].depth,
+                        (unsigned long int) stats.tx[i].max_depth,
+                        (unsigned long int) stats.tx[i].sent,
+                        (unsigned long int) stats.tx[i].promoted);
+    }
+    return ((size_t) len < size) ? len : (int) size - 1;
+}
+
+static int driver_baudrate_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    return snprintf(buf, size, "%u\n",  HALConn_baudrate(conn));
+}
+
+#ifndef HAL_CAPTURE_DIR
+/* Directory of capture files; created (and owned) by the driver */
+#define HAL_CAPTURE_DIR "/tmp/hal-captures"
+#endif
+
+#ifndef HAL_CAPTURE_NAME
+#define HAL_CAPTURE_NAME "capture.bin"
+#endif
+
+static int driver_capture_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    char path[PATH_MAX];
+    if (HALConn_capture_path(conn, path, sizeof(path)) > 0){
+        return snprintf(buf, size, "1 %s\n", path);
+    }
+    return snprintf(buf, size, "0\n");
+}
+
+/* Create the capture directory if needed, and check that no one else may
+   plant files in it */
+static int capture_dir_ready(void)
+{
+    struct stat st;
+    if (mkdir(HAL_CAPTURE_DIR, 0700) < 0 && errno != EEXIST){
+        HAL_WARN("Cannot create %s [ERRNO %d: %s]", HAL_CAPTURE_DIR, errno, strerror(errno));
+        return 0;
+    }
+    if (lstat(HAL_CAPTURE_DIR, &st) < 0 || ! S_ISDIR(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & 0022)){
+        HAL_WARN("%s is not a directory owned by the driver; no capture", HAL_CAPTURE_DIR);
+        return 0;
+    }
+    return 1;
+}
+
+/* Capture file names: no path, no hidden files */
+static int valid_capture_name(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '.'){
+        return 0;
+    }
+    for (const char *it=name; *it; it++){
+        if (! isalnum((unsigned char) *it) && *it != '.' && *it != '_' && *it != '-'){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* "0": stop capture, "1": capture in the default file, or name of the file
+   to capture in (in HAL_CAPTURE_DIR) */
+static int driver_capture_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char name[NAME_MAX+1], path[PATH_MAX];
+    size_t len = size;
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == ' ')){
+        len--;
+    }
+    if (len == 0 || len >= sizeof(name)){
+        return -EINVAL;
+    }
+    memcpy(name, buf, len);
+    name[len] = '\0';
+
+    if (strcmp(name, "0") == 0){
+        HALConn_stop_capture(conn);
+        return size;
+    }
+    if (strcmp(name, "1") == 0){
+        strcpy(name, HAL_CAPTURE_NAME);
+    } else if (! valid_capture_name(name)){
+        return -EINVAL;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", HAL_CAPTURE_DIR, name);
+    if (! capture_dir_ready() || ! HALConn_start_capture(conn, path, HALCAP_DEFAULT_SIZE)){
+        return -EIO;
+    }
+    return size;
+}
+
+#ifndef HAL_RING_NAME
+#define HAL_RING_NAME "/hal-events"
+#endif
+
+/* Rings may only be named HAL_RING_PREFIX followed by letters, digits, "_"
+   or "-", so that the driver never replaces another application objects */
+#define HAL_RING_PREFIX "/hal-"
+
+static int valid_ring_name(const char *name)
+{
+    size_t prefix_len = strlen(HAL_RING_PREFIX);
+    if (strncmp(name, HAL_RING_PREFIX, prefix_len) != 0 || name[prefix_len] == '\0'){
+        return 0;
+    }
+    for (const char *it=name+prefix_len; *it; it++){
+        if (! isalnum((unsigned char) *it) && *it != '_' && *it != '-'){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int driver_shm_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    char name[NAME_MAX];
+    if (HALConn_ring_name(conn, name, sizeof(name)) > 0){
+        return snprintf(buf, size, "1 %s\n", name);
+    }
+    return snprintf(buf, size, "0\n");
+}
+
+/* "0": stop publishing, "1": publish in default ring, or name of the ring
+   (see valid_ring_name) */
+static int driver_shm_write(HALConnection *conn, unsigned char unused_id, const char *buf, size_t size, off_t offset)
+{
+    char name[NAME_MAX];
+    size_t len = size;
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == ' ')){
+        len--;
+    }
+    if (len == 0 || len >= sizeof(name)){
+        return -EINVAL;
+    }
+    memcpy(name, buf, len);
+    name[len] = '\0';
+
+    if (strcmp(name, "0") == 0){
+        HALConn_stop_ring(conn);
+    } else if (strcmp(name, "1") == 0){
+        if (! HALConn_start_ring(conn, HAL_RING_NAME, HALRING_DEFAULT_CAPACITY)){
+            return -EIO;
+        }
+    } else if (valid_ring_name(name)){
+        if (! HALConn_start_ring(conn, name, HALRING_DEFAULT_CAPACITY)){
+            return -EIO;
+        }
+    } else {
+        return -EINVAL;
+    }
+    return size;
+}
+
 static int driver_loglevel_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
 {
     return snprintf(buf, size, "%d\n",  current_log_level);
@@ -237,6 +752,12 @@ static int driver_loglevel_write(HALConnection *conn, unsigned char unused_id, c
     return size;
 }
 
+static int driver_log_dropped_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    unsigned long int dropped = HALLog_dropped();
+    return snprintf(buf, size, "%lu\n",  dropped);
+}
+
 static int driver_version_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
 {
 #ifndef HAL_DRIVER_VERSION
@@ -246,6 +767,28 @@ static int driver_version_read(HALConnection *conn, unsigned char unused_id, cha
 #endif
 }
 
+#ifndef HAL_METRICS_SIZE
+#define HAL_METRICS_SIZE 16384
+#endif
+
+/* Metrics are rendered whole once per open (snapshot file) */
+static int driver_metrics_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
+{
+    HALConnStats conn_stats;
+    HALFSStats fs_stats;
+    if (offset > 0 || size == 0){
+        return 0;
+    }
+
+    HALConn_stats(conn, &conn_stats);
+    HALFS_stats(&fs_stats);
+    size_t len = HALMetrics_render(&conn_stats, &fs_stats, buf, size);
+    if (len >= size){
+        len = size - 1;
+    }
+    return len;
+}
+
 static int driver_uptime_read(HALConnection *conn, unsigned char unused_id, char *buf, size_t size, off_t offset)
 {
     unsigned long int rx = HALConn_uptime(conn);
@@ -255,6 +798,18 @@ static int driver_uptime_read(HALConnection *conn, unsigned char unused_id, char
 
 /* === Loading functions === */
 
+/* Insert the binary sibling (path + ".raw") of resource file path */
+static HALFS *HAL_insert_raw(HALFS *root, const char *path, const HALFS *text)
+{
+    char raw_path[270];
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", path);
+    HALFS *node = HALFS_insert(root, raw_path);
+    node->ops.mode = text->ops.mode;
+    node->ops.watch = text->ops.watch;
+    node->id = text->id;
+    return node;
+}
+
 static void HAL_insert_animation(HALFS *root, const char *name, unsigned char id)
 {
     char path[255];
@@ -268,6 +823,13 @@ static void HAL_insert_animation(HALFS *root, const char *name, unsigned char id
     node->ops.write = anim_fps_write;
     node->id = id;
 
+    /* Native value: delay between frames */
+    sprintf(path, "/animations/%s/delay", name);
+    node = HAL_insert_raw(root, path, node);
+    node->ops.size = 1;
+    node->ops.read = anim_delay_raw_read;
+    node->ops.write = anim_delay_raw_write;
+
     sprintf(path, "/animations/%s/loop", name);
     node = HALFS_insert(root, path);
     node->ops.mode = 0666;
@@ -276,6 +838,11 @@ static void HAL_insert_animation(HALFS *root, const char *name, unsigned char id
     node->ops.write = anim_loop_write;
     node->id = id;
 
+    node = HAL_insert_raw(root, path, node);
+    node->ops.size = 1;
+    node->ops.read = anim_loop_raw_read;
+    node->ops.write = anim_loop_raw_write;
+
     sprintf(path, "/animations/%s/play", name);
     node = HALFS_insert(root, path);
     node->ops.mode = 0666;
@@ -284,6 +851,11 @@ static void HAL_insert_animation(HALFS *root, const char *name, unsigned char id
     node->ops.write = anim_play_write;
     node->id = id;
 
+    node = HAL_insert_raw(root, path, node);
+    node->ops.size = 1;
+    node->ops.read = anim_play_raw_read;
+    node->ops.write = anim_play_raw_write;
+
     sprintf(path, "/animations/%s/frames", name);
     node = HALFS_insert(root, path);
     node->ops.mode = 0666;
@@ -341,6 +913,33 @@ static HALErr HAL_load(HAL *hal)
                     node->ops.size = 13;
                     node->id = i;
                     HAL_DEBUG("  Inserted sensor %s", node->name);
+
+                    node = HAL_insert_raw(hal->root, path, node);
+                    node->ops.read = sensor_raw_read;
+                    node->ops.size = 2;
+
+                    /* Sampled once /driver/sampling is set */
+                    if (! HALConn_set_history(hal->conn, i, 1)){
+                        HAL_WARN("No history for sensor %hhu", i);
+                        continue;
+                    }
+                    strcat(path, ".history");
+                    node = HALFS_insert(hal->root, path);
+                    node->ops.mode = 0666;
+                    node->ops.read = sensor_history_read;
+                    node->ops.write = sensor_history_write;
+                    node->ops.size = HAL_HISTORY_LINE*HALHistory_size(HALConn_history(hal->conn, i));
+                    node->ops.snapshot = 1;
+                    node->id = i;
+
+                    strcpy(file, (const char *) msg.data);
+                    strcat(path, ".stats");
+                    node = HALFS_insert(hal->root, path);
+                    node->ops.mode = 0444;
+                    node->ops.read = sensor_stats_read;
+                    node->ops.size = 128;
+                    node->ops.snapshot = 1;
+                    node->id = i;
                 }
                 break;
             case SWITCH:
@@ -359,8 +958,14 @@ static HALErr HAL_load(HAL *hal)
                     node->ops.write = switch_write;
                     node->ops.read = switch_read;
                     node->ops.size = 2;
+                    node->ops.watch = SWITCH;
                     node->id = i;
                     HAL_DEBUG("  Inserted switch %s", node->name);
+
+                    node = HAL_insert_raw(hal->root, path, node);
+                    node->ops.write = switch_raw_write;
+                    node->ops.read = switch_raw_read;
+                    node->ops.size = 1;
                 }
                 break;
             case RGB:
@@ -379,8 +984,14 @@ static HALErr HAL_load(HAL *hal)
                     node->ops.write = rgb_write;
                     node->ops.read = rgb_read;
                     node->ops.size = 8;
+                    node->ops.watch = RGB;
                     node->id = i;
                     HAL_DEBUG("  Inserted rgb %s", node->name);
+
+                    node = HAL_insert_raw(hal->root, path, node);
+                    node->ops.write = rgb_raw_write;
+                    node->ops.read = rgb_raw_read;
+                    node->ops.size = 3;
                 }
                 break;
             case ANIMATION_FRAMES:
@@ -415,8 +1026,13 @@ static HALErr HAL_load(HAL *hal)
                     node->ops.mode = 0444;
                     node->ops.read = trigger_read;
                     node->ops.size = 2;
+                    node->ops.watch = TRIGGER;
                     node->id = i;
                     HAL_DEBUG("  Inserted trigger %s", node->name);
+
+                    node = HAL_insert_raw(hal->root, path, node);
+                    node->ops.read = trigger_raw_read;
+                    node->ops.size = 1;
                 }
                 break;
         }
@@ -432,12 +1048,105 @@ static HALErr HAL_load(HAL *hal)
     node->ops.read = driver_tx_bytes_read;
     node->ops.size = 11;
 
+    node = HALFS_insert(hal->root, "/driver/rx_frames");
+    node->ops.mode = 0444;
+    node->ops.read = driver_rx_frames_read;
+    node->ops.size = 11;
+
+    node = HALFS_insert(hal->root, "/driver/tx_frames");
+    node->ops.mode = 0444;
+    node->ops.read = driver_tx_frames_read;
+    node->ops.size = 11;
+
+    node = HALFS_insert(hal->root, "/driver/shadow");
+    node->ops.mode = 0666;
+    node->ops.read = driver_shadow_read;
+    node->ops.write = driver_shadow_write;
+    node->ops.size = 2;
+
+    node = HALFS_insert(hal->root, "/driver/shadow_hits");
+    node->ops.mode = 0444;
+    node->ops.read = driver_shadow_hits_read;
+    node->ops.size = 11;
+
+    node = HALFS_insert(hal->root, "/driver/dedup_hits");
+    node->ops.mode = 0444;
+    node->ops.read = driver_dedup_hits_read;
+    node->ops.size = 11;
+
+    node = HALFS_insert(hal->root, "/driver/batch_window");
+    node->ops.mode = 0666;
+    node->ops.read = driver_batch_window_read;
+    node->ops.write = driver_batch_window_write;
+    node->ops.size = 8;
+
+    node = HALFS_insert(hal->root, "/driver/heartbeat");
+    node->ops.mode = 0666;
+    node->ops.read = driver_heartbeat_read;
+    node->ops.write = driver_heartbeat_write;
+    node->ops.size = 8;
+
+    node = HALFS_insert(hal->root, "/driver/hedge");
+    node->ops.mode = 0666;
+    node->ops.read = driver_hedge_read;
+    node->ops.write = driver_hedge_write;
+    node->ops.size = 3;
+
+    node = HALFS_insert(hal->root, "/driver/event_seq");
+    node->ops.mode = 0444;
+    node->ops.read = driver_event_seq_read;
+    node->ops.size = 21;
+
+    node = HALFS_insert(hal->root, "/driver/sampling");
+    node->ops.mode = 0666;
+    node->ops.read = driver_sampling_read;
+    node->ops.write = driver_sampling_write;
+    node->ops.size = 8;
+
+    node = HALFS_insert(hal->root, "/driver/link");
+    node->ops.mode = 0444;
+    node->ops.read = driver_link_read;
+    node->ops.size = 128;
+
+    node = HALFS_insert(hal->root, "/driver/sched");
+    node->ops.mode = 0444;
+    node->ops.read = driver_sched_read;
+    node->ops.size = 4*80;
+
+    node = HALFS_insert(hal->root, "/driver/baudrate");
+    node->ops.mode = 0444;
+    node->ops.read = driver_baudrate_read;
+    node->ops.size = 8;
+
+    node = HALFS_insert(hal->root, "/driver/shm");
+    node->ops.mode = 0644;
+    node->ops.read = driver_shm_read;
+    node->ops.write = driver_shm_write;
+    node->ops.size = NAME_MAX + 3;
+
     node = HALFS_insert(hal->root, "/driver/loglevel");
     node->ops.mode = 0666;
     node->ops.read = driver_loglevel_read;
     node->ops.write = driver_loglevel_write;
     node->ops.size = 2;
 
+    node = HALFS_insert(hal->root, "/driver/queues");
+    node->ops.mode = 0444;
+    node->ops.read = driver_queues_read;
+    node->ops.size = HALCONN_TX_CLASSES*HAL_QUEUES_LINE;
+    node->ops.snapshot = 1;
+
+    node = HALFS_insert(hal->root, "/driver/capture");
+    node->ops.mode = 0644;
+    node->ops.read = driver_capture_read;
+    node->ops.write = driver_capture_write;
+    node->ops.size = 255;
+
+    node = HALFS_insert(hal->root, "/driver/log_dropped");
+    node->ops.mode = 0444;
+    node->ops.read = driver_log_dropped_read;
+    node->ops.size = 11;
+
     node = HALFS_insert(hal->root, "/driver/version");
     node->ops.mode = 0444;
     node->ops.read = driver_version_read;
@@ -448,6 +1157,12 @@ static HALErr HAL_load(HAL *hal)
     node->ops.read = driver_uptime_read;
     node->ops.size = 11;
 
+    node = HALFS_insert(hal->root, "/driver/metrics");
+    node->ops.mode = 0444;
+    node->ops.read = driver_metrics_read;
+    node->ops.size = HAL_METRICS_SIZE;
+    node->ops.snapshot = 1;
+
     node = HALFS_insert(hal->root, "/events");
     node->ops.target = HALConn_sock_path(hal->conn);
 
@@ -456,7 +1171,7 @@ static HALErr HAL_load(HAL *hal)
     return OK;
 }
 
-HAL *HAL_connect()
+HAL *HAL_connect(const HALConnOpts *opts)
 {
     HALConnection *conn = NULL;
     HAL *res = NULL;
@@ -477,7 +1192,7 @@ HAL *HAL_connect()
 
     for (size_t i = 0; i < globbuf.gl_pathc; i++){
         HAL_DEBUG("Trying %s", globbuf.gl_pathv[i]);
-        conn = HALConn_open(globbuf.gl_pathv[i], sock_path);
+        conn = HALConn_open(globbuf.gl_pathv[i], sock_path, opts);
         sleep(2);
 
         if (! conn){
@@ -489,6 +1204,7 @@ HAL *HAL_connect()
             if (HAL_load(res) == OK){
                 HAL_INFO("Connected to %s !", globbuf.gl_pathv[i]);
                 HALConn_run_reader(conn, res->trigger_names, res->n_triggers);
+                HALConn_negotiate(conn);
             } else {
                 HALFS_destroy(res->root);
                 free(res);
@@ -11,7 +11,7 @@ typedef struct HAL {
     const char **trigger_names;
 } HAL;
 
-HAL *HAL_connect();
+HAL *HAL_connect(const HALConnOpts *opts);
 
 void HAL_release(HAL *hal);
 
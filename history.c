@@ -0,0 +1,131 @@
+#include "history.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A sample is valid when seq is its index+1; 0 while being written */
+struct HALSlot {
+    uint64_t seq;
+    uint64_t ts;
+    unsigned int value;
+};
+
+struct HALHistory {
+    size_t size;
+    uint64_t head;           /* Samples ever added */
+    struct HALSlot *slots;
+
+    /* Published aggregates: seqlock, odd while being written */
+    unsigned int stats_seq;
+    size_t count;
+    unsigned int min, max, last;
+    double mean, ewma;
+    double sum;              /* Writer only */
+};
+
+HALHistory *HALHistory_create(size_t size)
+{
+    HALHistory *res = calloc(1, sizeof(HALHistory));
+    if (! res){
+        return NULL;
+    }
+    res->size = size ? size : 1;
+    res->slots = calloc(res->size, sizeof(struct HALSlot));
+    if (! res->slots){
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+void HALHistory_destroy(HALHistory *history)
+{
+    free(history->slots);
+    free(history);
+}
+
+size_t HALHistory_size(HALHistory *history)
+{
+    return history->size;
+}
+
+static void store_double(double *dest, double val)
+{
+    __atomic_store(dest, &val, __ATOMIC_RELAXED);
+}
+
+static double load_double(double *src)
+{
+    double res;
+    __atomic_load(src, &res, __ATOMIC_RELAXED);
+    return res;
+}
+
+void HALHistory_add(HALHistory *history, uint64_t ts, unsigned int value)
+{
+    uint64_t index = history->head;
+    struct HALSlot *slot = history->slots + (index % history->size);
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->ts, ts, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, index+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&history->head, index+1, __ATOMIC_RELEASE);
+
+    /* Only the writer modifies aggregates: it may read them plainly */
+    size_t count = history->count + 1;
+    history->sum += value;
+    double ewma = (count == 1) ? value :
+                  history->ewma + HALHISTORY_EWMA_WEIGHT * (value - history->ewma);
+
+    unsigned int seq = history->stats_seq;
+    __atomic_store_n(&history->stats_seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (count == 1 || value < history->min){
+        __atomic_store_n(&history->min, value, __ATOMIC_RELAXED);
+    }
+    if (count == 1 || value > history->max){
+        __atomic_store_n(&history->max, value, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&history->last, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&history->count, count, __ATOMIC_RELAXED);
+    store_double(&history->mean, history->sum / count);
+    store_double(&history->ewma, ewma);
+    __atomic_store_n(&history->stats_seq, seq+2, __ATOMIC_RELEASE);
+}
+
+size_t HALHistory_samples(HALHistory *history, HALSample *dest, size_t n)
+{
+    uint64_t head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+    if (n > history->size){
+        n = history->size;
+    }
+    uint64_t first = (head > n) ? head - n : 0;
+
+    size_t res = 0;
+    for (uint64_t index=first; index<head; index++){
+        struct HALSlot *slot = history->slots + (index % history->size);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dest[res].ts = __atomic_load_n(&slot->ts, __ATOMIC_RELAXED);
+        dest[res].value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq == index+1 && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq){
+            res++;
+        }
+    }
+    return res;
+}
+
+void HALHistory_stats(HALHistory *history, HALHistoryStats *stats)
+{
+    unsigned int seq;
+    do {
+        seq = __atomic_load_n(&history->stats_seq, __ATOMIC_ACQUIRE);
+        stats->count = __atomic_load_n(&history->count, __ATOMIC_RELAXED);
+        stats->min = __atomic_load_n(&history->min, __ATOMIC_RELAXED);
+        stats->max = __atomic_load_n(&history->max, __ATOMIC_RELAXED);
+        stats->last = __atomic_load_n(&history->last, __ATOMIC_RELAXED);
+        stats->mean = load_double(&history->mean);
+        stats->ewma = load_double(&history->ewma);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&history->stats_seq, __ATOMIC_RELAXED) != seq);
+}
@@ -0,0 +1,58 @@
+#ifndef DEFINE_HISTORY_HEADER
+#define DEFINE_HISTORY_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  History of a sensor: ring of the last samples, and aggregates over all
+ *  samples, maintained as samples are added. There is a single writer (the
+ *  sampler thread); readers never block it nor each other. Samples that are
+ *  overwritten while being read are skipped, and aggregates are read again
+ *  if they changed while being read.
+ */
+
+#ifndef HALHISTORY_EWMA_WEIGHT
+/* Weight of a new sample in the exponentially weighted moving average */
+#define HALHISTORY_EWMA_WEIGHT 0.125
+#endif
+
+typedef struct HALSample {
+    uint64_t ts;        //!< Wall clock (usec)
+    unsigned int value; //!< Raw sensor value
+} HALSample;
+
+typedef struct HALHistoryStats {
+    size_t count;       //!< Samples ever added
+    unsigned int min;
+    unsigned int max;
+    unsigned int last;
+    double mean;
+    double ewma;
+} HALHistoryStats;
+
+typedef struct HALHistory HALHistory;
+
+/*!
+ *  Create an empty history keeping the last size samples
+ */
+HALHistory *HALHistory_create(size_t size);
+
+void HALHistory_destroy(HALHistory *history);
+
+size_t HALHistory_size(HALHistory *history);
+
+/*!
+ *  Add a sample, and update aggregates. Must not be called concurrently.
+ */
+void HALHistory_add(HALHistory *history, uint64_t ts, unsigned int value);
+
+/*!
+ *  Copy at most n of the last samples in dest, oldest first
+ *  @return Number of samples copied
+ */
+size_t HALHistory_samples(HALHistory *history, HALSample *dest, size_t n);
+
+void HALHistory_stats(HALHistory *history, HALHistoryStats *stats);
+
+#endif
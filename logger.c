@@ -1,13 +1,59 @@
 #include "logger.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 int current_log_level = LOG_LEVEL;
 
 char level_prefix[] = " EWIDC";
 int level_color[] = {0, 1, 3, 2, 4, 5};
 
+/*
+ *  Log records are pushed by any thread in a bounded lock-free ring (one
+ *  sequence number per slot, see D. Vyukov's bounded MPMC queue), and
+ *  written by a background thread. When the ring is full, records are
+ *  dropped and counted rather than waiting for the writer.
+ */
+
+#ifndef LOGGER_RING_SIZE
+/* Number of records in the ring; must be a power of 2 */
+#define LOGGER_RING_SIZE 1024
+#endif
+
+#ifndef LOGGER_RECORD_LEN
+#define LOGGER_RECORD_LEN 256
+#endif
+
+enum {LOG_TEXT, LOG_DUMP};
+
+struct log_record {
+    size_t seq;
+    int lvl;
+    int kind;
+    time_t when;
+    const char *prefix; /* For dumps; must be a literal */
+    union {
+        char text[LOGGER_RECORD_LEN];
+        HALMsg msg;     /* Dumps are formatted by the writer thread */
+    };
+};
+
+enum {LOGGER_STOPPED, LOGGER_STARTING, LOGGER_RUNNING, LOGGER_SYNC};
+
+static struct log_record ring[LOGGER_RING_SIZE];
+static size_t ring_head = 0; /* Next slot to fill (producers) */
+static size_t ring_tail = 0; /* Next slot to write (writer thread) */
+static size_t dropped = 0;
+static int logger_state = LOGGER_STOPPED;
+static int logger_stop = 0;
+static sem_t logger_sem;
+static pthread_t logger_thread;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const char *HALErr_desc(HALErr err)
 {
     switch (err){
@@ -23,46 +69,260 @@ const char *HALErr_desc(HALErr err)
     }
 }
 
+/* Format timestamp; only recomputed when the second changes */
+static const char *format_time(time_t when)
+{
+    static time_t cached_when = -1;
+    static char cached[80];
+
+    if (when != cached_when){
+        struct tm now;
+        localtime_r(&when, &now);
+        snprintf(cached, sizeof(cached), "%02d-%02d-%02d %02d:%02d:%02d",
+                 now.tm_year + 1900, now.tm_mon + 1, now.tm_mday,
+                 now.tm_hour, now.tm_min, now.tm_sec);
+        cached_when = when;
+    }
+    return cached;
+}
+
+static void write_record(const struct log_record *rec)
+{
+    if (rec->kind == LOG_TEXT){
+        printf("\033[1;3%dm(%c) %s\033[0m %s\n",
+               level_color[rec->lvl], level_prefix[rec->lvl],
+               format_time(rec->when), rec->text);
+        return;
+    }
+
+    const HALMsg *msg = &rec->msg;
+    char line[16*4 + 2];
+    fprintf(stderr,
+        "%s#%c%-3hhu: command=%02hhx, type=%c%c, rid=%hhu, len=%hhu chk=%d\n",
+        rec->prefix ? rec->prefix : "",
+        (IS_ARDUINO_SEQ(msg->seq) ? 'A' : 'D'),
+        ABSOLUTE_SEQ(msg->seq),
+        msg->cmd,
+        MSG_TYPE(msg), MSG_IS_CHANGE(msg) ? '!' : '?',
+        msg->rid,
+        msg->len,
+        msg->chk);
+
+    for (int i=0; i<16 && 16*i<msg->len; i++){
+        size_t n = 0;
+        for (int j=0; j<16 && 16*i+j < msg->len; j++){
+            n += snprintf(line+n, sizeof(line)-n, "  %02hhx", msg->data[16*i+j]);
+        }
+        line[n++] = '\n';
+        fwrite(line, 1, n, stderr);
+    }
+}
+
+/* Write all available records; return the number of records written */
+static size_t drain_ring(void)
+{
+    size_t n = 0;
+    while (1){
+        struct log_record *rec = ring + (ring_tail & (LOGGER_RING_SIZE-1));
+        size_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq != ring_tail + 1){
+            break;
+        }
+        write_record(rec);
+        __atomic_store_n(&rec->seq, ring_tail + LOGGER_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    if (n > 0){
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return n;
+}
+
+static void *logger_run(void *arg)
+{
+    while (! __atomic_load_n(&logger_stop, __ATOMIC_ACQUIRE)){
+        sem_wait(&logger_sem);
+        drain_ring();
+    }
+    drain_ring();
+    return NULL;
+}
+
+/* Write pending records before exiting */
+static void logger_shutdown(void)
+{
+    if (__atomic_load_n(&logger_state, __ATOMIC_ACQUIRE) == LOGGER_RUNNING){
+        __atomic_store_n(&logger_stop, 1, __ATOMIC_RELEASE);
+        sem_post(&logger_sem);
+        pthread_join(logger_thread, NULL);
+        __atomic_store_n(&logger_state, LOGGER_STOPPED, __ATOMIC_RELEASE);
+    }
+}
+
+static void init_ring(void)
+{
+    for (size_t i=0; i<LOGGER_RING_SIZE; i++){
+        ring[i].seq = i;
+    }
+    ring_head = ring_tail = 0;
+}
+
+#ifndef LOGGER_FORK_WAIT
+/* Longest wait (msec) for the writer to drain the ring before fork() */
+#define LOGGER_FORK_WAIT 100
+#endif
+
+/* Let the writer write pending records before fork(), so that the child
+   does not start with records it will never write */
+static void logger_prepare(void)
+{
+    if (__atomic_load_n(&logger_state, __ATOMIC_ACQUIRE) != LOGGER_RUNNING){
+        return;
+    }
+    const struct timespec msec = {.tv_sec=0, .tv_nsec=1000000};
+    size_t head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    sem_post(&logger_sem);
+    for (int i=0; i<LOGGER_FORK_WAIT; i++){
+        if ((long int) (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) - head) >= 0){
+            break;
+        }
+        nanosleep(&msec, NULL);
+    }
+}
+
+/* The writer thread does not survive fork(); start a new one when needed.
+   Records it did not write yet are dropped with the ring. */
+static void logger_forked(void)
+{
+    if (logger_state == LOGGER_RUNNING){
+        dropped += ring_head - ring_tail;
+    }
+    logger_state = LOGGER_STOPPED;
+}
+
+static int logger_start(void)
+{
+    static int registered = 0;
+    int state = LOGGER_STOPPED;
+
+    if (! __atomic_compare_exchange_n(&logger_state, &state, LOGGER_STARTING, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        /* Someone else is starting it: log synchronously meanwhile */
+        return state == LOGGER_RUNNING;
+    }
+
+    state = LOGGER_SYNC;
+    logger_stop = 0;
+    init_ring();
+    if (sem_init(&logger_sem, 0, 0) == 0){
+        if (pthread_create(&logger_thread, NULL, logger_run, NULL) == 0){
+            state = LOGGER_RUNNING;
+        } else {
+            sem_destroy(&logger_sem);
+        }
+    }
+    if (! registered){
+        atexit(logger_shutdown);
+        pthread_atfork(logger_prepare, NULL, logger_forked);
+        registered = 1;
+    }
+    __atomic_store_n(&logger_state, state, __ATOMIC_RELEASE);
+    return state == LOGGER_RUNNING;
+}
+
+/* Reserve a slot in the ring, or return NULL if it is full */
+static struct log_record *reserve_record(void)
+{
+    size_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    while (1){
+        struct log_record *rec = ring + (pos & (LOGGER_RING_SIZE-1));
+        size_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        long int diff = (long int) seq - (long int) pos;
+        if (diff == 0){
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos+1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                return rec;
+            }
+        } else if (diff < 0){
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void publish_record(struct log_record *rec)
+{
+    size_t pos = rec->seq;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&logger_sem);
+}
+
+/* Return a record to fill, or NULL to log synchronously */
+static struct log_record *new_record(int lvl, int kind, struct log_record *sync_rec)
+{
+    int state = __atomic_load_n(&logger_state, __ATOMIC_ACQUIRE);
+    struct log_record *rec = sync_rec;
+
+    if (state == LOGGER_RUNNING || (state == LOGGER_STOPPED && logger_start())){
+        rec = reserve_record();
+        if (! rec){
+            return NULL;
+        }
+    }
+    rec->lvl = lvl;
+    rec->kind = kind;
+    rec->when = time(NULL);
+    return rec;
+}
+
+static void commit_record(struct log_record *rec, struct log_record *sync_rec)
+{
+    if (rec == sync_rec){
+        pthread_mutex_lock(&sync_lock);
+        write_record(rec);
+        fflush((rec->kind == LOG_TEXT) ? stdout : stderr);
+        pthread_mutex_unlock(&sync_lock);
+    } else {
+        publish_record(rec);
+    }
+}
+
 void print_log(int lvl, const char *fmt, ... )
 {
     if (current_log_level >= lvl){
+        struct log_record sync_rec;
+        struct log_record *rec = new_record(lvl, LOG_TEXT, &sync_rec);
+        if (! rec){
+            return;
+        }
+
         va_list args;
         va_start(args, fmt);
-
-        time_t now_seconds = time(NULL);
-        struct tm *now = localtime(&now_seconds);
-
-        printf("\033[1;3%dm(%c) %02d-%02d-%02d %02d:%02d:%02d\033[0m ", 
-               level_color[lvl], level_prefix[lvl],
-               now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,
-               now->tm_hour, now->tm_min, now->tm_sec);
-        vprintf(fmt, args);
-        printf("\n");
-        fflush(stdout);
+        vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+        va_end(args);
+        commit_record(rec, &sync_rec);
     }
 }
 
 void dump_message(const HALMsg *msg, const char *prefix){
     if (current_log_level >= DUMP){
-        if (prefix){
-            fprintf(stderr, "%s", prefix);
+        struct log_record sync_rec;
+        struct log_record *rec = new_record(DUMP, LOG_DUMP, &sync_rec);
+        if (! rec){
+            return;
         }
 
-        fprintf(stderr, 
-            "#%c%-3hhu: command=%02hhx, type=%c%c, rid=%hhu, len=%hhu chk=%d\n", 
-            (IS_ARDUINO_SEQ(msg->seq) ? 'A' : 'D'),
-            ABSOLUTE_SEQ(msg->seq),
-            msg->cmd,
-            MSG_TYPE(msg), MSG_IS_CHANGE(msg) ? '!' : '?',
-            msg->rid,
-            msg->len,
-            msg->chk);
-        
-        for (int i=0; i<16 && 16*i<msg->len; i++){
-            for (int j=0; j<16 && 16*i+j < msg->len; j++){
-                fprintf(stderr, "  %02hhx", msg->data[16*i+j]);
-            }
-            fprintf(stderr, "\n");
-        }
+        rec->prefix = prefix;
+        memcpy(&rec->msg, msg, 5 + (size_t) msg->len);
+        commit_record(rec, &sync_rec);
     }
 }
+
+size_t HALLog_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -25,6 +25,14 @@ const char *HALErr_desc(HALErr err);
 
 void dump_message(const HALMsg *msg, const char *prefix);
 
+/*!
+ *  Log calls only push records in a ring buffer, written by a background
+ *  thread. Records are dropped (and counted) when the ring is full, and
+ *  in a forked child, when the writer could not write them before fork().
+ *  @return Number of dropped log records
+ */
+size_t HALLog_dropped(void);
+
 #define HAL_ERROR(err,fmt,...) print_log(ERROR, "{ERROR %d: %s} "fmt, err, HALErr_desc(err), ##__VA_ARGS__)
 #define HAL_WARN(fmt,...) print_log(WARNING, fmt, ##__VA_ARGS__)
 #define HAL_INFO(fmt,...) print_log(INFO, fmt, ##__VA_ARGS__)
@@ -0,0 +1,186 @@
+#include "metrics.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+static HALFSStats fs_stats;
+
+void HALFS_account(HALFSOp op, int res)
+{
+    __atomic_add_fetch(&fs_stats.calls[op], 1, __ATOMIC_RELAXED);
+    if (res < 0){
+        __atomic_add_fetch(&fs_stats.errors[op], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void HALFS_stats(HALFSStats *stats)
+{
+    for (int i=0; i<HALFS_OPS; i++){
+        stats->calls[i] = __atomic_load_n(&fs_stats.calls[i], __ATOMIC_RELAXED);
+        stats->errors[i] = __atomic_load_n(&fs_stats.errors[i], __ATOMIC_RELAXED);
+    }
+}
+
+static const char *op_label(HALFSOp op)
+{
+    switch (op){
+        case HALFS_OP_GETATTR:  return "getattr";
+        case HALFS_OP_READDIR:  return "readdir";
+        case HALFS_OP_OPEN:     return "open";
+        case HALFS_OP_READ:     return "read";
+        case HALFS_OP_WRITE:    return "write";
+        case HALFS_OP_TRUNCATE: return "truncate";
+        case HALFS_OP_READLINK: return "readlink";
+        case HALFS_OP_POLL:     return "poll";
+        default: return "unknown";
+    }
+}
+
+static const char *err_label(HALErr err)
+{
+    switch (err){
+        case OK:        return "OK";
+        case TIMEOUT:   return "TIMEOUT";
+        case SEQERR:    return "SEQERR";
+        case LOCKERR:   return "LOCKERR";
+        case CHKERR:    return "CHKERR";
+        case READERR:   return "READERR";
+        case WRITEERR:  return "WRITEERR";
+        case OUTOFSYNC: return "OUTOFSYNC";
+        default: return "UNKNERR";
+    }
+}
+
+static const char *tx_class_label[HALCONN_TX_CLASSES] = {"control", "interactive", "read", "bulk"};
+
+/* Append to buf; *len keeps growing past size, as snprintf */
+static void emit(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int r = vsnprintf(buf + ((*len < size) ? *len : size),
+                      (*len < size) ? size - *len : 0, fmt, args);
+    va_end(args);
+    if (r > 0){
+        *len += r;
+    }
+}
+
+static void emit_header(char *buf, size_t size, size_t *len,
+                        const char *name, const char *type, const char *help)
+{
+    emit(buf, size, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Frames by command: type character (or hex code) and change flag */
+static void emit_frames(char *buf, size_t size, size_t *len, const char *name, const size_t *by_cmd)
+{
+    for (int cmd=0; cmd<256; cmd++){
+        if (by_cmd[cmd] == 0){
+            continue;
+        }
+        int type = cmd & 0x7f;
+        char label[8];
+        if (isgraph(type) && type != '"' && type != '\\'){
+            snprintf(label, sizeof(label), "%c", type);
+        } else {
+            snprintf(label, sizeof(label), "0x%02x", type);
+        }
+        emit(buf, size, len, "%s{cmd=\"%s\",change=\"%d\"} %lu\n",
+             name, label, (cmd & PARAM_CHANGE) ? 1 : 0, (unsigned long int) by_cmd[cmd]);
+    }
+}
+
+#define EMIT_VALUE(name,type,help,value) do { \
+    emit_header(buf, size, &len, name, type, help); \
+    emit(buf, size, &len, "%s %lu\n", name, (unsigned long int) (value)); \
+} while (0)
+
+size_t HALMetrics_render(const HALConnStats *conn, const HALFSStats *fs, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    EMIT_VALUE("hal_uptime_seconds", "gauge", "Time since the connection was opened", conn->uptime);
+    EMIT_VALUE("hal_baudrate", "gauge", "Current baudrate of the serial link", conn->baudrate);
+    EMIT_VALUE("hal_rx_bytes_total", "counter", "Bytes read from the Arduino", conn->rx_bytes);
+    EMIT_VALUE("hal_tx_bytes_total", "counter", "Bytes written to the Arduino", conn->tx_bytes);
+
+    emit_header(buf, size, &len, "hal_rx_frames_total", "counter", "Frames received, by command");
+    emit_frames(buf, size, &len, "hal_rx_frames_total", conn->rx_by_cmd);
+    emit_header(buf, size, &len, "hal_tx_frames_total", "counter", "Frames transmitted, by command");
+    emit_frames(buf, size, &len, "hal_tx_frames_total", conn->tx_by_cmd);
+
+    EMIT_VALUE("hal_checksum_errors_total", "counter", "Frames received with a bad checksum", conn->chk_errors);
+    EMIT_VALUE("hal_resyncs_total", "counter", "Frames dropped because of an unexpected SYNC byte", conn->sync_errors);
+
+    emit_header(buf, size, &len, "hal_requests_total", "counter", "Requests completed, by result");
+    for (int i=0; i<HALCONN_ERRORS; i++){
+        emit(buf, size, &len, "hal_requests_total{result=\"%s\"} %lu\n",
+             err_label(i), (unsigned long int) conn->requests[i]);
+    }
+    EMIT_VALUE("hal_requests_inflight", "gauge", "Requests waiting for a response", conn->inflight);
+
+    emit_header(buf, size, &len, "hal_request_duration_seconds", "histogram", "Latency of requests");
+    size_t count = 0;
+    for (int i=0; i<HALCONN_LATENCY_BUCKETS; i++){
+        count += conn->latency[i];
+        if (i < HALCONN_LATENCY_BUCKETS-1){
+            emit(buf, size, &len, "hal_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                 HALConn_latency_bounds[i] / 1e6, (unsigned long int) count);
+        } else {
+            emit(buf, size, &len, "hal_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n",
+                 (unsigned long int) count);
+        }
+    }
+    emit(buf, size, &len, "hal_request_duration_seconds_sum %.6f\n", conn->latency_sum);
+    emit(buf, size, &len, "hal_request_duration_seconds_count %lu\n", (unsigned long int) count);
+
+    emit_header(buf, size, &len, "hal_tx_queue_depth", "gauge", "Frames waiting to be transmitted, by class");
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        emit(buf, size, &len, "hal_tx_queue_depth{class=\"%s\"} %lu\n",
+             tx_class_label[i], (unsigned long int) conn->tx[i].depth);
+    }
+    emit_header(buf, size, &len, "hal_tx_queue_max_depth", "gauge", "Max number of frames waiting at once, by class");
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        emit(buf, size, &len, "hal_tx_queue_max_depth{class=\"%s\"} %lu\n",
+             tx_class_label[i], (unsigned long int) conn->tx[i].max_depth);
+    }
+    emit_header(buf, size, &len, "hal_tx_queue_promoted_total", "counter", "Turns given because of starvation protection, by class");
+    for (int i=0; i<HALCONN_TX_CLASSES; i++){
+        emit(buf, size, &len, "hal_tx_queue_promoted_total{class=\"%s\"} %lu\n",
+             tx_class_label[i], (unsigned long int) conn->tx[i].promoted);
+    }
+
+    EMIT_VALUE("hal_link_degraded", "gauge", "Whether heartbeats are lost (requests fail right away)", conn->link.degraded);
+    EMIT_VALUE("hal_heartbeats_total", "counter", "Heartbeats sent", conn->link.sent);
+    EMIT_VALUE("hal_heartbeats_lost_total", "counter", "Heartbeats not answered in time", conn->link.lost);
+    emit_header(buf, size, &len, "hal_link_rtt_seconds", "gauge", "Round trip time of recent heartbeats");
+    emit(buf, size, &len, "hal_link_rtt_seconds{stat=\"last\"} %g\n", conn->link.rtt_last / 1e6);
+    emit(buf, size, &len, "hal_link_rtt_seconds{stat=\"min\"} %g\n", conn->link.rtt_min / 1e6);
+    emit(buf, size, &len, "hal_link_rtt_seconds{stat=\"avg\"} %g\n", conn->link.rtt_avg / 1e6);
+    emit(buf, size, &len, "hal_link_rtt_seconds{stat=\"max\"} %g\n", conn->link.rtt_max / 1e6);
+    emit_header(buf, size, &len, "hal_link_jitter_seconds", "gauge", "Smoothed variation of heartbeats round trip time");
+    emit(buf, size, &len, "hal_link_jitter_seconds %g\n", conn->link.jitter / 1e6);
+
+    EMIT_VALUE("hal_shadow_hits_total", "counter", "Asks answered from the shadow state", conn->shadow_hits);
+    EMIT_VALUE("hal_dedup_hits_total", "counter", "Asks answered with the response of an identical concurrent ask", conn->dedup_hits);
+    EMIT_VALUE("hal_hedged_asks_total", "counter", "Asks sent again because not answered in time", conn->hedges);
+    EMIT_VALUE("hal_hedge_wins_total", "counter", "Hedged asks answered by the copy first", conn->hedge_wins);
+    EMIT_VALUE("hal_event_listeners", "gauge", "Clients of the event socket", conn->listeners);
+    EMIT_VALUE("hal_events_total", "counter", "Events sent to listeners of the event socket", conn->events);
+    EMIT_VALUE("hal_log_dropped_total", "counter", "Log records dropped", HALLog_dropped());
+
+    emit_header(buf, size, &len, "hal_fuse_operations_total", "counter", "FUSE operations, by operation");
+    for (int i=0; i<HALFS_OPS; i++){
+        emit(buf, size, &len, "hal_fuse_operations_total{op=\"%s\"} %lu\n",
+             op_label(i), (unsigned long int) fs->calls[i]);
+    }
+    emit_header(buf, size, &len, "hal_fuse_errors_total", "counter", "FUSE operations that failed, by operation");
+    for (int i=0; i<HALFS_OPS; i++){
+        emit(buf, size, &len, "hal_fuse_errors_total{op=\"%s\"} %lu\n",
+             op_label(i), (unsigned long int) fs->errors[i]);
+    }
+
+    return len;
+}
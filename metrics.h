@@ -0,0 +1,43 @@
+#ifndef DEFINE_METRICS_HEADER
+#define DEFINE_METRICS_HEADER
+
+#include "com.h"
+
+/*
+ *  Driver metrics, in Prometheus text exposition format. Counters of the
+ *  FUSE layer are updated with atomic operations; counters of the connection
+ *  are copied in a single HALConn_stats call. Rendering never holds the
+ *  connection lock.
+ */
+
+typedef enum HALFSOp {
+    HALFS_OP_GETATTR  = 0,
+    HALFS_OP_READDIR  = 1,
+    HALFS_OP_OPEN     = 2,
+    HALFS_OP_READ     = 3,
+    HALFS_OP_WRITE    = 4,
+    HALFS_OP_TRUNCATE = 5,
+    HALFS_OP_READLINK = 6,
+    HALFS_OP_POLL     = 7,
+    HALFS_OPS         = 8
+} HALFSOp;
+
+typedef struct HALFSStats {
+    size_t calls[HALFS_OPS];
+    size_t errors[HALFS_OPS]; //!< Calls that returned an error
+} HALFSStats;
+
+/*!
+ *  Account for a FUSE operation that returned res (negative: error)
+ */
+void HALFS_account(HALFSOp op, int res);
+
+void HALFS_stats(HALFSStats *stats);
+
+/*!
+ *  Render metrics in buf
+ *  @return Length of the text (possibly more than size, as snprintf)
+ */
+size_t HALMetrics_render(const HALConnStats *conn, const HALFSStats *fs, char *buf, size_t size);
+
+#endif
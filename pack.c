@@ -0,0 +1,82 @@
+#include "pack.h"
+#include <string.h>
+
+/* Length of the run of identical bytes starting at src[0] */
+static inline size_t run_length(const unsigned char *src, size_t len)
+{
+    size_t n = 1;
+    while (n < len && n < 128 && src[n] == src[0]){
+        n++;
+    }
+    return n;
+}
+
+size_t HALPack_rle(const unsigned char *src, size_t len, unsigned char *dest, size_t max)
+{
+    size_t i = 0, out = 0;
+
+    while (i < len){
+        size_t run = run_length(src+i, len-i);
+        if (run >= 2){
+            /* Repeated byte */
+            if (out + 2 > max){
+                return 0;
+            }
+            dest[out++] = (unsigned char) (257 - run);
+            dest[out++] = src[i];
+            i += run;
+        } else {
+            /* Literals, until next run of 3 identical bytes */
+            size_t n = 1;
+            while (i+n < len && n < 128){
+                if (i+n+2 < len && src[i+n] == src[i+n+1] && src[i+n] == src[i+n+2]){
+                    break;
+                }
+                n++;
+            }
+            if (out + 1 + n > max){
+                return 0;
+            }
+            dest[out++] = (unsigned char) (n - 1);
+            memcpy(dest+out, src+i, n);
+            out += n;
+            i += n;
+        }
+    }
+
+    return out;
+}
+
+size_t HALPack_unrle(const unsigned char *src, size_t len, unsigned char *dest, size_t max)
+{
+    size_t i = 0, out = 0;
+
+    while (i < len){
+        unsigned char header = src[i++];
+        if (header < 128){
+            size_t n = header + 1;
+            if (i + n > len || out + n > max){
+                return 0;
+            }
+            memcpy(dest+out, src+i, n);
+            out += n;
+            i += n;
+        } else if (header > 128){
+            size_t n = 257 - header;
+            if (i >= len || out + n > max){
+                return 0;
+            }
+            memset(dest+out, src[i++], n);
+            out += n;
+        }
+    }
+
+    return out;
+}
+
+void HALPack_delta(const unsigned char *ref, size_t ref_len, const unsigned char *src, size_t len, unsigned char *dest)
+{
+    for (size_t i=0; i<len; i++){
+        dest[i] = (i < ref_len) ? (src[i] ^ ref[i]) : src[i];
+    }
+}
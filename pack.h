@@ -0,0 +1,27 @@
+#ifndef DEFINE_PACK_HEADER
+#define DEFINE_PACK_HEADER
+
+#include <stddef.h>
+
+/*!
+ *  Run-length encode src (PackBits). Each chunk starts with a header byte h:
+ *  h < 128 is followed by h+1 literal bytes, h > 128 is followed by a single
+ *  byte repeated 257-h times (h == 128 is ignored).
+ *  @return Length of encoded data, or 0 if it does not fit in max bytes
+ */
+size_t HALPack_rle(const unsigned char *src, size_t len, unsigned char *dest, size_t max);
+
+/*!
+ *  Decode PackBits encoded src
+ *  @return Length of decoded data, or 0 if src is malformed or does not fit
+ *          in max bytes
+ */
+size_t HALPack_unrle(const unsigned char *src, size_t len, unsigned char *dest, size_t max);
+
+/*!
+ *  XOR src with ref into dest (len bytes). ref is considered zero-padded
+ *  after ref_len bytes. Applying it twice with the same ref restores src.
+ */
+void HALPack_delta(const unsigned char *ref, size_t ref_len, const unsigned char *src, size_t len, unsigned char *dest);
+
+#endif
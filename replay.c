@@ -0,0 +1,289 @@
+#include "com.h"
+#include "capture.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ *  Feed captured serial traffic through the driver decoding and dispatching
+ *  path, without Arduino. Input is either a capture file (see capture.h; only
+ *  received bytes are replayed) or a raw byte stream.
+ *  Usage: replay [-n passes] [-r] [-l listeners] [-v] <file>
+ *    -n: replay the input n times (default 1)
+ *    -r: replay at recorded timing (capture files only)
+ *    -l: connect that many listeners on the event socket, and measure the
+ *        cost of events fan-out
+ *    -v: log at DUMP level
+ */
+
+#define N_TRIGGERS 256
+
+typedef struct {
+    const unsigned char *bytes;
+    size_t len;
+    uint64_t ts;
+} Chunk;
+
+typedef struct {
+    Chunk *chunks;
+    size_t n_chunks;
+    size_t bytes;
+    HALCapture *capture;
+    unsigned char *raw;
+} Input;
+
+static const char *trigger_names[N_TRIGGERS];
+
+static volatile int listening = 1;
+
+static double now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e9*now.tv_sec + now.tv_nsec;
+}
+
+/* Return 0 if out of memory */
+static int add_chunk(Input *input, const unsigned char *bytes, size_t len, uint64_t ts)
+{
+    if ((input->n_chunks & (input->n_chunks-1)) == 0){
+        size_t n = input->n_chunks ? 2*input->n_chunks : 1;
+        Chunk *chunks = realloc(input->chunks, n*sizeof(Chunk));
+        if (! chunks){
+            return 0;
+        }
+        input->chunks = chunks;
+    }
+    Chunk *chunk = input->chunks + input->n_chunks++;
+    chunk->bytes = bytes;
+    chunk->len = len;
+    chunk->ts = ts;
+    input->bytes += len;
+    return 1;
+}
+
+static int load_input(Input *input, const char *path)
+{
+    memset(input, 0, sizeof(Input));
+
+    input->capture = HALCapture_load(path);
+    if (input->capture){
+        HALCaptureRecord rec;
+        const unsigned char *bytes;
+        size_t index = 0;
+        while (HALCapture_next(input->capture, &index, &rec, &bytes)){
+            if (rec.dir == HALCAP_RX && ! add_chunk(input, bytes, rec.len, rec.ts)){
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    /* Raw byte stream */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0){
+        return 0;
+    }
+    input->raw = malloc(st.st_size ? st.st_size : 1);
+    if (! input->raw){
+        close(fd);
+        return 0;
+    }
+    size_t len = 0;
+    while (len < (size_t) st.st_size){
+        ssize_t r = read(fd, input->raw + len, st.st_size - len);
+        if (r <= 0){
+            break;
+        }
+        len += r;
+    }
+    close(fd);
+    return add_chunk(input, input->raw, len, 0);
+}
+
+static void free_input(Input *input)
+{
+    if (input->capture){
+        HALCapture_close(input->capture);
+    }
+    free(input->raw);
+    free(input->chunks);
+}
+
+/* Drain the event sockets of listeners */
+static void *run_listeners(void *arg)
+{
+    int *fds = arg;
+    size_t n = 0;
+    while (fds[n] >= 0){
+        n++;
+    }
+    struct pollfd *polled = calloc(n, sizeof(struct pollfd));
+    for (size_t i=0; i<n; i++){
+        polled[i].fd = fds[i];
+        polled[i].events = POLLIN;
+    }
+
+    char buf[4096];
+    while (listening){
+        if (poll(polled, n, 100) <= 0){
+            continue;
+        }
+        for (size_t i=0; i<n; i++){
+            if (polled[i].revents & POLLIN){
+                if (read(polled[i].fd, buf, sizeof(buf)) <= 0){
+                    polled[i].fd = -1;
+                }
+            }
+        }
+    }
+    free(polled);
+    return NULL;
+}
+
+static int *connect_listeners(HALConnection *conn, int n)
+{
+    int *fds = calloc(n+1, sizeof(int));
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HALConn_sock_path(conn), sizeof(addr.sun_path)-1);
+
+    for (int i=0; i<n; i++){
+        fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fds[i], (struct sockaddr *) &addr, sizeof(addr)) < 0){
+            perror("Unable to connect listener");
+        }
+    }
+    fds[n] = -1;
+    return fds;
+}
+
+/* Replay whole input; return elapsed time (ns) */
+static double replay(HALConnection *conn, const Input *input, int timed)
+{
+    double start = now_ns();
+    for (size_t i=0; i<input->n_chunks; i++){
+        const Chunk *chunk = input->chunks + i;
+        if (timed){
+            double at = start + (chunk->ts - input->chunks[0].ts);
+            double delay = at - now_ns();
+            if (delay > 0){
+                struct timespec ts = {.tv_sec = delay/1e9, .tv_nsec = ((long int) delay) % 1000000000l};
+                nanosleep(&ts, NULL);
+            }
+        }
+        HALConn_replay(conn, chunk->bytes, chunk->len, trigger_names, N_TRIGGERS);
+    }
+    return now_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 1, timed = 0, n_listeners = 0, opt;
+    while ((opt = getopt(argc, argv, "n:rl:v")) != -1){
+        switch (opt){
+            case 'n': passes = atoi(optarg); break;
+            case 'r': timed = 1; break;
+            case 'l': n_listeners = atoi(optarg); break;
+            case 'v': current_log_level = DUMP; break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc-1 || passes < 1){
+        fprintf(stderr, "Usage: %s [-n passes] [-r] [-l listeners] [-v] <capture or raw file>\n", argv[0]);
+        return 1;
+    }
+    if (current_log_level < DUMP){
+        current_log_level = ERROR;
+    }
+
+    Input input;
+    if (! load_input(&input, argv[optind])){
+        fprintf(stderr, "Unable to read %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    char names[N_TRIGGERS][16];
+    for (int i=0; i<N_TRIGGERS; i++){
+        snprintf(names[i], sizeof(names[i]), "trigger%d", i);
+        trigger_names[i] = names[i];
+    }
+
+    /* Messages emitted (PING echoes) are discarded */
+    char sock_path[64];
+    snprintf(sock_path, sizeof(sock_path), "/tmp/hal-replay-%d.sock", (int) getpid());
+    HALConnOpts conn_opts = {.baudrate=0, .low_latency=0, .latency_timer=0};
+    int fd = open("/dev/null", O_RDWR);
+    if (fd < 0){
+        fprintf(stderr, "Unable to open /dev/null: %s\n", strerror(errno));
+        free_input(&input);
+        return 1;
+    }
+    HALConnection *conn = HALConn_open_fd(fd, sock_path, &conn_opts);
+    if (! conn){
+        fprintf(stderr, "Unable to open connection on %s\n", sock_path);
+        close(fd);
+        free_input(&input);
+        return 1;
+    }
+
+    double elapsed = 0;
+    for (int i=0; i<passes; i++){
+        elapsed += replay(conn, &input, timed);
+    }
+    size_t frames = HALConn_rx_frames(conn);
+    size_t events = HALConn_events(conn);
+    size_t bytes = passes * input.bytes;
+
+    printf("input:      %lu bytes in %lu chunks%s\n",
+           (unsigned long int) input.bytes, (unsigned long int) input.n_chunks,
+           input.capture ? " (capture)" : "");
+    printf("decoded:    %lu frames, %lu events, %lu checksum errors, %lu resyncs\n",
+           (unsigned long int) frames, (unsigned long int) events,
+           (unsigned long int) HALConn_chk_errors(conn),
+           (unsigned long int) HALConn_sync_errors(conn));
+    if (frames > 0 && elapsed > 0){
+        printf("throughput: %.1f MB/s, %.0f frames/s, %.1f ns/frame\n",
+               1e3*bytes/elapsed, 1e9*frames/elapsed, elapsed/frames);
+    }
+
+    /* Same replay, with listeners on the event socket */
+    if (n_listeners > 0 && events > 0){
+        int *fds = connect_listeners(conn, n_listeners);
+        pthread_t listener;
+        pthread_create(&listener, NULL, run_listeners, fds);
+
+        double fanout_elapsed = 0;
+        for (int i=0; i<passes; i++){
+            fanout_elapsed += replay(conn, &input, timed);
+        }
+        listening = 0;
+        pthread_join(listener, NULL);
+
+        printf("fan-out:    %.0f ns/event with %d listeners (%.0f ns/event/listener)\n",
+               (fanout_elapsed - elapsed) / events, n_listeners,
+               (fanout_elapsed - elapsed) / events / n_listeners);
+        for (int i=0; i<n_listeners; i++){
+            close(fds[i]);
+        }
+        free(fds);
+    }
+
+    HALConn_close(conn);
+    free_input(&input);
+    return 0;
+}
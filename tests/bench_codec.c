@@ -0,0 +1,190 @@
+#include "../HALMsg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ *  Microbenchmarks of checksum, encoding and decoding of messages, in memory.
+ *  Usage: bench_codec [-n frames] [-c]
+ *  With -c, results are printed as CSV: bench,mix,frames,ns_per_frame,bytes_per_sec
+ */
+
+#define STREAM_FRAMES 1024
+
+typedef struct {
+    const char *name;
+    HALMsg msgs[STREAM_FRAMES];
+    unsigned char *stream;       /* All messages, encoded */
+    size_t stream_len;
+    size_t msgs_bytes;           /* Sum of messages length (header + data) */
+} Mix;
+
+static int csv = 0;
+static volatile unsigned long int sink = 0;
+
+static double now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e9*now.tv_sec + now.tv_nsec;
+}
+
+static void make_msg(HALMsg *msg, int kind, unsigned int *seed)
+{
+    memset(msg, 0, sizeof(HALMsg));
+    msg->seq = DRIVER_SEQ(rand_r(seed));
+    switch (kind){
+        case 0: /* Zero-length ask */
+            msg->cmd = PARAM_ASK|SENSOR;
+            msg->rid = rand_r(seed) % 16;
+            break;
+        case 1: /* RGB change */
+            msg->cmd = PARAM_CHANGE|RGB;
+            msg->rid = rand_r(seed) % 4;
+            msg->len = 3;
+            for (int i=0; i<3; i++){
+                msg->data[i] = rand_r(seed);
+            }
+            break;
+        case 2: /* Full frames of random colors */
+            msg->cmd = PARAM_CHANGE|ANIMATION_FRAMES;
+            msg->len = 255;
+            for (int i=0; i<255; i++){
+                msg->data[i] = rand_r(seed);
+            }
+            break;
+        default: /* Full frames, worst case for escaping */
+            msg->cmd = PARAM_CHANGE|ANIMATION_FRAMES;
+            msg->len = 255;
+            for (int i=0; i<255; i++){
+                msg->data[i] = (i%2) ? HALMSG_ESC : HALMSG_SYNC;
+            }
+            break;
+    }
+    msg->chk = HALMsg_checksum(msg);
+}
+
+/* kind < 0: realistic mix of 70% asks, 25% RGB, 5% frames */
+static void make_mix(Mix *mix, const char *name, int kind)
+{
+    unsigned int seed = 42;
+    mix->name = name;
+    mix->stream = malloc(STREAM_FRAMES * HALMSG_FRAME_MAX);
+    mix->stream_len = 0;
+    mix->msgs_bytes = 0;
+    for (int i=0; i<STREAM_FRAMES; i++){
+        int k = kind;
+        if (k < 0){
+            int r = rand_r(&seed) % 100;
+            k = (r < 70) ? 0 : (r < 95) ? 1 : 3;
+        }
+        make_msg(mix->msgs+i, k, &seed);
+        mix->stream_len += HALMsg_encode(mix->msgs+i, mix->stream + mix->stream_len);
+        mix->msgs_bytes += 5 + mix->msgs[i].len;
+    }
+}
+
+static void report(const char *bench, const Mix *mix, size_t frames, size_t bytes, double ns)
+{
+    if (csv){
+        printf("%s,%s,%lu,%.2f,%.0f\n", bench, mix->name,
+               (unsigned long int) frames, ns/frames, 1e9*bytes/ns);
+    } else {
+        printf("%-9s %-7s %8.1f ns/frame %10.1f MB/s\n", bench, mix->name,
+               ns/frames, 1e3*bytes/ns);
+    }
+}
+
+static void bench_checksum(Mix *mix, size_t n)
+{
+    unsigned long int sum = 0;
+    double start = now_ns();
+    for (size_t i=0; i<n; i++){
+        sum += HALMsg_checksum(mix->msgs + (i % STREAM_FRAMES));
+    }
+    double ns = now_ns() - start;
+    sink += sum;
+    report("checksum", mix, n, (n/STREAM_FRAMES) * mix->msgs_bytes, ns);
+}
+
+static void bench_encode(Mix *mix, size_t n)
+{
+    unsigned char frame[HALMSG_FRAME_MAX];
+    size_t bytes = 0;
+    double start = now_ns();
+    for (size_t i=0; i<n; i++){
+        bytes += HALMsg_encode(mix->msgs + (i % STREAM_FRAMES), frame);
+    }
+    double ns = now_ns() - start;
+    sink += frame[bytes % sizeof(frame)];
+    report("encode", mix, n, bytes, ns);
+}
+
+static void bench_decode(Mix *mix, size_t n)
+{
+    HALMsg msg;
+    HALDecoder dec;
+    size_t frames = 0, bytes = 0, consumed;
+    HALDecoder_init(&dec, &msg);
+
+    double start = now_ns();
+    while (frames < n){
+        size_t pos = 0;
+        while (pos < mix->stream_len){
+            HALDecoderRes res = HALDecoder_feed(&dec, mix->stream + pos, mix->stream_len - pos, &consumed);
+            pos += consumed;
+            if (res == HALDEC_COMPLETE){
+                frames++;
+            } else if (res == HALDEC_BADCHK || res == HALDEC_BADSYNC){
+                fprintf(stderr, "Decoding error (%d)\n", res);
+                exit(1);
+            }
+        }
+        bytes += mix->stream_len;
+    }
+    double ns = now_ns() - start;
+    sink += msg.chk;
+    report("decode", mix, frames, bytes, ns);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c")) != -1){
+        switch (opt){
+            case 'n': n = strtoul(optarg, NULL, 10); break;
+            case 'c': csv = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n frames] [-c]\n", argv[0]);
+                return 1;
+        }
+    }
+    /* Whole number of streams */
+    n = ((n + STREAM_FRAMES - 1) / STREAM_FRAMES) * STREAM_FRAMES;
+
+    static Mix mixes[5];
+    make_mix(mixes+0, "ask", 0);
+    make_mix(mixes+1, "rgb", 1);
+    make_mix(mixes+2, "anim", 2);
+    make_mix(mixes+3, "frames", 3);
+    make_mix(mixes+4, "mixed", -1);
+
+    if (csv){
+        printf("bench,mix,frames,ns_per_frame,bytes_per_sec\n");
+    }
+    for (int i=0; i<5; i++){
+        size_t frames = (i == 2 || i == 3) ? n/10 : n;
+        frames = ((frames + STREAM_FRAMES - 1) / STREAM_FRAMES) * STREAM_FRAMES;
+        bench_checksum(mixes+i, frames);
+        bench_encode(mixes+i, frames);
+        bench_decode(mixes+i, frames);
+    }
+
+    for (int i=0; i<5; i++){
+        free(mixes[i].stream);
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include "halsim.h"
+#include "../com.h"
+#include "../logger.h"
+#include "../capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/*
+ *  Measure HALConn_request throughput, latency and CPU usage against the
+ *  simulated Arduino. Usage: bench_request [-t threads] [-n requests/thread]
+ *  [-l sim latency (usec)] [-d drop rate] [-c corrupt rate] [-w batch window]
+ *  [-f features] [-C capture file] [-i interactive period (usec)]
+ *  With -i, a switch is also toggled periodically during the run, and the
+ *  latency of these changes is reported separately.
+ */
+
+struct worker {
+    HALConnection *conn;
+    unsigned int n_requests;
+    unsigned char n_sensors;
+    double *latencies;
+    unsigned int errors;
+    unsigned int seed;
+};
+
+struct interactive {
+    HALConnection *conn;
+    unsigned int period;
+    volatile int running;
+    double latencies[100000];
+    size_t n;
+};
+
+static double now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e6*now.tv_sec + now.tv_nsec/1e3;
+}
+
+static double cpu_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return 1e6*(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    for (unsigned int i=0; i<worker->n_requests; i++){
+        HALMsg msg = {.cmd=(PARAM_ASK|SENSOR), .len=0};
+        msg.rid = rand_r(&worker->seed) % worker->n_sensors;
+
+        double start = now_us();
+        HALErr err = HALConn_request(worker->conn, &msg);
+        worker->latencies[i] = now_us() - start;
+        if (err != OK){
+            worker->errors++;
+        }
+    }
+    return NULL;
+}
+
+static void *run_interactive(void *arg)
+{
+    struct interactive *inter = arg;
+    struct timespec period = {.tv_sec = inter->period/1000000, .tv_nsec = 1000l*(inter->period%1000000)};
+    while (inter->running && inter->n < sizeof(inter->latencies)/sizeof(double)){
+        HALMsg msg = {.cmd=(PARAM_CHANGE|SWITCH), .rid=0, .len=1};
+        msg.data[0] = inter->n % 2;
+        double start = now_us();
+        HALConn_request(inter->conn, &msg);
+        inter->latencies[inter->n++] = now_us() - start;
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n_threads = 4, n_requests = 1000;
+    int batch_window = -1, opt;
+    const char *capture = NULL;
+    static struct interactive inter;
+    HALSimOpts sim_opts;
+    memset(&sim_opts, 0, sizeof(sim_opts));
+    sim_opts.n_sensors = 16;
+    sim_opts.n_triggers = 4;
+    sim_opts.n_switchs = 4;
+
+    while ((opt = getopt(argc, argv, "t:n:l:d:c:w:f:C:i:")) != -1){
+        switch (opt){
+            case 't': n_threads = atoi(optarg); break;
+            case 'n': n_requests = atoi(optarg); break;
+            case 'l': sim_opts.latency = atoi(optarg); break;
+            case 'd': sim_opts.drop_rate = atof(optarg); break;
+            case 'c': sim_opts.corrupt_rate = atof(optarg); break;
+            case 'w': batch_window = atoi(optarg); break;
+            case 'f': sim_opts.features = strtol(optarg, NULL, 0); break;
+            case 'C': capture = optarg; break;
+            case 'i': inter.period = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-n requests] [-l latency] "
+                                "[-d drop rate] [-c corrupt rate] [-w batch window] "
+                                "[-f features] [-C capture file] [-i period]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    current_log_level = ERROR;
+
+    HALSim *sim = HALSim_start(&sim_opts);
+    if (! sim){
+        perror("Unable to start simulator");
+        return 1;
+    }
+
+    char sock_path[64];
+    snprintf(sock_path, sizeof(sock_path), "/tmp/bench_request-%d.sock", (int) getpid());
+    HALConnOpts conn_opts = {.baudrate=0, .low_latency=0, .latency_timer=0};
+    HALConnection *conn = HALConn_open(HALSim_path(sim), sock_path, &conn_opts);
+    if (! conn){
+        HALSim_stop(sim);
+        return 1;
+    }
+    HALConn_run_reader(conn, NULL, 0);
+    HALConn_negotiate(conn);
+    if (batch_window >= 0){
+        HALConn_set_batch_window(conn, batch_window);
+    }
+    if (capture){
+        HALConn_start_capture(conn, capture, HALCAP_DEFAULT_SIZE);
+    }
+
+    struct worker *workers = calloc(n_threads, sizeof(struct worker));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    double *latencies = calloc(n_threads * n_requests, sizeof(double));
+
+    size_t tx_frames = HALConn_tx_frames(conn);
+    size_t tx_bytes = HALConn_tx_bytes(conn);
+    double start_cpu = cpu_us();
+    double start = now_us();
+    pthread_t inter_thread;
+    if (inter.period > 0){
+        inter.conn = conn;
+        inter.running = 1;
+        pthread_create(&inter_thread, NULL, run_interactive, &inter);
+    }
+    for (unsigned int i=0; i<n_threads; i++){
+        workers[i].conn = conn;
+        workers[i].n_requests = n_requests;
+        workers[i].n_sensors = sim_opts.n_sensors;
+        workers[i].latencies = latencies + i*n_requests;
+        workers[i].seed = i;
+        pthread_create(threads+i, NULL, run_worker, workers+i);
+    }
+
+    unsigned int errors = 0;
+    for (unsigned int i=0; i<n_threads; i++){
+        pthread_join(threads[i], NULL);
+        errors += workers[i].errors;
+    }
+    double elapsed = now_us() - start;
+    double cpu = cpu_us() - start_cpu;
+    if (inter.period > 0){
+        inter.running = 0;
+        pthread_join(inter_thread, NULL);
+    }
+    tx_frames = HALConn_tx_frames(conn) - tx_frames;
+    tx_bytes = HALConn_tx_bytes(conn) - tx_bytes;
+
+    size_t total = n_threads * n_requests;
+    qsort(latencies, total, sizeof(double), cmp_double);
+
+    printf("requests:   %lu (%u threads, %u errors)\n", (unsigned long int) total, n_threads, errors);
+    printf("throughput: %.0f req/s\n", 1e6 * total / elapsed);
+    printf("latency:    p50 %.0fus, p99 %.0fus, max %.0fus\n",
+           latencies[total/2], latencies[(99*total)/100], latencies[total-1]);
+    printf("cpu:        %.2fus/req\n", cpu / total);
+    printf("tx:         %lu frames, %lu bytes\n",
+           (unsigned long int) tx_frames, (unsigned long int) tx_bytes);
+    if (inter.n > 0){
+        qsort(inter.latencies, inter.n, sizeof(double), cmp_double);
+        printf("switch:     %lu changes, p50 %.0fus, p99 %.0fus, max %.0fus\n",
+               (unsigned long int) inter.n, inter.latencies[inter.n/2],
+               inter.latencies[(99*inter.n)/100], inter.latencies[inter.n-1]);
+    }
+
+    free(latencies);
+    free(threads);
+    free(workers);
+    HALConn_close(conn);
+    HALSim_stop(sim);
+    return 0;
+}
@@ -0,0 +1,380 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include "halsim.h"
+#include "../pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+static const unsigned char SYNC = 0xff;
+static const unsigned char  ESC = 0xaa;
+
+struct HALSim {
+    pid_t pid;
+    char path[128];
+};
+
+/* State of the simulated Arduino (lives in the child process) */
+struct sim_state {
+    HALSimOpts opts;
+    int fd;
+    unsigned char seq;
+    unsigned int sensors[256];
+    unsigned char switchs[256];
+    unsigned char rgbs[256][3];
+    unsigned char anim_delay[256];
+    unsigned char anim_loop[256];
+    unsigned char anim_play[256];
+    unsigned char frames[256][255];
+    unsigned char frames_len[256];
+    unsigned char triggers[256];
+    unsigned int answered;
+};
+
+/* Frame decoder; deliberately independent of the driver one */
+struct sim_decoder {
+    int syncs;
+    int in_frame;
+    int escaped;
+    size_t pos;
+    unsigned char bytes[sizeof(HALMsg)];
+};
+
+static int sim_feed(struct sim_decoder *dec, unsigned char c)
+{
+    if (! dec->escaped && c == SYNC){
+        dec->syncs++;
+        dec->in_frame = (dec->syncs >= 3);
+        dec->pos = 0;
+        return 0;
+    }
+    dec->syncs = 0;
+    if (! dec->in_frame){
+        return 0;
+    }
+    if (! dec->escaped && c == ESC){
+        dec->escaped = 1;
+        return 0;
+    }
+    dec->escaped = 0;
+    dec->bytes[dec->pos++] = c;
+    if (dec->pos >= 5 && dec->pos == 5 + (size_t) dec->bytes[4]){
+        dec->in_frame = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static double sim_random(void)
+{
+    return ((double) rand()) / RAND_MAX;
+}
+
+static void sim_send(struct sim_state *sim, HALMsg *msg)
+{
+    unsigned char buf[3 + 2*sizeof(HALMsg)];
+    size_t n = 0;
+
+    msg->chk = HALMsg_checksum(msg);
+    if (sim->opts.corrupt_rate > 0 && sim_random() < sim->opts.corrupt_rate){
+        msg->chk ^= 0x5a;
+    }
+
+    buf[n++] = SYNC;
+    buf[n++] = SYNC;
+    buf[n++] = SYNC;
+    const unsigned char *bytes = (const unsigned char *) msg;
+    for (size_t i=0; i<5 + (size_t) msg->len; i++){
+        if (bytes[i] == SYNC || bytes[i] == ESC){
+            buf[n++] = ESC;
+        }
+        buf[n++] = bytes[i];
+    }
+    if (IS_DRIVER_SEQ(msg->seq) && sim->opts.truncate_rate > 0 && sim_random() < sim->opts.truncate_rate){
+        n--;
+    }
+
+    for (size_t written=0; written<n;){
+        ssize_t r = write(sim->fd, buf+written, n-written);
+        if (r <= 0){
+            return;
+        }
+        written += r;
+    }
+}
+
+/* Send a message on behalf of the Arduino (not an answer) */
+static void sim_emit(struct sim_state *sim, unsigned char cmd, unsigned char rid, const char *data, size_t len)
+{
+    HALMsg msg = {.seq=ARDUINO_SEQ(sim->seq++), .cmd=cmd, .rid=rid, .len=len};
+    if (len > 0){
+        memcpy(msg.data, data, len);
+    }
+    sim_send(sim, &msg);
+}
+
+static void sim_send_tree(struct sim_state *sim)
+{
+    const struct {unsigned char type; unsigned char n; const char *prefix;} tree[] = {
+        {SENSOR, sim->opts.n_sensors, "sensor"},
+        {SWITCH, sim->opts.n_switchs, "switch"},
+        {RGB, sim->opts.n_rgbs, "rgb"},
+        {ANIMATION_FRAMES, sim->opts.n_animations, "animation"},
+        {TRIGGER, sim->opts.n_triggers, "trigger"}
+    };
+    char name[32];
+
+    for (size_t i=0; i<sizeof(tree)/sizeof(tree[0]); i++){
+        name[0] = tree[i].type;
+        sim_emit(sim, TREE, tree[i].n, name, 1);
+        for (unsigned int j=0; j<tree[i].n; j++){
+            int len = snprintf(name, sizeof(name), "%s%u", tree[i].prefix, j);
+            sim_emit(sim, TREE, j, name, len);
+        }
+    }
+}
+
+/* Value of a resource, as sent in answers; return its length */
+static int sim_get(struct sim_state *sim, unsigned char type, unsigned char rid, unsigned char *dest)
+{
+    switch (type){
+        case SENSOR:
+            dest[0] = sim->sensors[rid] >> 8;
+            dest[1] = sim->sensors[rid] & 0xff;
+            return 2;
+        case SWITCH:          dest[0] = sim->switchs[rid];    return 1;
+        case TRIGGER:         dest[0] = sim->triggers[rid];   return 1;
+        case ANIMATION_DELAY: dest[0] = sim->anim_delay[rid]; return 1;
+        case ANIMATION_LOOP:  dest[0] = sim->anim_loop[rid];  return 1;
+        case ANIMATION_PLAY:  dest[0] = sim->anim_play[rid];  return 1;
+        case RGB:
+            memcpy(dest, sim->rgbs[rid], 3);
+            return 3;
+        case ANIMATION_FRAMES:
+            memcpy(dest, sim->frames[rid], sim->frames_len[rid]);
+            return sim->frames_len[rid];
+        case FEATURES:
+            dest[0] = sim->opts.features;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void sim_set(struct sim_state *sim, HALMsg *msg)
+{
+    unsigned char rid = msg->rid;
+    unsigned char unpacked[255];
+    size_t len;
+
+    switch (MSG_TYPE(msg)){
+        case SWITCH:          sim->switchs[rid] = msg->data[0];    break;
+        case ANIMATION_DELAY: sim->anim_delay[rid] = msg->data[0]; break;
+        case ANIMATION_LOOP:  sim->anim_loop[rid] = msg->data[0];  break;
+        case ANIMATION_PLAY:  sim->anim_play[rid] = msg->data[0];  break;
+        case RGB:
+            memcpy(sim->rgbs[rid], msg->data, 3);
+            break;
+        case ANIMATION_FRAMES:
+            memcpy(sim->frames[rid], msg->data, msg->len);
+            sim->frames_len[rid] = msg->len;
+            break;
+        case ANIMATION_PACKED:
+            len = HALPack_unrle(msg->data+2, msg->len-2, unpacked, sizeof(unpacked));
+            if (len != msg->data[1]){
+                fprintf(stderr, "[halsim] Malformed packed frames\n");
+                return;
+            }
+            if (msg->data[0] == HAL_PACK_DELTA){
+                HALPack_delta(sim->frames[rid], sim->frames_len[rid], unpacked, len, unpacked);
+            }
+            memcpy(sim->frames[rid], unpacked, len);
+            sim->frames_len[rid] = len;
+            break;
+    }
+}
+
+static void sim_handle(struct sim_state *sim, HALMsg *msg)
+{
+    if (HALMsg_checksum(msg) != msg->chk){
+        fprintf(stderr, "[halsim] Checksum error\n");
+        return;
+    }
+
+    /* PING echoed by the driver */
+    if (IS_ARDUINO_SEQ(msg->seq)){
+        return;
+    }
+
+    if (MSG_TYPE(msg) == TREE){
+        sim_send_tree(sim);
+        return;
+    }
+
+    if (sim->opts.drop_rate > 0 && sim_random() < sim->opts.drop_rate){
+        return;
+    }
+    /* Wedged board */
+    if (sim->opts.answer_limit && sim->answered >= sim->opts.answer_limit){
+        return;
+    }
+    sim->answered++;
+    if (sim->opts.latency > 0){
+        struct timespec delay = {
+            .tv_sec = sim->opts.latency / 1000000,
+            .tv_nsec = 1000l * (sim->opts.latency % 1000000)
+        };
+        nanosleep(&delay, NULL);
+    }
+
+    if (MSG_IS_CHANGE(msg)){
+        sim_set(sim, msg);
+    }
+    else if (MSG_TYPE(msg) == MULTI){
+        HALMsg multi = *msg;
+        size_t len = 0;
+        for (size_t i=0; i<msg->rid && len+3 < 255; i++){
+            unsigned char cmd = msg->data[2*i], rid = msg->data[2*i+1];
+            unsigned char value[255];
+            int vlen = sim_get(sim, cmd & 0x7f, rid, value);
+            if (len + 3 + vlen > 255){
+                break;
+            }
+            multi.data[len] = cmd;
+            multi.data[len+1] = rid;
+            multi.data[len+2] = vlen;
+            memcpy(multi.data+len+3, value, vlen);
+            len += 3 + vlen;
+        }
+        multi.len = len;
+        sim_send(sim, &multi);
+        return;
+    }
+    else {
+        msg->len = sim_get(sim, MSG_TYPE(msg), msg->rid, msg->data);
+    }
+
+    /* Answer with the same seq */
+    sim_send(sim, msg);
+}
+
+static long int now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000*now.tv_sec + now.tv_nsec/1000000;
+}
+
+static void sim_run(struct sim_state *sim)
+{
+    struct sim_decoder dec;
+    struct pollfd polled = {.fd = sim->fd, .events = POLLIN};
+    unsigned char buf[512];
+    long int next_ping = now_ms() + sim->opts.ping_interval;
+    long int next_trigger = now_ms() + sim->opts.trigger_interval;
+
+    memset(&dec, 0, sizeof(dec));
+    sim_emit(sim, BOOT, 0, NULL, 0);
+
+    while (1){
+        long int now = now_ms();
+        int timeout = 1000;
+        if (sim->opts.ping_interval && next_ping - now < timeout){
+            timeout = (next_ping > now) ? next_ping - now : 0;
+        }
+        if (sim->opts.trigger_interval && next_trigger - now < timeout){
+            timeout = (next_trigger > now) ? next_trigger - now : 0;
+        }
+
+        if (poll(&polled, 1, timeout) > 0){
+            ssize_t n = read(sim->fd, buf, sizeof(buf));
+            for (ssize_t i=0; i<n; i++){
+                if (sim_feed(&dec, buf[i])){
+                    sim_handle(sim, (HALMsg *) dec.bytes);
+                }
+            }
+        }
+
+        now = now_ms();
+        if (sim->opts.ping_interval && now >= next_ping){
+            sim_emit(sim, HAL_PING, 0, NULL, 0);
+            next_ping = now + sim->opts.ping_interval;
+        }
+        if (sim->opts.trigger_interval && sim->opts.n_triggers && now >= next_trigger){
+            unsigned char rid = rand() % sim->opts.n_triggers;
+            sim->triggers[rid] = ! sim->triggers[rid];
+            sim_emit(sim, TRIGGER|PARAM_CHANGE, rid, (const char *) sim->triggers+rid, 1);
+            next_trigger = now + sim->opts.trigger_interval;
+        }
+    }
+}
+
+HALSim *HALSim_start(const HALSimOpts *opts)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0){
+        return NULL;
+    }
+
+    HALSim *res = calloc(1, sizeof(HALSim));
+    strncpy(res->path, ptsname(master), sizeof(res->path)-1);
+
+    /* Keep slave side opened, so that the master does not get EIO before
+       the driver opens it */
+    int slave = open(res->path, O_RDWR | O_NOCTTY);
+    struct termios toptions;
+    tcgetattr(slave, &toptions);
+    cfmakeraw(&toptions);
+    tcsetattr(slave, TCSANOW, &toptions);
+
+    res->pid = fork();
+    if (res->pid == 0){
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        struct sim_state *sim = calloc(1, sizeof(struct sim_state));
+        sim->opts = *opts;
+        sim->fd = master;
+        srand(opts->seed);
+        for (int i=0; i<256; i++){
+            sim->sensors[i] = HALSim_sensor_value(i);
+            for (int j=0; j<3; j++){
+                sim->rgbs[i][j] = HALSim_rgb_value(i, j);
+            }
+            sim->anim_delay[i] = 40;
+        }
+        sim_run(sim);
+        exit(0);
+    }
+
+    close(master);
+    close(slave);
+    if (res->pid < 0){
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+const char *HALSim_path(HALSim *sim)
+{
+    return sim->path;
+}
+
+void HALSim_stop(HALSim *sim)
+{
+    kill(sim->pid, SIGTERM);
+    waitpid(sim->pid, NULL, 0);
+    free(sim);
+}
@@ -0,0 +1,54 @@
+#ifndef DEFINE_HALSIM_HEADER
+#define DEFINE_HALSIM_HEADER
+
+#include "../HALMsg.h"
+
+/*!
+ *  Simulated Arduino, speaking the HAL protocol on a pseudo-terminal. It runs
+ *  in a child process, so that it does not interfere with the measures of
+ *  the driver side.
+ */
+typedef struct HALSim HALSim;
+
+typedef struct HALSimOpts {
+    unsigned char n_sensors;
+    unsigned char n_switchs;
+    unsigned char n_rgbs;
+    unsigned char n_animations;
+    unsigned char n_triggers;
+    unsigned char features;            //!< Announced features (HAL_FEAT_*)
+    unsigned int latency;              //!< Delay before each answer (usec)
+    unsigned int ping_interval;        //!< Delay between 2 PINGs (ms, 0: never)
+    unsigned int trigger_interval;     //!< Delay between 2 trigger changes (ms, 0: never)
+    double drop_rate;                  //!< Probability to not answer a request
+    unsigned int answer_limit;         //!< Stop answering after that many requests (0: never)
+    double corrupt_rate;               //!< Probability to send a wrong checksum
+    double truncate_rate;              //!< Probability to send an answer without its last byte
+    unsigned int seed;
+} HALSimOpts;
+
+/*!
+ *  Open a pseudo-terminal and start the simulator on its master side
+ *  @return The simulator, or NULL on error
+ */
+HALSim *HALSim_start(const HALSimOpts *opts);
+
+/*!
+ *  Path of the slave side of the pseudo-terminal, to give to HALConn_open
+ */
+const char *HALSim_path(HALSim *sim);
+
+void HALSim_stop(HALSim *sim);
+
+/* Initial values of the simulated resources */
+static inline unsigned int HALSim_sensor_value(unsigned char rid)
+{
+    return (37*rid + 100) & 0x3ff;
+}
+
+static inline unsigned char HALSim_rgb_value(unsigned char rid, int component)
+{
+    return (unsigned char) (16*rid + component);
+}
+
+#endif
@@ -3,8 +3,7 @@
 
 TEST(create_node, {
     HALFS *node = HALFS_create("node");
-    ASSERT(node->first_child == NULL);
-    ASSERT(node->next_sibling == NULL);
+    ASSERT(node->n_children == 0);
     ASSERT(streq(node->name, "node"));
     ASSERT(HALFS_find(node, "/") == node);
     HALFS_destroy(node);
@@ -25,10 +24,68 @@ TEST(insert, {
     HALFS *child1 = HALFS_find(root, "/CHILD1");
 
     ASSERT(child1 != NULL);
-    ASSERT(child1->first_child == child2);
+    ASSERT(child1->n_children == 1);
+    ASSERT(child1->children[0] == child2);
 
     HALFS *child3 = HALFS_insert(root, "/CHILD1/CHILD3");
-    ASSERT(child2->next_sibling == child3);
+    ASSERT(child1->n_children == 2);
+    ASSERT(child1->children[1] == child3);
+    ASSERT(HALFS_insert(root, "/CHILD1/CHILD2") == child2);
+
+    HALFS_destroy(root);
+})
+
+TEST(sorted_children, {
+    HALFS *root = HALFS_create("ROOT");
+    HALFS *c = HALFS_insert(root, "/c");
+    HALFS *a = HALFS_insert(root, "/a");
+    HALFS *b = HALFS_insert(root, "/b");
+
+    ASSERT(root->n_children == 3);
+    ASSERT(root->children[0] == a);
+    ASSERT(root->children[1] == b);
+    ASSERT(root->children[2] == c);
+
+    /* Nodes do not move when children arrays grow */
+    char path[16];
+    for (int i=0; i<100; i++){
+        snprintf(path, sizeof(path), "/n%03d", i);
+        HALFS_insert(root, path);
+    }
+    ASSERT(root->n_children == 103);
+    ASSERT(HALFS_find(root, "/a") == a);
+    ASSERT(HALFS_find(root, "/c") == c);
+    ASSERT(HALFS_find(root, "/n042") != NULL);
+    for (size_t i=1; i<root->n_children; i++){
+        ASSERT(strcmp(root->children[i-1]->name, root->children[i]->name) < 0);
+    }
+
+    HALFS_destroy(root);
+})
+
+TEST(exact_match, {
+    HALFS *root = HALFS_create("ROOT");
+    HALFS *child1 = HALFS_insert(root, "/CHILD1");
+
+    ASSERT(HALFS_find(root, "/CHILD") == NULL);
+    ASSERT(HALFS_find(root, "/CHILD12") == NULL);
+    ASSERT(HALFS_find(root, "/CHILD1") == child1);
+
+    HALFS *child = HALFS_insert(root, "/CHILD");
+    ASSERT(child != child1);
+    ASSERT(HALFS_find(root, "/CHILD") == child);
+
+    HALFS_destroy(root);
+})
+
+TEST(interned_names, {
+    HALFS *root = HALFS_create("ROOT");
+    HALFS *first = HALFS_insert(root, "/a/loop");
+    HALFS *second = HALFS_insert(root, "/b/loop");
+
+    ASSERT(first != second);
+    ASSERT(first->name == second->name);
+    ASSERT(streq(first->name, "loop"));
 
     HALFS_destroy(root);
 })
@@ -36,5 +93,8 @@ TEST(insert, {
 SUITE(
     ADDTEST(create_node), 
     ADDTEST(add_child),
-    ADDTEST(insert)
-)
\ No newline at end of file
+    ADDTEST(insert),
+    ADDTEST(sorted_children),
+    ADDTEST(exact_match),
+    ADDTEST(interned_names)
+)
@@ -1,5 +1,6 @@
 #include "lighttest2.h"
 #include "../HALMsg.h"
+#include <stdlib.h>
 
 TEST(checksum, {
     HALMsg msg;
@@ -17,5 +18,226 @@ TEST(checksum, {
     ASSERT(HALMsg_checksum(&msg) == VERSION+2); //+len +data
 })
 
+TEST(multi_ask, {
+    HALMsg multi;
+    memset(&multi, 0, sizeof(multi));
+    multi.cmd = PARAM_ASK|MULTI;
+
+    ASSERT(HALMsg_value_len(SENSOR) == 2);
+    ASSERT(HALMsg_value_len(RGB) == 3);
+    ASSERT(HALMsg_value_len(ANIMATION_FRAMES) == -1);
+
+    ASSERT(HALMsg_multi_add(&multi, SENSOR, 3));
+    ASSERT(HALMsg_multi_add(&multi, RGB, 1));
+    ASSERT(multi.rid == 2);
+    ASSERT(multi.len == 4);
+    ASSERT(multi.data[0] == SENSOR && multi.data[1] == 3);
+    ASSERT(multi.data[2] == RGB && multi.data[3] == 1);
+
+    /* Answer: sensor 3 = 0x0102, rgb 1 = #aabbcc */
+    const char *answer = "C\x03\x02\x01\x02R\x01\x03\xaa\xbb\xcc";
+    memcpy(multi.data, answer, 11);
+    multi.len = 11;
+
+    HALMsg entry;
+    size_t offset = 0;
+    ASSERT(HALMsg_multi_next(&multi, &offset, &entry));
+    ASSERT(entry.cmd == SENSOR && entry.rid == 3 && entry.len == 2);
+    ASSERT(entry.data[0] == 1 && entry.data[1] == 2);
+    ASSERT(HALMsg_multi_next(&multi, &offset, &entry));
+    ASSERT(entry.cmd == RGB && entry.rid == 1 && entry.len == 3);
+    ASSERT(entry.data[2] == 0xcc);
+    ASSERT(! HALMsg_multi_next(&multi, &offset, &entry));
+
+    /* Truncated answer */
+    multi.len = 4;
+    offset = 0;
+    ASSERT(! HALMsg_multi_next(&multi, &offset, &entry));
+})
+
+/* Feed all bytes to dec, return last result other than HEADER */
+static HALDecoderRes decode_all(HALDecoder *dec, const unsigned char *bytes, size_t len, size_t *consumed)
+{
+    HALDecoderRes res;
+    size_t n = 0, total = 0;
+    do {
+        res = HALDecoder_feed(dec, bytes+total, len-total, &n);
+        total += n;
+    } while (res == HALDEC_HEADER || (res == HALDEC_INCOMPLETE && total < len));
+    *consumed = total;
+    return res;
+}
+
+TEST(encode_decode, {
+    HALMsg msg;
+    HALMsg decoded;
+    memset(&msg, 0, sizeof(msg));
+    msg.seq = 0x12;
+    msg.cmd = PARAM_CHANGE|ANIMATION_FRAMES;
+    msg.rid = HALMSG_ESC;
+    msg.len = 4;
+    msg.data[0] = HALMSG_SYNC;
+    msg.data[1] = 1;
+    msg.data[2] = HALMSG_ESC;
+    msg.data[3] = 2;
+    msg.chk = HALMsg_checksum(&msg);
+
+    unsigned char frame[HALMSG_FRAME_MAX];
+    size_t len = HALMsg_encode(&msg, frame);
+    ASSERT(len == 3 + 9 + 3);
+    ASSERT(frame[0] == HALMSG_SYNC && frame[2] == HALMSG_SYNC);
+    ASSERT(frame[6] == HALMSG_ESC);
+    ASSERT(frame[7] == HALMSG_ESC);
+
+    HALDecoder dec;
+    size_t consumed;
+    HALDecoder_init(&dec, &decoded);
+
+    /* Header first */
+    ASSERT(HALDecoder_feed(&dec, frame, len, &consumed) == HALDEC_HEADER);
+    ASSERT(consumed == 3 + 6);
+    ASSERT(decoded.len == 4);
+    ASSERT(HALDecoder_feed(&dec, frame+consumed, len-consumed, &consumed) == HALDEC_COMPLETE);
+    ASSERT(memcmp(&msg, &decoded, 9) == 0);
+
+    /* Byte by byte */
+    memset(&decoded, 0, sizeof(decoded));
+    HALDecoderRes res = HALDEC_INCOMPLETE;
+    for (size_t i=0; i<len; i++){
+        res = decode_all(&dec, frame+i, 1, &consumed);
+        ASSERT(consumed == 1);
+    }
+    ASSERT(res == HALDEC_COMPLETE);
+    ASSERT(memcmp(&msg, &decoded, 9) == 0);
+})
+
+TEST(decode_errors, {
+    HALMsg msg;
+    HALMsg decoded;
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = SENSOR;
+    msg.len = 2;
+    msg.chk = HALMsg_checksum(&msg) + 1;
+
+    unsigned char stream[3*HALMSG_FRAME_MAX];
+    size_t len = HALMsg_encode(&msg, stream);
+    HALDecoder dec;
+    size_t consumed;
+    HALDecoder_init(&dec, &decoded);
+    ASSERT(decode_all(&dec, stream, len, &consumed) == HALDEC_BADCHK);
+
+    /* Truncated message followed by a valid one */
+    msg.chk = HALMsg_checksum(&msg);
+    len = HALMsg_encode(&msg, stream) - 1;
+    len += HALMsg_encode(&msg, stream+len);
+    ASSERT(decode_all(&dec, stream, len, &consumed) == HALDEC_BADSYNC);
+    ASSERT(decode_all(&dec, stream+consumed, len-consumed, &consumed) == HALDEC_COMPLETE);
+    ASSERT(decoded.cmd == SENSOR);
+})
+
+/* Byte at a time reference implementations */
+static unsigned char ref_checksum(const HALMsg *msg)
+{
+    const unsigned char *bytes = (const unsigned char *) msg + 1;
+    unsigned char res = 0;
+    for (size_t i=0; i<((size_t) msg->len) + 4; i++){
+        res += bytes[i];
+    }
+    return res;
+}
+
+static size_t ref_encode(const HALMsg *msg, unsigned char *dest)
+{
+    const unsigned char *bytes = (const unsigned char *) msg;
+    size_t n = 0;
+    for (int i=0; i<3; i++){
+        dest[n++] = HALMSG_SYNC;
+    }
+    for (size_t i=0; i<((size_t) msg->len) + 5; i++){
+        if (bytes[i] == HALMSG_SYNC || bytes[i] == HALMSG_ESC){
+            dest[n++] = HALMSG_ESC;
+        }
+        dest[n++] = bytes[i];
+    }
+    return n;
+}
+
+/* Random message; special bytes with probability density/100 */
+static void random_msg(HALMsg *msg, size_t len, int density, unsigned int *seed)
+{
+    unsigned char *bytes = (unsigned char *) msg;
+    memset(msg, 0, sizeof(HALMsg));
+    for (size_t i=1; i<5+len; i++){
+        int r = rand_r(seed) % 100;
+        if (r < density){
+            bytes[i] = (r % 2) ? HALMSG_SYNC : HALMSG_ESC;
+        } else {
+            do {bytes[i] = rand_r(seed);} while (bytes[i] == HALMSG_SYNC || bytes[i] == HALMSG_ESC);
+        }
+    }
+    msg->len = len;
+    msg->chk = ref_checksum(msg);
+}
+
+static const int densities[] = {0, 1, 10, 50, 100};
+
+TEST(bulk_kernels, {
+    HALMsg msg;
+    HALMsg decoded;
+    HALDecoder dec;
+    unsigned char frame[HALMSG_FRAME_MAX];
+    unsigned char ref_frame[HALMSG_FRAME_MAX];
+    unsigned int seed = 1;
+
+    HALDecoder_init(&dec, &decoded);
+    for (size_t len=0; len<256; len++){
+        for (int d=0; d<5; d++){
+            random_msg(&msg, len, densities[d], &seed);
+            ASSERT(HALMsg_checksum(&msg) == msg.chk);
+
+            size_t n = HALMsg_encode(&msg, frame);
+            ASSERT(n == ref_encode(&msg, ref_frame));
+            ASSERT(memcmp(frame, ref_frame, n) == 0);
+
+            /* Decode in random chunks */
+            HALDecoderRes res = HALDEC_INCOMPLETE;
+            size_t pos = 0;
+            while (pos < n){
+                size_t chunk = 1 + rand_r(&seed) % 40;
+                size_t consumed;
+                if (chunk > n-pos){
+                    chunk = n-pos;
+                }
+                res = HALDecoder_feed(&dec, frame+pos, chunk, &consumed);
+                pos += consumed;
+            }
+            if (res == HALDEC_HEADER){
+                res = HALDecoder_feed(&dec, frame+pos, 0, &pos);
+            }
+            ASSERT(res == HALDEC_COMPLETE);
+            ASSERT(memcmp(&msg, &decoded, 5+len) == 0);
+        }
+    }
+
+    /* Unaligned sums */
+    unsigned char bytes[1100];
+    for (size_t i=0; i<sizeof(bytes); i++){
+        bytes[i] = rand_r(&seed);
+    }
+    for (size_t offset=0; offset<8; offset++){
+        for (size_t n=0; n+offset<=sizeof(bytes); n += 7){
+            unsigned char ref = 0;
+            for (size_t i=0; i<n; i++){
+                ref += bytes[offset+i];
+            }
+            ASSERT(HALMsg_sum(bytes+offset, n) == ref);
+        }
+    }
+})
+
 SUITE(
-    ADDTEST(checksum))
\ No newline at end of file
+    ADDTEST(checksum),
+    ADDTEST(bulk_kernels),
+    ADDTEST(encode_decode),
+    ADDTEST(decode_errors),
+    ADDTEST(multi_ask))
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "lighttest2.h"
+#include "../capture.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RING_SIZE (256*1024)
+
+static char path[64];
+
+static const char *capture_path(void)
+{
+    snprintf(path, sizeof(path), "/tmp/test_capture-%d.bin", (int) getpid());
+    return path;
+}
+
+static void record_counter(HALCapture *cap, unsigned int i, size_t len)
+{
+    unsigned char bytes[512];
+    memset(bytes, i & 0xff, len);
+    memcpy(bytes, &i, sizeof(i));
+    HALCapture_record(cap, (i%2) ? HALCAP_TX : HALCAP_RX, bytes, len);
+}
+
+TEST(record_load, {
+    HALCapture *cap = HALCapture_open(capture_path(), RING_SIZE);
+    ASSERT(cap != NULL);
+    HALCapture_record(cap, HALCAP_TX, (const unsigned char *) "\xff\xff\xff" "abcde", 8);
+    HALCapture_record(cap, HALCAP_RX, (const unsigned char *) "\xff\xff\xff", 3);
+    HALCapture_close(cap);
+
+    cap = HALCapture_load(path);
+    ASSERT(cap != NULL);
+    ASSERT(HALCapture_header(cap)->n_records == 2);
+
+    HALCaptureRecord rec;
+    const unsigned char *bytes;
+    size_t index = 0;
+    ASSERT(HALCapture_next(cap, &index, &rec, &bytes));
+    ASSERT(rec.dir == HALCAP_TX);
+    ASSERT(rec.len == 8);
+    ASSERT(memcmp(bytes, "\xff\xff\xff" "abcde", 8) == 0);
+    ASSERT(HALCapture_next(cap, &index, &rec, &bytes));
+    ASSERT(rec.dir == HALCAP_RX);
+    ASSERT(rec.len == 3);
+    ASSERT(! HALCapture_next(cap, &index, &rec, &bytes));
+    HALCapture_close(cap);
+
+    unlink(path);
+    ASSERT(HALCapture_load(path) == NULL);
+})
+
+TEST(ring_wrap, {
+    HALCapture *cap = HALCapture_open(capture_path(), RING_SIZE);
+    ASSERT(cap != NULL);
+    for (unsigned int i=0; i<10000; i++){
+        record_counter(cap, i, 20 + (i*7)%480);
+    }
+    const HALCaptureHeader *hdr = HALCapture_header(cap);
+    ASSERT(hdr->total_records == 10000);
+    ASSERT(hdr->n_records > 0);
+    ASSERT(hdr->n_records < 10000);
+
+    /* Only the most recent records are left, in order */
+    HALCaptureRecord rec;
+    const unsigned char *bytes;
+    size_t index = 0;
+    unsigned int expected = 10000 - hdr->n_records;
+    unsigned int i;
+    uint64_t last_ts = 0;
+    while (HALCapture_next(cap, &index, &rec, &bytes)){
+        memcpy(&i, bytes, sizeof(i));
+        ASSERT(i == expected);
+        ASSERT(rec.len == 20 + (i*7)%480);
+        ASSERT(rec.ts >= last_ts);
+        last_ts = rec.ts;
+        expected++;
+    }
+    ASSERT(expected == 10000);
+    PRINT("%lu records left in ring", (unsigned long int) hdr->n_records);
+
+    HALCapture_close(cap);
+    unlink(path);
+})
+
+TEST(no_symlink, {
+    /* A symlink planted in place of the capture is not followed */
+    char target[64];
+    snprintf(target, sizeof(target), "/tmp/test_capture-%d.target", (int) getpid());
+    FILE *f = fopen(target, "w");
+    ASSERT(f != NULL);
+    fputs("precious", f);
+    fclose(f);
+    ASSERT(symlink(target, capture_path()) == 0);
+
+    ASSERT(HALCapture_open(path, RING_SIZE) == NULL);
+    struct stat st;
+    ASSERT(stat(target, &st) == 0);
+    ASSERT(st.st_size == 8);
+
+    unlink(path);
+    unlink(target);
+})
+
+SUITE(
+    ADDTEST(record_load),
+    ADDTEST(ring_wrap),
+    ADDTEST(no_symlink))
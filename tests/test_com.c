@@ -0,0 +1,836 @@
+#include "lighttest2.h"
+#include "halsim.h"
+#include "../com.h"
+#include "../logger.h"
+#include "../metrics.h"
+#include "../eventring.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const HALConnOpts conn_opts = {.baudrate=0, .low_latency=0, .latency_timer=0};
+
+static HALSim *sim = NULL;
+static unsigned int sim_latency = 0;
+static unsigned int sim_answer_limit = 0;
+static unsigned int sim_ping_interval = 50;
+static double sim_truncate_rate = 0;
+
+static HALConnection *connect_sim(unsigned char features, double drop_rate)
+{
+    HALSimOpts opts;
+    memset(&opts, 0, sizeof(opts));
+    current_log_level = WARNING;
+    opts.n_sensors = 8;
+    opts.n_rgbs = 2;
+    opts.n_animations = 1;
+    opts.n_triggers = 2;
+    opts.features = features;
+    opts.drop_rate = drop_rate;
+    opts.ping_interval = sim_ping_interval;
+    opts.truncate_rate = sim_truncate_rate;
+    opts.latency = sim_latency;
+    opts.answer_limit = sim_answer_limit;
+
+    sim = HALSim_start(&opts);
+    if (! sim){
+        return NULL;
+    }
+
+    char sock_path[64];
+    snprintf(sock_path, sizeof(sock_path), "/tmp/test_com-%d.sock", (int) getpid());
+    HALConnection *conn = HALConn_open(HALSim_path(sim), sock_path, &conn_opts);
+    if (conn){
+        HALConn_run_reader(conn, NULL, 0);
+    }
+    return conn;
+}
+
+static HALMsg new_msg(unsigned char cmd, unsigned char rid, unsigned char len)
+{
+    HALMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = cmd;
+    msg.rid = rid;
+    msg.len = len;
+    return msg;
+}
+
+static void disconnect_sim(HALConnection *conn)
+{
+    HALConn_close(conn);
+    HALSim_stop(sim);
+}
+
+TEST(request, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+    HALConn_negotiate(conn);
+
+    HALMsg msg = new_msg(PARAM_ASK|SENSOR, 3, 0);
+    ASSERT(HALConn_request(conn, &msg) == OK);
+    ASSERT(msg.len == 2);
+    ASSERT(((msg.data[0] << 8) | msg.data[1]) == HALSim_sensor_value(3));
+
+    msg.cmd = PARAM_CHANGE|RGB;
+    msg.rid = 1;
+    msg.len = 3;
+    msg.data[0] = 0xff;
+    msg.data[1] = 0xaa;
+    msg.data[2] = 0x00;
+    ASSERT(HALConn_request(conn, &msg) == OK);
+
+    msg.cmd = PARAM_ASK|RGB;
+    msg.len = 0;
+    ASSERT(HALConn_request_flags(conn, &msg, HALCONN_DEVICE_READ) == OK);
+    ASSERT(msg.len == 3);
+    ASSERT(msg.data[0] == 0xff);
+    ASSERT(msg.data[1] == 0xaa);
+    ASSERT(msg.data[2] == 0x00);
+
+    disconnect_sim(conn);
+})
+
+TEST(timeout, {
+    HALConnection *conn = connect_sim(0, 1);
+    ASSERT(conn != NULL);
+
+    HALMsg msg = new_msg(PARAM_ASK|SENSOR, 0, 0);
+    ASSERT(HALConn_request(conn, &msg) == TIMEOUT);
+
+    disconnect_sim(conn);
+})
+
+struct ask_args {
+    HALConnection *conn;
+    unsigned char rid;
+    int ok;
+};
+
+static void *ask_sensor(void *arg)
+{
+    struct ask_args *args = arg;
+    for (int i=0; i<20; i++){
+        HALMsg msg = new_msg(PARAM_ASK|SENSOR, args->rid, 0);
+        if (HALConn_request(args->conn, &msg) == OK &&
+            ((msg.data[0] << 8) | msg.data[1]) == HALSim_sensor_value(args->rid)){
+            args->ok++;
+        }
+    }
+    return NULL;
+}
+
+TEST(shadow, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+
+    /* Unknown yet: asked to the Arduino */
+    HALMsg msg = new_msg(PARAM_ASK|RGB, 1, 0);
+    ASSERT(HALConn_request(conn, &msg) == OK);
+    ASSERT(msg.len == 3);
+    ASSERT(msg.data[2] == HALSim_rgb_value(1, 2));
+    ASSERT(HALConn_shadow_hits(conn) == 0);
+
+    msg = new_msg(PARAM_CHANGE|SWITCH, 0, 1);
+    msg.data[0] = 1;
+    ASSERT(HALConn_request(conn, &msg) == OK);
+
+    /* Known from the change, and from the previous answer */
+    size_t tx_frames = HALConn_tx_frames(conn);
+    msg = new_msg(PARAM_ASK|SWITCH, 0, 0);
+    ASSERT(HALConn_request(conn, &msg) == OK);
+    ASSERT(msg.len == 1);
+    ASSERT(msg.data[0] == 1);
+    msg = new_msg(PARAM_ASK|RGB, 1, 0);
+    ASSERT(HALConn_request(conn, &msg) == OK);
+    ASSERT(msg.data[2] == HALSim_rgb_value(1, 2));
+    ASSERT(HALConn_shadow_hits(conn) == 2);
+
+    /* Sensors are not shadowed */
+    msg = new_msg(PARAM_ASK|SENSOR, 0, 0);
+    ASSERT(HALConn_request(conn, &msg) == OK);
+    ASSERT(HALConn_shadow_hits(conn) == 2);
+
+    msg = new_msg(PARAM_ASK|SWITCH, 0, 0);
+    ASSERT(HALConn_request_flags(conn, &msg, HALCONN_DEVICE_READ) == OK);
+    ASSERT(msg.data[0] == 1);
+    ASSERT(HALConn_shadow_hits(conn) == 2);
+    ASSERT(HALConn_tx_frames(conn) >= tx_frames + 2);
+
+    disconnect_sim(conn);
+})
+
+/* Responses are decoded in the right requester's message */
+TEST(concurrent_requests, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+
+    pthread_t threads[8];
+    struct ask_args args[8];
+    for (int i=0; i<8; i++){
+        args[i].conn = conn;
+        args[i].rid = i;
+        args[i].ok = 0;
+        pthread_create(threads+i, NULL, ask_sensor, args+i);
+    }
+    for (int i=0; i<8; i++){
+        pthread_join(threads[i], NULL);
+        ASSERT(args[i].ok == 20);
+    }
+
+    disconnect_sim(conn);
+})
+
+/* Identical concurrent asks share a single round trip */
+TEST(dedup, {
+    sim_latency = 1000;
+    HALConnection *conn = connect_sim(0, 0);
+    sim_latency = 0;
+    ASSERT(conn != NULL);
+
+    pthread_t threads[8];
+    struct ask_args args[8];
+    for (int i=0; i<8; i++){
+        args[i].conn = conn;
+        args[i].rid = 3;
+        args[i].ok = 0;
+        pthread_create(threads+i, NULL, ask_sensor, args+i);
+    }
+    for (int i=0; i<8; i++){
+        pthread_join(threads[i], NULL);
+        ASSERT(args[i].ok == 20);
+    }
+    PRINT("160 asks in %lu frames, %lu hits", (unsigned long int) HALConn_tx_frames(conn),
+          (unsigned long int) HALConn_dedup_hits(conn));
+    ASSERT(HALConn_dedup_hits(conn) > 0);
+    ASSERT(HALConn_tx_frames(conn) + HALConn_dedup_hits(conn) >= 160);
+    ASSERT(HALConn_tx_frames(conn) < 160);
+
+    disconnect_sim(conn);
+})
+
+TEST(concurrent_multi, {
+    HALConnection *conn = connect_sim(HAL_FEAT_MULTI, 0);
+    ASSERT(conn != NULL);
+    HALConn_negotiate(conn);
+
+    pthread_t threads[8];
+    struct ask_args args[8];
+    for (int i=0; i<8; i++){
+        args[i].conn = conn;
+        args[i].rid = i;
+        args[i].ok = 0;
+        pthread_create(threads+i, NULL, ask_sensor, args+i);
+    }
+    for (int i=0; i<8; i++){
+        pthread_join(threads[i], NULL);
+        ASSERT(args[i].ok == 20);
+    }
+    PRINT("160 asks in %lu frames", (unsigned long int) HALConn_tx_frames(conn));
+    ASSERT(HALConn_tx_frames(conn) < 160);
+
+    disconnect_sim(conn);
+})
+
+TEST(packed_frames, {
+    HALConnection *conn = connect_sim(HAL_FEAT_RLE|HAL_FEAT_DELTA, 0);
+    ASSERT(conn != NULL);
+    HALConn_negotiate(conn);
+
+    unsigned char frames[200];
+    memset(frames, 0x12, sizeof(frames));
+
+    for (int round=0; round<3; round++){
+        frames[10*round] = 0xff;
+
+        HALMsg msg = new_msg(PARAM_CHANGE|ANIMATION_FRAMES, 0, sizeof(frames));
+        memcpy(msg.data, frames, sizeof(frames));
+        ASSERT(HALConn_request(conn, &msg) == OK);
+
+        msg.cmd = PARAM_ASK|ANIMATION_FRAMES;
+        msg.len = 0;
+        ASSERT(HALConn_request_flags(conn, &msg, HALCONN_DEVICE_READ) == OK);
+        ASSERT(msg.len == sizeof(frames));
+        ASSERT(memcmp(msg.data, frames, sizeof(frames)) == 0);
+    }
+
+    disconnect_sim(conn);
+})
+
+static void *upload_frames(void *arg)
+{
+    HALConnection *conn = arg;
+    for (int i=0; i<10; i++){
+        HALMsg msg = new_msg(PARAM_CHANGE|ANIMATION_FRAMES, 0, 255);
+        memset(msg.data, i, 255);
+        HALConn_request(conn, &msg);
+    }
+    return NULL;
+}
+
+static void *toggle_switch(void *arg)
+{
+    HALConnection *conn = arg;
+    for (int i=0; i<10; i++){
+        HALMsg msg = new_msg(PARAM_CHANGE|SWITCH, 0, 1);
+        msg.data[0] = i%2;
+        HALConn_request(conn, &msg);
+    }
+    return NULL;
+}
+
+static int tx_sent(HALConnection *conn, HALTxClass tx_class)
+{
+    HALConnStats stats;
+    HALConn_stats(conn, &stats);
+    return (stats.tx[tx_class].depth == 0) ? (int) stats.tx[tx_class].sent : -1;
+}
+
+TEST(tx_classes, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+
+    pthread_t threads[6];
+    struct ask_args args[2];
+    for (int i=0; i<2; i++){
+        args[i].conn = conn;
+        args[i].rid = i;
+        args[i].ok = 0;
+        pthread_create(threads+i, NULL, ask_sensor, args+i);
+        pthread_create(threads+2+i, NULL, upload_frames, conn);
+        pthread_create(threads+4+i, NULL, toggle_switch, conn);
+    }
+    for (int i=0; i<6; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    ASSERT(tx_sent(conn, HALCONN_TX_READ) == 40);
+    ASSERT(tx_sent(conn, HALCONN_TX_BULK) == 20);
+    ASSERT(tx_sent(conn, HALCONN_TX_INTERACTIVE) == 20);
+    ASSERT(tx_sent(conn, HALCONN_TX_CONTROL) >= 0);
+
+    disconnect_sim(conn);
+})
+
+static size_t encode(unsigned char *dest, unsigned char seq, unsigned char cmd, unsigned char rid, unsigned char data)
+{
+    HALMsg msg = new_msg(cmd, rid, 1);
+    msg.seq = seq;
+    msg.data[0] = data;
+    msg.chk = HALMsg_checksum(&msg);
+    return HALMsg_encode(&msg, dest);
+}
+
+TEST(replay, {
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDWR), "/tmp/test_com_replay.sock", &conn_opts);
+    ASSERT(conn != NULL);
+
+    const char *names[] = {"door"};
+    unsigned char stream[4*HALMSG_FRAME_MAX];
+    size_t len = encode(stream, ARDUINO_SEQ(1), TRIGGER|PARAM_CHANGE, 0, 1);
+    size_t corrupted = len + 4;
+    len += encode(stream+len, ARDUINO_SEQ(2), TRIGGER|PARAM_CHANGE, 0, 0);
+    stream[corrupted] ^= 0x01;
+    len += encode(stream+len, ARDUINO_SEQ(3), TRIGGER|PARAM_CHANGE, 0, 1);
+    stream[len-1] = HALMSG_SYNC;
+    len += encode(stream+len, ARDUINO_SEQ(4), TRIGGER|PARAM_CHANGE, 0, 0);
+
+    /* Messages may span several calls */
+    HALConn_replay(conn, stream, 7, names, 1);
+    HALConn_replay(conn, stream+7, len-7, names, 1);
+    ASSERT(HALConn_rx_frames(conn) == 3);
+    ASSERT(HALConn_events(conn) == 2);
+    ASSERT(HALConn_chk_errors(conn) == 1);
+    ASSERT(HALConn_sync_errors(conn) == 1);
+
+    HALConn_close(conn);
+})
+
+static void sleep_ms(unsigned int msecs)
+{
+    struct timespec delay = {.tv_sec = msecs/1000, .tv_nsec = 1000000l*(msecs%1000)};
+    nanosleep(&delay, NULL);
+}
+
+TEST(heartbeat, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+    HALConn_set_heartbeat(conn, 10);
+    sleep_ms(200);
+
+    HALLinkStats link;
+    HALConn_link_stats(conn, &link);
+    ASSERT(link.sent >= 5);
+    ASSERT(link.lost == 0);
+    ASSERT(! link.degraded);
+    ASSERT(link.rtt_min > 0);
+    ASSERT(link.rtt_min <= link.rtt_avg);
+    ASSERT(link.rtt_avg <= link.rtt_max);
+    /* Heartbeats do not queue behind asks */
+    ASSERT(tx_sent(conn, HALCONN_TX_CONTROL) >= link.sent);
+    ASSERT(tx_sent(conn, HALCONN_TX_READ) == 0);
+    PRINT("rtt %lu/%lu/%lu us, jitter %lu us", link.rtt_min, link.rtt_avg, link.rtt_max, link.jitter);
+
+    disconnect_sim(conn);
+})
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e3*(now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec)/1e6;
+}
+
+TEST(link_degraded, {
+    /* Board stops answering after a few heartbeats */
+    sim_answer_limit = 3;
+    HALConnection *conn = connect_sim(0, 0);
+    sim_answer_limit = 0;
+    ASSERT(conn != NULL);
+    HALConn_set_heartbeat(conn, 10);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HALLinkStats link;
+    HALConn_link_stats(conn, &link);
+    while (! link.degraded && elapsed_ms(&start) < 3000){
+        sleep_ms(10);
+        HALConn_link_stats(conn, &link);
+    }
+    ASSERT(link.degraded);
+    ASSERT(link.lost >= 2);
+    PRINT("Degraded after %.0f ms", elapsed_ms(&start));
+
+    /* Requests fail fast */
+    HALMsg msg = new_msg(PARAM_ASK|SENSOR, 1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT(HALConn_request(conn, &msg) == TIMEOUT);
+    ASSERT(elapsed_ms(&start) < 50);
+
+    disconnect_sim(conn);
+})
+
+TEST(write_error, {
+    /* Writes to a read-only fd fail */
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDONLY), "/tmp/test_com_writeerr.sock", &conn_opts);
+    ASSERT(conn != NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HALMsg msg = new_msg(PARAM_ASK|SENSOR, 1, 0);
+    ASSERT(HALConn_request(conn, &msg) == WRITEERR);
+    ASSERT(elapsed_ms(&start) < 100);
+
+    HALConn_close(conn);
+})
+
+TEST(hedging, {
+    /* One request (or answer) out of 10 is lost */
+    HALConnection *conn = connect_sim(0, 0.1);
+    ASSERT(conn != NULL);
+    HALConn_set_heartbeat(conn, 0);
+    ASSERT(HALConn_hedge_percentile(conn) == 95);
+
+    size_t ok = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<200; i++){
+        HALMsg msg = new_msg(PARAM_ASK|SENSOR, i % 8, 0);
+        if (HALConn_request_flags(conn, &msg, HALCONN_DEVICE_READ) == OK &&
+            ((msg.data[0] << 8) | msg.data[1]) == HALSim_sensor_value(i % 8)){
+            ok++;
+        }
+    }
+    double elapsed = elapsed_ms(&start);
+    ASSERT(HALConn_hedge_delay(conn) >= 1000);
+
+    HALConnStats stats;
+    HALConn_stats(conn, &stats);
+    ASSERT(stats.hedges > 0);
+    ASSERT(stats.hedge_wins > 0);
+    ASSERT(stats.hedge_wins <= stats.hedges);
+    /* Without hedging, about 20 asks would time out */
+    ASSERT(ok >= 190);
+    PRINT("%lu/200 asks answered in %.0f ms; %lu hedged, %lu answered by the copy, delay %lu us",
+          (unsigned long int) ok, elapsed, (unsigned long int) stats.hedges,
+          (unsigned long int) stats.hedge_wins, HALConn_hedge_delay(conn));
+
+    /* Changes are never sent again */
+    size_t hedges = stats.hedges;
+    for (int i=0; i<20; i++){
+        HALMsg change = new_msg(PARAM_CHANGE|SWITCH, 0, 1);
+        change.data[0] = i & 1;
+        HALConn_request(conn, &change);
+    }
+    HALConn_stats(conn, &stats);
+    ASSERT(stats.hedges == hedges);
+
+    HALConn_set_hedge_percentile(conn, 0);
+    ASSERT(HALConn_hedge_delay(conn) == 0);
+
+    disconnect_sim(conn);
+})
+
+TEST(truncated_answers, {
+    /* Nothing follows a truncated answer but the next request */
+    sim_ping_interval = 0;
+    sim_truncate_rate = 0.1;
+    HALConnection *conn = connect_sim(0, 0);
+    sim_ping_interval = 50;
+    sim_truncate_rate = 0;
+    ASSERT(conn != NULL);
+    HALConn_set_heartbeat(conn, 0);
+
+    size_t ok = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<200; i++){
+        HALMsg msg = new_msg(PARAM_ASK|SENSOR, i % 8, 0);
+        if (HALConn_request_flags(conn, &msg, HALCONN_DEVICE_READ) == OK &&
+            ((msg.data[0] << 8) | msg.data[1]) == HALSim_sensor_value(i % 8)){
+            ok++;
+        }
+    }
+    double elapsed = elapsed_ms(&start);
+
+    HALConnStats stats;
+    HALConn_stats(conn, &stats);
+    ASSERT(stats.hedges > 0);
+    ASSERT(ok >= 190);
+    PRINT("%lu/200 asks answered in %.0f ms; %lu hedged",
+          (unsigned long int) ok, elapsed, (unsigned long int) stats.hedges);
+
+    disconnect_sim(conn);
+})
+
+struct changes {
+    size_t n;
+    unsigned char type;
+    unsigned char rid;
+};
+
+static void count_change(void *arg, unsigned char type, unsigned char rid)
+{
+    struct changes *changes = arg;
+    changes->n++;
+    changes->type = type;
+    changes->rid = rid;
+}
+
+TEST(on_change, {
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDWR), "/tmp/test_com_change.sock", &conn_opts);
+    ASSERT(conn != NULL);
+    struct changes changes;
+    memset(&changes, 0, sizeof(changes));
+    HALConn_on_change(conn, count_change, &changes);
+
+    const char *names[] = {"door"};
+    unsigned char stream[HALMSG_FRAME_MAX];
+    size_t len = encode(stream, ARDUINO_SEQ(1), TRIGGER|PARAM_CHANGE, 0, 1);
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(changes.n == 1);
+    ASSERT(changes.type == TRIGGER);
+    ASSERT(changes.rid == 0);
+
+    /* Writable resources: only when the value actually changes */
+    len = encode(stream, ARDUINO_SEQ(2), SWITCH|PARAM_CHANGE, 3, 1);
+    HALConn_replay(conn, stream, len, names, 1);
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(changes.n == 2);
+    ASSERT(changes.type == SWITCH);
+    ASSERT(changes.rid == 3);
+    len = encode(stream, ARDUINO_SEQ(3), SWITCH|PARAM_CHANGE, 3, 0);
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(changes.n == 3);
+
+    /* Not a change */
+    len = encode(stream, ARDUINO_SEQ(4), SWITCH, 3, 0);
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(changes.n == 3);
+
+    HALConn_close(conn);
+})
+
+TEST(buffered_input, {
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    HALConnection *conn = HALConn_open_fd(sv[0], "/tmp/test_com_buffered.sock", &conn_opts);
+    ASSERT(conn != NULL);
+    struct changes changes;
+    memset(&changes, 0, sizeof(changes));
+    HALConn_on_change(conn, count_change, &changes);
+
+    /* The second trigger is buffered when the first one is read */
+    unsigned char stream[2*HALMSG_FRAME_MAX];
+    size_t len = encode(stream, ARDUINO_SEQ(1), TRIGGER|PARAM_CHANGE, 0, 1);
+    len += encode(stream+len, ARDUINO_SEQ(2), TRIGGER|PARAM_CHANGE, 0, 0);
+    ASSERT(write(sv[1], stream, len) == (ssize_t) len);
+    HALMsg msg;
+    ASSERT(HALConn_read_message(conn, &msg) == OK);
+    ASSERT(msg.seq == ARDUINO_SEQ(1));
+
+    /* More input is pending when the reader starts */
+    len = encode(stream, ARDUINO_SEQ(3), TRIGGER|PARAM_CHANGE, 0, 1);
+    ASSERT(write(sv[1], stream, len) == (ssize_t) len);
+    const char *names[] = {"door"};
+    HALConn_run_reader(conn, names, 1);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (HALConn_events(conn) < 2 && elapsed_ms(&start) < 1000){
+        sleep_ms(5);
+    }
+    ASSERT(HALConn_events(conn) == 2);
+    ASSERT(HALConn_event_seq(conn) == 2);
+
+    HALConn_close(conn);
+    close(sv[1]);
+})
+
+TEST(metrics, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+
+    for (int i=0; i<3; i++){
+        HALMsg msg = new_msg(PARAM_ASK|SENSOR, i, 0);
+        ASSERT(HALConn_request(conn, &msg) == OK);
+    }
+
+    HALConnStats stats;
+    HALConn_stats(conn, &stats);
+    ASSERT(stats.requests[OK] == 3);
+    ASSERT(stats.requests[TIMEOUT] == 0);
+    ASSERT(stats.tx_by_cmd[PARAM_ASK|SENSOR] == 3);
+    ASSERT(stats.rx_by_cmd[PARAM_ASK|SENSOR] == 3);
+    ASSERT(stats.latency_sum > 0);
+    size_t n_latencies = 0;
+    for (int i=0; i<HALCONN_LATENCY_BUCKETS; i++){
+        n_latencies += stats.latency[i];
+    }
+    ASSERT(n_latencies == 3);
+
+    HALFSStats fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.calls[HALFS_OP_READ] = 5;
+    fs.errors[HALFS_OP_READ] = 1;
+
+    char text[16384];
+    size_t len = HALMetrics_render(&stats, &fs, text, sizeof(text));
+    ASSERT(len > 0 && len < sizeof(text));
+    ASSERT(strstr(text, "hal_requests_total{result=\"OK\"} 3\n") != NULL);
+    ASSERT(strstr(text, "hal_tx_frames_total{cmd=\"C\",change=\"0\"} 3\n") != NULL);
+    ASSERT(strstr(text, "hal_request_duration_seconds_bucket{le=\"+Inf\"} 3\n") != NULL);
+    ASSERT(strstr(text, "hal_request_duration_seconds_count 3\n") != NULL);
+    ASSERT(strstr(text, "hal_fuse_errors_total{op=\"read\"} 1\n") != NULL);
+    ASSERT(strstr(text, "# TYPE hal_rx_bytes_total counter\n") != NULL);
+
+    /* Same length, even if truncated */
+    char small[64];
+    ASSERT(HALMetrics_render(&stats, &fs, small, sizeof(small)) == len);
+    ASSERT(strlen(small) == sizeof(small) - 1);
+
+    disconnect_sim(conn);
+})
+
+#define JOURNAL_SOCK "/tmp/test_com_journal.sock"
+
+static int connect_listener(const char *request)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, JOURNAL_SOCK);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    if (request){
+        send(fd, request, strlen(request), 0);
+    }
+    return fd;
+}
+
+/* Read what the listener received so far; drop timestamps of sequenced events */
+static const char *received(int fd)
+{
+    static char text[1024];
+    char buf[1024];
+    size_t len = 0;
+    struct pollfd polled = {.fd = fd, .events = POLLIN};
+    while (poll(&polled, 1, 50) > 0){
+        ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r <= 0){
+            break;
+        }
+        len += r;
+    }
+    buf[len] = '\0';
+
+    text[0] = '\0';
+    for (char *line=strtok(buf, "\n"); line; line=strtok(NULL, "\n")){
+        unsigned long int seq;
+        char name[64];
+        if (sscanf(line, "%lu %*u.%*u %63s", &seq, name) == 2){
+            snprintf(text + strlen(text), sizeof(text) - strlen(text), "%lu %s\n", seq, name);
+        } else {
+            snprintf(text + strlen(text), sizeof(text) - strlen(text), "%s\n", line);
+        }
+    }
+    return text;
+}
+
+TEST(journal, {
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDWR), JOURNAL_SOCK, &conn_opts);
+    ASSERT(conn != NULL);
+    ASSERT(HALConn_event_seq(conn) == 0);
+
+    const char *names[] = {"door"};
+    unsigned char stream[4*HALMSG_FRAME_MAX];
+    size_t len = 0;
+    for (int i=0; i<3; i++){
+        len += encode(stream+len, ARDUINO_SEQ(i), TRIGGER|PARAM_CHANGE, 0, (i+1) % 2);
+    }
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(HALConn_event_seq(conn) == 3);
+
+    /* Late listeners: resume, or get live events only */
+    int legacy = connect_listener(NULL);
+    int resumed = connect_listener("SINCE 1\n");
+    int restarted = connect_listener("SINCE 12\n");
+    ASSERT(legacy >= 0 && resumed >= 0 && restarted >= 0);
+    HALConn_replay(conn, stream, 0, names, 1);
+    ASSERT(strcmp(received(resumed), "2 door:0\n3 door:1\n") == 0);
+    ASSERT(strcmp(received(restarted), "lost\n1 door:1\n2 door:0\n3 door:1\n") == 0);
+    ASSERT(strcmp(received(legacy), "") == 0);
+
+    len = encode(stream, ARDUINO_SEQ(3), TRIGGER|PARAM_CHANGE, 0, 0);
+    HALConn_replay(conn, stream, len, names, 1);
+    ASSERT(strcmp(received(legacy), "door:0\n") == 0);
+    ASSERT(strcmp(received(resumed), "4 door:0\n") == 0);
+
+    /* Request split across reads */
+    int split = connect_listener("SIN");
+    ASSERT(split >= 0);
+    HALConn_replay(conn, stream, 0, names, 1);
+    ASSERT(strcmp(received(split), "") == 0);
+    send(split, "CE 2\n", 5, 0);
+    HALConn_replay(conn, stream, 0, names, 1);
+    ASSERT(strcmp(received(split), "3 door:1\n4 door:0\n") == 0);
+
+    close(legacy);
+    close(resumed);
+    close(restarted);
+    close(split);
+    HALConn_close(conn);
+})
+
+TEST(event_ring, {
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDWR), "/tmp/test_com_ring.sock", &conn_opts);
+    ASSERT(conn != NULL);
+    char ring_path[64];
+    snprintf(ring_path, sizeof(ring_path), "/test_com-%d", (int) getpid());
+    ASSERT(HALConn_start_ring(conn, ring_path, 64));
+    char buf[64];
+    ASSERT(HALConn_ring_name(conn, buf, sizeof(buf)) > 0 && strcmp(buf, ring_path) == 0);
+
+    HALRing *ring = HALRing_attach(ring_path);
+    ASSERT(ring != NULL);
+
+    const char *names[] = {"door"};
+    unsigned char stream[4*HALMSG_FRAME_MAX];
+    size_t len = encode(stream, ARDUINO_SEQ(1), TRIGGER|PARAM_CHANGE, 0, 1);
+    len += encode(stream+len, ARDUINO_SEQ(2), SWITCH|PARAM_CHANGE, 3, 1);
+    HALConn_replay(conn, stream, len, names, 1);
+
+    uint64_t cursor = 0;
+    HALRingEvent event;
+    ASSERT(HALRing_next(ring, &cursor, &event) == 1);
+    ASSERT(event.type == TRIGGER && event.rid == 0 && event.len == 1 && event.data[0] == 1);
+    ASSERT(HALRing_next(ring, &cursor, &event) == 1);
+    ASSERT(event.type == SWITCH && event.rid == 3 && event.data[0] == 1);
+    ASSERT(HALRing_next(ring, &cursor, &event) == 0);
+
+    HALConn_stop_ring(conn);
+    ASSERT(HALConn_ring_name(conn, buf, sizeof(buf)) == 0);
+    HALRing_close(ring);
+    HALConn_close(conn);
+})
+
+TEST(sched, {
+    HALConnOpts sched_opts = conn_opts;
+    sched_opts.cpus = "0";
+    HALConnection *conn = HALConn_open_fd(open("/dev/null", O_RDWR), "/tmp/test_com_sched.sock", &sched_opts);
+    ASSERT(conn != NULL);
+
+    char text[512];
+    int len = HALConn_sched(conn, text, sizeof(text));
+    ASSERT(len > 0 && (size_t) len < sizeof(text));
+    ASSERT(strstr(text, "writer policy=other priority=0 cpus=0\n") != NULL);
+    ASSERT(strstr(text, "mlock=0\n") != NULL);
+    HALConn_close(conn);
+
+    /* Invalid CPU lists are ignored */
+    sched_opts.cpus = "1-0";
+    conn = HALConn_open_fd(open("/dev/null", O_RDWR), "/tmp/test_com_sched.sock", &sched_opts);
+    ASSERT(conn != NULL);
+    HALConn_close(conn);
+})
+
+TEST(sampling, {
+    HALConnection *conn = connect_sim(0, 0);
+    ASSERT(conn != NULL);
+    ASSERT(HALConn_history(conn, 3) == NULL);
+    ASSERT(HALConn_set_history(conn, 3, 1));
+    HALHistory *history = HALConn_history(conn, 3);
+    ASSERT(history != NULL);
+
+    HALConn_set_sampling(conn, 10);
+    sleep_ms(200);
+    HALConn_set_sampling(conn, 0);
+
+    HALHistoryStats stats;
+    HALHistory_stats(history, &stats);
+    PRINT("%lu samples in 200ms", (unsigned long int) stats.count);
+    ASSERT(stats.count >= 10 && stats.count <= 21);
+    ASSERT(stats.min == HALSim_sensor_value(3));
+    ASSERT(stats.max == HALSim_sensor_value(3));
+
+    HALSample samples[32];
+    size_t n = HALHistory_samples(history, samples, 32);
+    ASSERT(n == stats.count);
+    ASSERT(samples[n-1].ts > samples[0].ts);
+
+    /* Stopped history keeps its samples */
+    ASSERT(HALConn_set_history(conn, 3, 0));
+    ASSERT(HALConn_history(conn, 3) == history);
+
+    disconnect_sim(conn);
+})
+
+SUITE(
+    ADDTEST(request),
+    ADDTEST(timeout),
+    ADDTEST(shadow),
+    ADDTEST(concurrent_requests),
+    ADDTEST(dedup),
+    ADDTEST(concurrent_multi),
+    ADDTEST(packed_frames),
+    ADDTEST(tx_classes),
+    ADDTEST(replay),
+    ADDTEST(on_change),
+    ADDTEST(heartbeat),
+    ADDTEST(link_degraded),
+    ADDTEST(write_error),
+    ADDTEST(hedging),
+    ADDTEST(truncated_answers),
+    ADDTEST(buffered_input),
+    ADDTEST(metrics),
+    ADDTEST(journal),
+    ADDTEST(event_ring),
+    ADDTEST(sched),
+    ADDTEST(sampling))
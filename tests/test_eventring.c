@@ -0,0 +1,172 @@
+#include "lighttest2.h"
+#include "../eventring.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define N_WRITES 200000
+
+static char name[64];
+static int writing = 1;
+
+static const char *ring_name(void)
+{
+    snprintf(name, sizeof(name), "/test_eventring-%d", (int) getpid());
+    return name;
+}
+
+static void publish_counter(HALRing *ring, uint32_t i)
+{
+    HALRing_publish(ring, 'T', i & 0xff, (const unsigned char *) &i, sizeof(i));
+}
+
+TEST(publish_next, {
+    HALRing *writer = HALRing_create(ring_name(), 10);
+    ASSERT(writer != NULL);
+    ASSERT(HALRing_header(writer)->capacity == 16);
+
+    HALRing *reader = HALRing_attach(name);
+    ASSERT(reader != NULL);
+    uint64_t cursor = 0;
+    HALRingEvent event;
+    ASSERT(HALRing_next(reader, &cursor, &event) == 0);
+    ASSERT(HALRing_wait(reader, cursor, 10) == 0);
+
+    for (uint32_t i=1; i<=3; i++){
+        publish_counter(writer, i);
+    }
+    ASSERT(HALRing_wait(reader, cursor, 0) == 1);
+    uint32_t value;
+    for (uint32_t i=1; i<=3; i++){
+        ASSERT(HALRing_next(reader, &cursor, &event) == 1);
+        memcpy(&value, event.data, sizeof(value));
+        ASSERT(event.seq == i && value == i);
+        ASSERT(event.type == 'T' && event.rid == i && event.len == 4);
+    }
+    ASSERT(HALRing_next(reader, &cursor, &event) == 0);
+
+    /* A late reader gets the most recent events, with a gap in seq */
+    for (uint32_t i=4; i<=40; i++){
+        publish_counter(writer, i);
+    }
+    ASSERT(HALRing_next(reader, &cursor, &event) == 1);
+    ASSERT(event.seq == 25);
+    ASSERT(HALRing_head(reader) == 40);
+
+    HALRing_close(reader);
+    HALRing_close(writer);
+    ASSERT(HALRing_attach(name) == NULL);
+})
+
+static void *publish_later(void *arg)
+{
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 20000000};
+    nanosleep(&delay, NULL);
+    publish_counter(arg, 1);
+    return NULL;
+}
+
+TEST(wait_wakeup, {
+    HALRing *writer = HALRing_create(ring_name(), 16);
+    HALRing *reader = HALRing_attach(name);
+    pthread_t thread;
+    pthread_create(&thread, NULL, publish_later, writer);
+    ASSERT(HALRing_wait(reader, 0, 5000) == 1);
+    pthread_join(thread, NULL);
+    ASSERT(HALRing_waiters(reader) == 0);
+
+    HALRing_close(reader);
+    HALRing_close(writer);
+})
+
+static void *write_events(void *arg)
+{
+    for (uint32_t i=1; i<=N_WRITES; i++){
+        publish_counter(arg, i);
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+TEST(concurrent_reads, {
+    HALRing *writer = HALRing_create(ring_name(), 256);
+    HALRing *reader = HALRing_attach(name);
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_events, writer);
+
+    /* Events read are never torn, and always in order */
+    uint64_t cursor = 0;
+    uint64_t n = 0;
+    uint64_t last = 0;
+    int consistent = 1;
+    HALRingEvent event;
+    uint32_t value;
+    int more = 1;
+    while (more){
+        more = __atomic_load_n(&writing, __ATOMIC_ACQUIRE);
+        while (HALRing_next(reader, &cursor, &event)){
+            memcpy(&value, event.data, sizeof(value));
+            consistent &= (value == event.seq && event.rid == (event.seq & 0xff));
+            consistent &= (event.seq > last);
+            last = event.seq;
+            n++;
+        }
+    }
+    ASSERT(last == N_WRITES);
+    pthread_join(thread, NULL);
+    ASSERT(consistent);
+    PRINT("%lu events read of %d", (unsigned long int) n, N_WRITES);
+
+    HALRing_close(reader);
+    HALRing_close(writer);
+})
+
+TEST(shared_header_ignored, {
+    HALRing *writer = HALRing_create(ring_name(), 16);
+    HALRing *reader = HALRing_attach(name);
+    ASSERT(writer != NULL && reader != NULL);
+
+    /* Someone tampers with the header: the writer keeps its own view */
+    int fd = shm_open(name, O_RDWR, 0);
+    ASSERT(fd >= 0);
+    HALRingHeader *hdr = mmap(NULL, sizeof(HALRingHeader), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    ASSERT(hdr != MAP_FAILED);
+    hdr->capacity = UINT32_MAX;
+    hdr->head = 1ull << 40;
+    munmap(hdr, sizeof(HALRingHeader));
+
+    for (uint32_t i=1; i<=20; i++){
+        publish_counter(writer, i);
+    }
+    ASSERT(HALRing_head(writer) == 20);
+    uint64_t cursor = 0;
+    HALRingEvent event;
+    ASSERT(HALRing_next(reader, &cursor, &event) == 1);
+    ASSERT(event.seq == 5);
+
+    HALRing_close(reader);
+    HALRing_close(writer);
+})
+
+TEST(replace_stale, {
+    /* Left by a previous writer of ours */
+    int fd = shm_open(ring_name(), O_RDWR|O_CREAT, 0600);
+    ASSERT(fd >= 0);
+    close(fd);
+
+    HALRing *writer = HALRing_create(name, 16);
+    ASSERT(writer != NULL);
+    HALRing *reader = HALRing_attach(name);
+    ASSERT(reader != NULL);
+    HALRing_close(reader);
+    HALRing_close(writer);
+})
+
+SUITE(
+    ADDTEST(publish_next),
+    ADDTEST(wait_wakeup),
+    ADDTEST(concurrent_reads),
+    ADDTEST(shared_header_ignored),
+    ADDTEST(replace_stale))
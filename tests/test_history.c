@@ -0,0 +1,109 @@
+#include "lighttest2.h"
+#include "../history.h"
+#include <pthread.h>
+
+#define N_WRITES 200000
+
+static int writing = 1;
+
+static const unsigned int values[] = {500, 100, 900, 300, 200, 700};
+
+TEST(samples_order, {
+    HALHistory *history = HALHistory_create(8);
+    ASSERT(history != NULL);
+    HALSample samples[16];
+    ASSERT(HALHistory_samples(history, samples, 16) == 0);
+
+    for (unsigned int i=0; i<5; i++){
+        HALHistory_add(history, 1000+i, i);
+    }
+    ASSERT(HALHistory_samples(history, samples, 16) == 5);
+    ASSERT(samples[0].value == 0 && samples[0].ts == 1000);
+    ASSERT(samples[4].value == 4 && samples[4].ts == 1004);
+
+    /* Only the last 8 samples are kept */
+    for (unsigned int i=5; i<20; i++){
+        HALHistory_add(history, 1000+i, i);
+    }
+    ASSERT(HALHistory_samples(history, samples, 16) == 8);
+    ASSERT(samples[0].value == 12);
+    ASSERT(samples[7].value == 19);
+    ASSERT(HALHistory_samples(history, samples, 3) == 3);
+    ASSERT(samples[0].value == 17);
+
+    HALHistory_destroy(history);
+})
+
+TEST(aggregates, {
+    HALHistory *history = HALHistory_create(4);
+    HALHistoryStats stats;
+    HALHistory_stats(history, &stats);
+    ASSERT(stats.count == 0);
+
+    double ewma = values[0];
+    for (int i=0; i<6; i++){
+        HALHistory_add(history, i, values[i]);
+        if (i > 0){
+            ewma += HALHISTORY_EWMA_WEIGHT * (values[i] - ewma);
+        }
+    }
+
+    /* Over all samples, not only those left in the ring */
+    HALHistory_stats(history, &stats);
+    ASSERT(stats.count == 6);
+    ASSERT(stats.min == 100);
+    ASSERT(stats.max == 900);
+    ASSERT(stats.last == 700);
+    ASSERT(stats.mean == 450);
+    ASSERT(stats.ewma > ewma - 1e-9 && stats.ewma < ewma + 1e-9);
+
+    HALHistory_destroy(history);
+})
+
+static void *write_samples(void *arg)
+{
+    HALHistory *history = arg;
+    for (unsigned int i=1; i<=N_WRITES; i++){
+        HALHistory_add(history, 2*i, i);
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+TEST(concurrent_reads, {
+    HALHistory *history = HALHistory_create(64);
+    pthread_t writer;
+    pthread_create(&writer, NULL, write_samples, history);
+
+    /* Samples read are never torn, and always in order */
+    HALSample samples[64];
+    HALHistoryStats stats;
+    size_t reads = 0;
+    int consistent = 1;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)){
+        size_t n = HALHistory_samples(history, samples, 64);
+        for (size_t i=0; i<n; i++){
+            consistent &= (samples[i].ts == 2*samples[i].value);
+            consistent &= (i == 0 || samples[i].value > samples[i-1].value);
+        }
+        HALHistory_stats(history, &stats);
+        consistent &= (stats.count == stats.max && stats.last == stats.max);
+        consistent &= (stats.count == 0 || stats.min == 1);
+        reads++;
+    }
+    pthread_join(writer, NULL);
+    ASSERT(consistent);
+    PRINT("%lu reads during writes", (unsigned long int) reads);
+
+    HALHistory_stats(history, &stats);
+    ASSERT(stats.count == N_WRITES);
+    ASSERT(HALHistory_samples(history, samples, 64) == 64);
+    ASSERT(samples[63].value == N_WRITES);
+
+    HALHistory_destroy(history);
+})
+
+SUITE(
+    ADDTEST(samples_order),
+    ADDTEST(aggregates),
+    ADDTEST(concurrent_reads))
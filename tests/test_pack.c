@@ -0,0 +1,70 @@
+#include "lighttest2.h"
+#include "../pack.h"
+
+TEST(rle_runs, {
+    unsigned char frames[200];
+    unsigned char packed[255];
+    unsigned char unpacked[255];
+    memset(frames, 0x42, 100);
+    memset(frames+100, 0xff, 100);
+
+    size_t len = HALPack_rle(frames, 200, packed, sizeof(packed));
+    ASSERT(len == 4);
+    ASSERT(HALPack_unrle(packed, len, unpacked, sizeof(unpacked)) == 200);
+    ASSERT(memcmp(frames, unpacked, 200) == 0);
+})
+
+TEST(rle_literals, {
+    unsigned char frames[255];
+    unsigned char packed[300];
+    unsigned char unpacked[255];
+    for (int i=0; i<255; i++){
+        frames[i] = i;
+    }
+    frames[10] = frames[11] = frames[12] = 0xaa;
+
+    size_t len = HALPack_rle(frames, 255, packed, sizeof(packed));
+    ASSERT(len > 0);
+    ASSERT(HALPack_unrle(packed, len, unpacked, sizeof(unpacked)) == 255);
+    ASSERT(memcmp(frames, unpacked, 255) == 0);
+
+    /* Does not fit */
+    ASSERT(HALPack_rle(frames, 255, packed, 255) == 0);
+})
+
+TEST(unrle_malformed, {
+    unsigned char unpacked[10];
+    ASSERT(HALPack_unrle((const unsigned char *) "\x05" "ab", 3, unpacked, 10) == 0);
+    ASSERT(HALPack_unrle((const unsigned char *) "\xf0", 1, unpacked, 10) == 0);
+    ASSERT(HALPack_unrle((const unsigned char *) "\xf0" "a", 2, unpacked, 10) == 0);
+})
+
+TEST(delta_pack, {
+    unsigned char prev[100];
+    unsigned char frames[120];
+    unsigned char delta[120];
+    unsigned char restored[120];
+    for (int i=0; i<100; i++){
+        prev[i] = frames[i] = 3*i;
+    }
+    for (int i=100; i<120; i++){
+        frames[i] = i;
+    }
+    frames[50] = 0;
+
+    HALPack_delta(prev, 100, frames, 120, delta);
+    ASSERT(delta[0] == 0);
+    ASSERT(delta[49] == 0);
+    ASSERT(delta[51] == 0);
+    ASSERT(delta[50] == 150);
+    ASSERT(delta[110] == 110);
+
+    HALPack_delta(prev, 100, delta, 120, restored);
+    ASSERT(memcmp(frames, restored, 120) == 0);
+})
+
+SUITE(
+    ADDTEST(rle_runs),
+    ADDTEST(rle_literals),
+    ADDTEST(unrle_malformed),
+    ADDTEST(delta_pack))
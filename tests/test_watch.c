@@ -0,0 +1,68 @@
+#include "lighttest2.h"
+#include "../watch.h"
+#include "../HALMsg.h"
+
+static int notified = 0;
+
+static void notify(void *handle)
+{
+    (*(int *) handle)++;
+    notified++;
+}
+
+TEST(unwatched, {
+    ASSERT(HALWatch_open(SENSOR, 0) == NULL);
+})
+
+TEST(readable_after_change, {
+    HALWatcher *watcher = HALWatch_open(TRIGGER, 1);
+    ASSERT(watcher != NULL);
+    ASSERT(HALWatch_poll(watcher, NULL) == 0);
+
+    /* Changes of other resources do not count */
+    HALWatch_changed(TRIGGER, 2, notify);
+    HALWatch_changed(SWITCH, 1, notify);
+    ASSERT(HALWatch_poll(watcher, NULL) == 0);
+
+    HALWatch_changed(TRIGGER, 1, notify);
+    ASSERT(HALWatch_poll(watcher, NULL) == 1);
+    ASSERT(HALWatch_poll(watcher, NULL) == 1);
+
+    /* Not readable again once read */
+    HALWatch_seen(watcher);
+    ASSERT(HALWatch_poll(watcher, NULL) == 0);
+
+    HALWatch_close(watcher);
+})
+
+TEST(wakeup, {
+    HALWatcher *watcher = HALWatch_open(RGB, 3);
+    HALWatcher *other = HALWatch_open(RGB, 3);
+    ASSERT(watcher != NULL && other != NULL);
+    int handle = 0;
+    notified = 0;
+
+    ASSERT(HALWatch_poll(watcher, &handle) == 0);
+    HALWatch_changed(RGB, 3, notify);
+    ASSERT(handle == 1);
+
+    /* Notified handles are forgotten */
+    HALWatch_changed(RGB, 3, notify);
+    ASSERT(handle == 1);
+
+    /* Each open file has its own last read value */
+    HALWatch_seen(watcher);
+    ASSERT(HALWatch_poll(watcher, &handle) == 0);
+    ASSERT(HALWatch_poll(other, NULL) == 1);
+    HALWatch_forget(notify);
+    ASSERT(handle == 2);
+    ASSERT(notified == 2);
+
+    HALWatch_close(watcher);
+    HALWatch_close(other);
+})
+
+SUITE(
+    ADDTEST(unwatched),
+    ADDTEST(readable_after_change),
+    ADDTEST(wakeup))
@@ -0,0 +1,123 @@
+#include "watch.h"
+#include "HALMsg.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define HAL_WATCH_TYPES 3
+
+struct HALWatcher {
+    int type;
+    unsigned char rid;
+    unsigned long int seen; /* Generation last read */
+};
+
+struct HALPoller {
+    void *handle;
+    int type;
+    unsigned char rid;
+    struct HALPoller *next;
+};
+
+/* Generations are changed, and pollers registered, with the lock held: a
+   change cannot happen between a poll check and its registration */
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long int watch_gen[HAL_WATCH_TYPES][256];
+static struct HALPoller *pollers = NULL;
+
+static int watch_index(unsigned char type)
+{
+    switch (type){
+        case TRIGGER: return 0;
+        case SWITCH:  return 1;
+        case RGB:     return 2;
+        default:      return -1;
+    }
+}
+
+static unsigned long int generation(int type, unsigned char rid)
+{
+    return __atomic_load_n(&watch_gen[type][rid], __ATOMIC_ACQUIRE);
+}
+
+HALWatcher *HALWatch_open(unsigned char type, unsigned char rid)
+{
+    int w = watch_index(type);
+    if (w < 0){
+        return NULL;
+    }
+    HALWatcher *res = malloc(sizeof(HALWatcher));
+    if (! res){
+        return NULL;
+    }
+    res->type = w;
+    res->rid = rid;
+    res->seen = generation(w, rid);
+    return res;
+}
+
+void HALWatch_close(HALWatcher *watcher)
+{
+    free(watcher);
+}
+
+void HALWatch_seen(HALWatcher *watcher)
+{
+    watcher->seen = generation(watcher->type, watcher->rid);
+}
+
+int HALWatch_poll(HALWatcher *watcher, void *handle)
+{
+    int res = 0;
+    pthread_mutex_lock(&watch_mutex);
+    if (generation(watcher->type, watcher->rid) != watcher->seen){
+        res = 1;
+    } else if (handle){
+        struct HALPoller *poller = malloc(sizeof(struct HALPoller));
+        if (poller){
+            poller->handle = handle;
+            poller->type = watcher->type;
+            poller->rid = watcher->rid;
+            poller->next = pollers;
+            pollers = poller;
+        } else {
+            res = 1;
+        }
+    }
+    pthread_mutex_unlock(&watch_mutex);
+    return res;
+}
+
+void HALWatch_changed(unsigned char type, unsigned char rid, HALWatchNotify notify)
+{
+    int w = watch_index(type);
+    if (w < 0){
+        return;
+    }
+
+    pthread_mutex_lock(&watch_mutex);
+    __atomic_add_fetch(&watch_gen[w][rid], 1, __ATOMIC_RELEASE);
+    struct HALPoller **it = &pollers;
+    while (*it){
+        struct HALPoller *poller = *it;
+        if (poller->type == w && poller->rid == rid){
+            notify(poller->handle);
+            *it = poller->next;
+            free(poller);
+        } else {
+            it = &poller->next;
+        }
+    }
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+void HALWatch_forget(HALWatchNotify release)
+{
+    pthread_mutex_lock(&watch_mutex);
+    while (pollers){
+        struct HALPoller *next = pollers->next;
+        release(pollers->handle);
+        free(pollers);
+        pollers = next;
+    }
+    pthread_mutex_unlock(&watch_mutex);
+}
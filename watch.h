@@ -0,0 +1,48 @@
+#ifndef DEFINE_WATCH_HEADER
+#define DEFINE_WATCH_HEADER
+
+/*
+ *  Changes of watched resources (triggers, switches, colors), for poll() on
+ *  their files. Each change of a resource increments its generation. An open
+ *  file has its own HALWatcher, which remembers the generation it last read:
+ *  the file is readable when the resource changed since then. Poll handles
+ *  of files that are not readable yet are kept, and notified (then
+ *  forgotten) on the next change of their resource.
+ */
+
+/* Called with a poll handle when it should be woken up, or forgotten */
+typedef void (* HALWatchNotify)(void *handle);
+
+typedef struct HALWatcher HALWatcher;
+
+/*!
+ *  Watch resource (type, rid) for an open file; the current value counts as
+ *  read. Return NULL if type is not watched, or on allocation failure.
+ */
+HALWatcher *HALWatch_open(unsigned char type, unsigned char rid);
+void HALWatch_close(HALWatcher *watcher);
+
+/*!
+ *  The file is about to read the value of its resource
+ */
+void HALWatch_seen(HALWatcher *watcher);
+
+/*!
+ *  Return 1 if the resource changed since the file last read it. Otherwise
+ *  keep handle (if not NULL) to be notified on the next change, and return
+ *  0. A handle that cannot be kept is reported as changed (1): the caller
+ *  keeps ownership of handle whenever 1 is returned.
+ */
+int HALWatch_poll(HALWatcher *watcher, void *handle);
+
+/*!
+ *  Resource (type, rid) changed: notify and forget the handles waiting for it
+ */
+void HALWatch_changed(unsigned char type, unsigned char rid, HALWatchNotify notify);
+
+/*!
+ *  Forget all waiting handles, calling release on each
+ */
+void HALWatch_forget(HALWatchNotify release);
+
+#endif